@@ -5,7 +5,10 @@
  * By Scott Pakin <pakin@lanl.gov>
  *    Pat McCormick <pat@lanl.gov>
  */
+#include <sched.h>
 #include <sstream>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "byfl.h"
 
@@ -23,11 +26,26 @@ typedef enum {
 } bb_end_t;
 
 
-// Encapsulate of all of our counters into a single structure.
+// Encapsulate of all of our counters into a single structure.  The
+// large arrays needed only by -bf-types and -bf-inst-mix are allocated
+// separately and only when those options are in effect, which keeps
+// the per-function and per-call-path records small.
 class ByteFlopCounters {
+private:
+  // Allocate an array of counters and initialize it either to zero or
+  // to a copy of another array.
+  static uint64_t* new_side_array (size_t num_elts, const uint64_t* initial_values) {
+    uint64_t* side_array = new uint64_t[num_elts];
+    if (initial_values == NULL)
+      memset(side_array, 0, num_elts*sizeof(uint64_t));
+    else
+      memcpy(side_array, initial_values, num_elts*sizeof(uint64_t));
+    return side_array;
+  }
+
 public:
-  uint64_t mem_insts[NUM_MEM_INSTS];  // Number of memory instructions by type
-  uint64_t inst_mix_histo[NUM_OPCODES];   // Histogram of instruction mix
+  uint64_t* mem_insts;                // Number of memory instructions by type (NULL without -bf-types)
+  uint64_t* inst_mix_histo;           // Histogram of instruction mix (NULL without -bf-inst-mix)
   uint64_t terminators[BF_END_BB_NUM];    // Tally of basic-block terminator types
   uint64_t mem_intrinsics[BF_NUM_MEM_INTRIN];  // Tallies of data movement performed by memory intrinsics
   uint64_t loads;                     // Number of bytes loaded
@@ -52,25 +70,12 @@ public:
                     uint64_t initial_fp_bits=0,
                     uint64_t initial_ops=0,
                     uint64_t initial_op_bits=0) {
-    // Initialize mem_insts only if -bf-types was specified.
-    if (bf_types) {
-      if (initial_mem_insts == NULL)
-        for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-          mem_insts[i] = 0;
-      else
-        for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-          mem_insts[i] = initial_mem_insts[i];
-    }
+    // Allocate mem_insts only if -bf-types was specified.
+    mem_insts = bf_types ? new_side_array(NUM_MEM_INSTS, initial_mem_insts) : NULL;
 
-    // Initialize inst_mix_histo only if -bf-inst-mix was specified.
-    if (bf_tally_inst_mix) {
-      if (initial_inst_mix_histo == NULL)
-        for (size_t i = 0; i < NUM_OPCODES; i++)
-          inst_mix_histo[i] = 0;
-      else
-        for(size_t i = 0; i < NUM_OPCODES; i++)
-          inst_mix_histo[i] = initial_inst_mix_histo[i];
-    }
+    // Allocate inst_mix_histo only if -bf-inst-mix was specified.
+    inst_mix_histo =
+      bf_tally_inst_mix ? new_side_array(NUM_OPCODES, initial_inst_mix_histo) : NULL;
 
     // Unconditionally initialize everything else.
     if (initial_terminators == NULL)
@@ -95,6 +100,52 @@ public:
     op_bits  = initial_op_bits;
   }
 
+  // Copy another set of counters, including its side arrays.
+  ByteFlopCounters (const ByteFlopCounters& other) {
+    mem_insts = NULL;
+    inst_mix_histo = NULL;
+    *this = other;
+  }
+
+  // Overwrite our counters with another set of counters.
+  ByteFlopCounters& operator= (const ByteFlopCounters& other) {
+    if (this == &other)
+      return *this;
+    if (other.mem_insts == NULL) {
+      delete[] mem_insts;
+      mem_insts = NULL;
+    }
+    else if (mem_insts == NULL)
+      mem_insts = new_side_array(NUM_MEM_INSTS, other.mem_insts);
+    else
+      memcpy(mem_insts, other.mem_insts, NUM_MEM_INSTS*sizeof(uint64_t));
+    if (other.inst_mix_histo == NULL) {
+      delete[] inst_mix_histo;
+      inst_mix_histo = NULL;
+    }
+    else if (inst_mix_histo == NULL)
+      inst_mix_histo = new_side_array(NUM_OPCODES, other.inst_mix_histo);
+    else
+      memcpy(inst_mix_histo, other.inst_mix_histo, NUM_OPCODES*sizeof(uint64_t));
+    memcpy(terminators, other.terminators, sizeof(terminators));
+    memcpy(mem_intrinsics, other.mem_intrinsics, sizeof(mem_intrinsics));
+    loads     = other.loads;
+    stores    = other.stores;
+    load_ins  = other.load_ins;
+    store_ins = other.store_ins;
+    flops     = other.flops;
+    fp_bits   = other.fp_bits;
+    ops       = other.ops;
+    op_bits   = other.op_bits;
+    return *this;
+  }
+
+  // Free our side arrays.
+  ~ByteFlopCounters() {
+    delete[] mem_insts;
+    delete[] inst_mix_histo;
+  }
+
   // Accumulate new values into our counters.
   void accumulate (uint64_t* more_mem_insts,
                    uint64_t* more_inst_mix_histo,
@@ -160,6 +211,35 @@ public:
     op_bits   += other->op_bits;
   }
 
+  // Add a multiple of a single counter, identified by a BF_BBF_*
+  // value, to our counters.
+  void accumulate_counter (uint64_t counter, uint64_t amount) {
+    if (counter >= BF_BBF_INST_MIX) {
+      if (bf_tally_inst_mix)
+        inst_mix_histo[counter - BF_BBF_INST_MIX] += amount;
+    }
+    else if (counter >= BF_BBF_MEM_INSTS) {
+      if (bf_types)
+        mem_insts[counter - BF_BBF_MEM_INSTS] += amount;
+    }
+    else if (counter >= BF_BBF_MEM_INTRIN)
+      mem_intrinsics[counter - BF_BBF_MEM_INTRIN] += amount;
+    else if (counter >= BF_BBF_TERMINATORS)
+      terminators[counter - BF_BBF_TERMINATORS] += amount;
+    else
+      switch (counter) {
+        case BF_BBF_LOADS:     loads     += amount; break;
+        case BF_BBF_STORES:    stores    += amount; break;
+        case BF_BBF_LOAD_INS:  load_ins  += amount; break;
+        case BF_BBF_STORE_INS: store_ins += amount; break;
+        case BF_BBF_FLOPS:     flops     += amount; break;
+        case BF_BBF_FP_BITS:   fp_bits   += amount; break;
+        case BF_BBF_OPS:       ops       += amount; break;
+        case BF_BBF_OP_BITS:   op_bits   += amount; break;
+        default:               break;
+      }
+  }
+
   // Return the difference of our counters and another set of counters.
   ByteFlopCounters* difference (ByteFlopCounters* other) {
     // Take the difference of mem_insts only if -bf-types was specified.
@@ -224,24 +304,42 @@ public:
   }
 };
 
+// Represent the subset of counters that appear in a BYFL_BB line.
+typedef struct {
+  uint64_t loads;       // Number of bytes loaded
+  uint64_t stores;      // Number of bytes stored
+  uint64_t load_ins;    // Number of load instructions executed
+  uint64_t store_ins;   // Number of store instructions executed
+  uint64_t flops;       // Number of floating-point operations performed
+  uint64_t fp_bits;     // Number of bits consumed or produced by all FP operations
+  uint64_t ops;         // Number of operations of any type performed
+  uint64_t op_bits;     // Number of bits consumed or produced by any operation except loads/stores
+} bb_tallies_t;
+
 // The following values get reset at the end of every basic block.
-uint64_t  bf_load_count       = 0;    // Tally of the number of bytes loaded
-uint64_t  bf_store_count      = 0;    // Tally of the number of bytes stored
-uint64_t* bf_mem_insts_count  = NULL; // Tally of memory instructions by type
-uint64_t* bf_inst_mix_histo   = NULL; // Tally of instruction mix (as histogram)
-uint64_t* bf_terminator_count = NULL; // Tally of terminators by type
-uint64_t* bf_mem_intrin_count = NULL; // Tally of memory intrinsic calls and data movement
-uint64_t  bf_load_ins_count   = 0;    // Tally of the number of load instructions performed
-uint64_t  bf_store_ins_count  = 0;    // Tally of the number of store instructions performed
-uint64_t  bf_flop_count       = 0;    // Tally of the number of FP operations performed
-uint64_t  bf_fp_bits_count    = 0;    // Tally of the number of bits used by all FP operations
-uint64_t  bf_op_count         = 0;    // Tally of the number of operations performed
-uint64_t  bf_op_bits_count    = 0;    // Tally of the number of bits used by all operations except loads/stores
-
-// The following values represent more persistent counter and other state.
-static uint64_t num_merged = 0;    // Number of basic blocks merged so far
+// Each thread gets its own copy so that instrumented code never needs
+// to synchronize when updating them.
+__thread uint64_t  bf_load_count       = 0;    // Tally of the number of bytes loaded
+__thread uint64_t  bf_store_count      = 0;    // Tally of the number of bytes stored
+__thread uint64_t* bf_mem_insts_count  = NULL; // Tally of memory instructions by type
+__thread uint64_t* bf_inst_mix_histo   = NULL; // Tally of instruction mix (as histogram)
+__thread uint64_t* bf_terminator_count = NULL; // Tally of terminators by type
+__thread uint64_t* bf_mem_intrin_count = NULL; // Tally of memory intrinsic calls and data movement
+__thread uint64_t  bf_load_ins_count   = 0;    // Tally of the number of load instructions performed
+__thread uint64_t  bf_store_ins_count  = 0;    // Tally of the number of store instructions performed
+__thread uint64_t  bf_flop_count       = 0;    // Tally of the number of FP operations performed
+__thread uint64_t  bf_fp_bits_count    = 0;    // Tally of the number of bits used by all FP operations
+__thread uint64_t  bf_op_count         = 0;    // Tally of the number of operations performed
+__thread uint64_t  bf_op_bits_count    = 0;    // Tally of the number of bits used by all operations except loads/stores
+
+// In -bf-bb-freq mode, instrumented code updates only the following
+// per-thread array of basic-block execution counts.  It is never reset.
+__thread uint64_t* bf_bb_freq_counts   = NULL; // Number of executions of each basic block
+
+// The following values represent more persistent counter and other
+// state.  They are populated at the end of the program by merging all
+// threads' state.
 static ByteFlopCounters global_totals;  // Global tallies of all of our counters
-static ByteFlopCounters prev_global_totals;  // Previously reported global tallies of all of our counters
 
 // Keep track of counters on a per-function basis, being careful to
 // work around the "C++ static initialization order fiasco" (cf. the
@@ -260,6 +358,59 @@ static str2num_t& func_call_tallies()
   return *mapping;
 }
 
+// Keep track of counters that include all callees on a per-call-path
+// basis (-bf-call-stack only), being careful to work around the "C++
+// static initialization order fiasco" (cf. the C++ FAQ).
+static str2bfc_t& inclusive_totals()
+{
+  static str2bfc_t* mapping = new str2bfc_t();
+  return *mapping;
+}
+
+// Map each function ID assigned by the instrumentation pass to the
+// function's name, being careful to work around the "C++ static
+// initialization order fiasco" (cf. the C++ FAQ).  Names are
+// interned only at the end of the program.
+static vector<const char*>& func_id_to_name()
+{
+  static vector<const char*>* mapping = new vector<const char*>();
+  return *mapping;
+}
+static pthread_mutex_t func_table_lock = PTHREAD_MUTEX_INITIALIZER;  // Protects func_id_to_name()
+
+// Return the name of a function given its ID.  A module loaded with
+// dlopen() can grow func_id_to_name() at any time, so the name is
+// copied out while holding func_table_lock.
+static const char* func_id_name (uint64_t funcid)
+{
+  pthread_mutex_lock(&func_table_lock);
+  const char* funcname = func_id_to_name()[funcid];
+  pthread_mutex_unlock(&func_table_lock);
+  return funcname;
+}
+
+// Describe the static counts of a single basic block (-bf-bb-freq
+// only).
+typedef struct {
+  uint64_t funcid;              // ID of the function containing the basic block
+  const uint64_t* increments;   // {BF_BBF_* counter, increment} pairs
+  uint64_t num_increments;      // Number of pairs in the above
+} bb_static_counts_t;
+
+// Map each basic-block ID assigned by the instrumentation pass to the
+// basic block's static counts, being careful to work around the "C++
+// static initialization order fiasco" (cf. the C++ FAQ).
+static vector<bb_static_counts_t>& bb_id_to_counts()
+{
+  static vector<bb_static_counts_t>* mapping = new vector<bb_static_counts_t>();
+  return *mapping;
+}
+
+// Count the basic blocks registered so far (-bf-bb-freq only).  Each
+// thread's bf_bb_freq_counts array holds at least this many elements.
+// Protected by thread_state_lock.
+static uint64_t num_registered_bbs = 0;
+
 // Keep track of counters on a user-defined basis, being careful to
 // work around the "C++ static initialization order fiasco" (cf. the
 // C++ FAQ).
@@ -281,22 +432,14 @@ extern "C" {
 
 namespace bytesflops {
 
-const char* bf_func_and_parents; // Top of the complete_call_stack stack
+__thread size_t bf_thread_id = 0;         // Index of the current thread into all_thread_states
 string bf_output_prefix;         // String to output before "BYFL" on every line
 ostream* bfout;                  // Stream to which to send standard output
 
 
 // Define a stack of tallies of all of our counters across <=
-// num_merged basic blocks.  This *ought* to be a top-level variable
-// defintion, but because of the "C++ static initialization order
-// fiasco" (cf. the C++ FAQ) we have to use the following roundabout
-// approach.
+// num_merged basic blocks.
 typedef vector<ByteFlopCounters*> counter_vector_t;
-static counter_vector_t& bb_totals (void)
-{
-  static counter_vector_t* bfc = new counter_vector_t();
-  return *bfc;
-}
 
 // Define a memory pool for ByteFlopCounters.
 class CounterMemoryPool {
@@ -321,66 +464,268 @@ public:
     freelist.push_back(oldBFC);
   }
 };
-static CounterMemoryPool* counter_memory_pool = NULL;
 
-// Maintain a function call stack.
-class CallStack {
+// Represent one node of a calling-context tree: a function invoked
+// along a particular path of callers.
+class CallingContext {
 private:
-  vector<const char*> complete_call_stack;  // Stack of function and ancestor names
+  unordered_map<uint64_t, CallingContext*> children;  // Callees, keyed by function ID
+  CallingContext* prev_child;   // Most recently entered callee
+  const char* path_name;        // Interned name of the function and its ancestors
+
 public:
-  size_t max_depth;   // Maximum depth achieved by complete_call_stack
+  CallingContext* parent;       // Calling context of our caller (NULL=root)
+  uint64_t funcid;              // ID of the function this context represents
+  size_t depth;                 // Number of functions on the path from the root
+  uint64_t invocations;         // Number of times this context was entered
+  ByteFlopCounters* counters;   // Tallies for the function itself (NULL=none)
+
+  CallingContext(CallingContext* caller, uint64_t id) {
+    parent = caller;
+    funcid = id;
+    depth = caller == NULL ? 0 : caller->depth + 1;
+    invocations = 0;
+    counters = NULL;
+    prev_child = NULL;
+    path_name = NULL;
+  }
 
-  CallStack() {
-    bf_func_and_parents = "-";
-    max_depth = 0;
+  // Return the calling context of a given callee, creating it if
+  // necessary.
+  CallingContext* child (uint64_t callee) {
+    if (prev_child != NULL && prev_child->funcid == callee)
+      return prev_child;
+    CallingContext*& callee_context = children[callee];
+    if (callee_context == NULL)
+      callee_context = new CallingContext(this, callee);
+    prev_child = callee_context;
+    return callee_context;
   }
 
-  // Push a function name onto the stack.  Return a string containing
-  // the name of the function followed by the names of all of its
-  // ancestors.
-  const char* push_function (const char* funcname) {
-    // Push both the current function name and the combined name of the
-    // function and its call stack.
-    static char* combined_name = NULL;
-    static size_t len_combined_name = 0;
-    const char* unique_combined_name;      // Interned version of combined_name
-    size_t current_stack_depth = complete_call_stack.size();
-    if (current_stack_depth == 0) {
-      // First function on the call stack
-      len_combined_name = strlen(funcname) + 1;
-      combined_name = (char*) malloc(len_combined_name);
-      strcpy(combined_name, funcname);
-      max_depth = 1;
-    }
+  // Append each of our children to a given list.
+  void get_children (vector<CallingContext*>& child_list) {
+    for (unordered_map<uint64_t, CallingContext*>::iterator c_iter = children.begin();
+         c_iter != children.end();
+         c_iter++)
+      child_list.push_back(c_iter->second);
+  }
+
+  // Return a string containing the name of the function followed by
+  // the names of all of its ancestors.  The string is constructed
+  // only on first use.
+  const char* name (void) {
+    if (path_name != NULL)
+      return path_name;
+    if (parent == NULL)
+      path_name = "-";
     else {
-      // All other calls (the common case)
-      const char* ancestors_names = complete_call_stack.back();
-      size_t length_needed = strlen(funcname) + strlen(ancestors_names) + 2;
-      if (len_combined_name < length_needed) {
-        len_combined_name = length_needed*2;
-        combined_name = (char*) realloc(combined_name, len_combined_name);
+      string combined_name(func_id_name(funcid));
+      for (CallingContext* ancestor = parent;
+           ancestor->parent != NULL;
+           ancestor = ancestor->parent) {
+        combined_name += ' ';
+        combined_name += func_id_name(ancestor->funcid);
       }
-      sprintf(combined_name, "%s %s", funcname, ancestors_names);
-      current_stack_depth++;
-      if (current_stack_depth > max_depth)
-        max_depth = current_stack_depth;
+      path_name = bf_string_to_symbol(combined_name.c_str());
     }
-    unique_combined_name = bf_string_to_symbol(combined_name);
-    complete_call_stack.push_back(unique_combined_name);
-    return unique_combined_name;
+    return path_name;
   }
+};
 
-  // Pop a function name from the call stack and return the new top of
-  // the call stack (function + ancestors).
-  const char* pop_function (void) {
-    complete_call_stack.pop_back();
-    if (complete_call_stack.size() > 0)
-      return complete_call_stack.back();
-    else
-      return "[EMPTY]";
+// Maintain a calling-context tree.  Pushing and popping a function
+// merely moves a pointer within the tree.
+class CallingContextTree {
+public:
+  CallingContext root;        // Context outside of any instrumented function
+  CallingContext* current;    // Context of the currently executing function
+  size_t max_depth;           // Maximum depth achieved by the call stack
+
+  CallingContextTree() : root(NULL, 0) {
+    current = &root;
+    max_depth = 0;
+  }
+
+  // Enter a function from the current calling context.
+  void push_function (uint64_t funcid) {
+    current = current->child(funcid);
+    current->invocations++;
+    if (current->depth > max_depth)
+      max_depth = current->depth;
+  }
+
+  // Return to the caller's calling context.
+  void pop_function (void) {
+    if (current->parent != NULL)
+      current = current->parent;
+  }
+};
+
+static pthread_mutex_t thread_state_lock = PTHREAD_MUTEX_INITIALIZER;  // Protects all_thread_states
+
+// Encapsulate all of the counter state that belongs to a single
+// thread.  Instrumented code touches only its own thread's state so
+// it never needs to acquire a lock.  The states of all threads are
+// merged once, at the end of the program.
+class ThreadState {
+public:
+  counter_vector_t bb_totals;             // Stack of per-basic-block tallies
+  str2bfc_t per_func_totals;              // Tallies by name, populated when merging
+  counter_vector_t func_id_totals;        // Tallies by function, indexed by function ID (NULL=none)
+  vector<uint64_t*> bb_freq_counts;       // Every execution-count array the thread has used (-bf-bb-freq only)
+  vector<uint64_t> bb_freq_sizes;         // Number of elements in each of the above
+  uint64_t** bb_freq_var;                 // The thread's bf_bb_freq_counts (NULL=retired)
+  vector<uint64_t> func_id_tallies;       // Invocation counts, indexed by function ID
+  str2bfc_t user_defined_totals;          // Tallies by bf_categorize_counters() partition
+  str2num_t func_call_tallies;            // Invocation counts by name, populated when merging
+  ByteFlopCounters global_totals;         // Thread-wide tallies of all of our counters
+  bb_tallies_t prev_bb_tallies;           // Thread-wide tallies as of the previous BYFL_BB line
+  uint64_t num_merged;                    // Number of basic blocks merged so far
+  CallingContextTree* call_tree;          // Tallies by calling context
+  CounterMemoryPool counter_memory_pool;  // Recycled ByteFlopCounters for bb_totals
+
+  // Pointers to this thread's instances of the bf_*_count variables.
+  // These let another thread read the counters at the end of the
+  // program.  Once the thread exits they point to retired_count.
+  uint64_t* load_count;
+  uint64_t* store_count;
+  uint64_t* load_ins_count;
+  uint64_t* store_ins_count;
+  uint64_t* flop_count;
+  uint64_t* fp_bits_count;
+  uint64_t* op_count;
+  uint64_t* op_bits_count;
+  uint64_t* mem_insts_count;
+  uint64_t* inst_mix_histo;
+  uint64_t* terminator_count;
+  uint64_t* mem_intrin_count;
+  uint64_t retired_count;                 // Always-zero stand-in for an exited thread's counters
+
+  // Allocate the calling thread's counter arrays and remember where
+  // all of its counters live.
+  ThreadState() {
+    num_merged = 0;
+    memset(&prev_bb_tallies, 0, sizeof(bb_tallies_t));
+    retired_count = 0;
+    call_tree = new CallingContextTree();
+    bb_freq_var = &bf_bb_freq_counts;
+    if (bf_types) {
+      bf_mem_insts_count = new uint64_t[NUM_MEM_INSTS];
+      for (size_t i = 0; i < NUM_MEM_INSTS; i++)
+        bf_mem_insts_count[i] = 0;
+    }
+    if (bf_tally_inst_mix) {
+      bf_inst_mix_histo = new uint64_t[NUM_OPCODES];
+      for (unsigned int i = 0; i < NUM_OPCODES; i++)
+        bf_inst_mix_histo[i] = 0;
+    }
+    bf_terminator_count = new uint64_t[BF_END_BB_NUM];
+    for (unsigned int i = 0; i < BF_END_BB_NUM; i++)
+      bf_terminator_count[i] = 0;
+    bf_mem_intrin_count = new uint64_t[BF_NUM_MEM_INTRIN];
+    for (unsigned int i = 0; i < BF_NUM_MEM_INTRIN; i++)
+      bf_mem_intrin_count[i] = 0;
+    load_count       = &bf_load_count;
+    store_count      = &bf_store_count;
+    load_ins_count   = &bf_load_ins_count;
+    store_ins_count  = &bf_store_ins_count;
+    flop_count       = &bf_flop_count;
+    fp_bits_count    = &bf_fp_bits_count;
+    op_count         = &bf_op_count;
+    op_bits_count    = &bf_op_bits_count;
+    mem_insts_count  = bf_mem_insts_count;
+    inst_mix_histo   = bf_inst_mix_histo;
+    terminator_count = bf_terminator_count;
+    mem_intrin_count = bf_mem_intrin_count;
+  }
+
+  // Accumulate the thread's not-yet-tallied counter values into its
+  // totals and zero out the counters.
+  void flush_counters (void) {
+    global_totals.accumulate(mem_insts_count,
+                             inst_mix_histo,
+                             terminator_count,
+                             mem_intrin_count,
+                             *load_count,
+                             *store_count,
+                             *load_ins_count,
+                             *store_ins_count,
+                             *flop_count,
+                             *fp_bits_count,
+                             *op_count,
+                             *op_bits_count);
+    if (bf_types)
+      for (size_t i = 0; i < NUM_MEM_INSTS; i++)
+        mem_insts_count[i] = 0;
+    if (bf_tally_inst_mix)
+      for (size_t i = 0; i < NUM_OPCODES; i++)
+        inst_mix_histo[i] = 0;
+    for (size_t i = 0; i < BF_END_BB_NUM; i++)
+      terminator_count[i] = 0;
+    for (size_t i = 0; i < BF_NUM_MEM_INTRIN; i++)
+      mem_intrin_count[i] = 0;
+    *load_count = *store_count = 0;
+    *load_ins_count = *store_ins_count = 0;
+    *flop_count = *fp_bits_count = 0;
+    *op_count = *op_bits_count = 0;
+  }
+
+  // Make room in the thread's basic-block execution counts for a
+  // given number of basic blocks (-bf-bb-freq only).  The caller must
+  // hold thread_state_lock.  Because the thread may be incrementing
+  // its current array concurrently, that array is kept rather than
+  // copied, and the counts in all of the thread's arrays are summed
+  // when merging.
+  void grow_bb_freq_counts (uint64_t num_bbs) {
+    uint64_t capacity = bb_freq_sizes.empty() ? 0 : bb_freq_sizes.back();
+    if (num_bbs <= capacity && !bb_freq_counts.empty())
+      return;
+    capacity = max(max(capacity*2, num_bbs), uint64_t(1024));
+    uint64_t* counts = (uint64_t*) calloc(capacity, sizeof(uint64_t));
+    if (counts == NULL) {
+      cerr << "Failed to allocate basic-block execution counts\n";
+      exit(1);
+    }
+    bb_freq_counts.push_back(counts);
+    bb_freq_sizes.push_back(capacity);
+    if (bb_freq_var != NULL)
+      __atomic_store_n(bb_freq_var, counts, __ATOMIC_RELEASE);
+  }
+
+  // Flush the thread's counters then stop referring to its
+  // thread-local storage, which is about to be deallocated.  Lock out
+  // a concurrent merge_thread_states(), which flushes the same
+  // counters.
+  void retire (void) {
+    pthread_mutex_lock(&thread_state_lock);
+    flush_counters();
+    bb_freq_var = NULL;
+    load_count = store_count = &retired_count;
+    load_ins_count = store_ins_count = &retired_count;
+    flop_count = fp_bits_count = &retired_count;
+    op_count = op_bits_count = &retired_count;
+    pthread_mutex_unlock(&thread_state_lock);
   }
 };
-static CallStack* call_stack = NULL;
+
+// Retire a thread's state when the thread exits.
+class ThreadRetirer {
+private:
+  ThreadState* state;
+public:
+  ThreadRetirer(ThreadState* state_to_retire) : state(state_to_retire) { }
+  ~ThreadRetirer() {
+    state->retire();
+  }
+};
+
+static __thread ThreadState* thread_state = NULL;        // The calling thread's state
+static vector<ThreadState*>* all_thread_states = NULL;   // Every thread's state
+
+// Return the calling thread's stack of basic-block tallies.
+static inline counter_vector_t& bb_totals (void)
+{
+  return thread_state->bb_totals;
+}
 
 // As a kludge, set a global variable indicating that all of the
 // constructors in this file have been called.  Because of the "C++
@@ -399,45 +744,72 @@ public:
 
 // Initialize some of our variables at first use.
 void initialize_byfl (void) {
-  call_stack = new CallStack();
-  counter_memory_pool = new CounterMemoryPool();
-  if (bf_types) {
-    bf_mem_insts_count = new uint64_t[NUM_MEM_INSTS];
-    for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-      bf_mem_insts_count[i] = 0;
-  }
-  if (bf_tally_inst_mix) {
-    bf_inst_mix_histo = new uint64_t[NUM_OPCODES];
-    for (unsigned int i = 0; i < NUM_OPCODES; i++)
-      bf_inst_mix_histo[i] = 0;
-  }
-  bf_terminator_count = new uint64_t[BF_END_BB_NUM];
-  for (unsigned int i = 0; i < BF_END_BB_NUM; i++)
-    bf_terminator_count[i] = 0;
-  bf_mem_intrin_count = new uint64_t[BF_NUM_MEM_INTRIN];
-  for (unsigned int i = 0; i < BF_NUM_MEM_INTRIN; i++)
-    bf_mem_intrin_count[i] = 0;
+  all_thread_states = new vector<ThreadState*>();
+}
+
+
+// Return true if the calling thread is the process's initial thread,
+// whose thread-local storage remains valid until the end of the
+// program.  Where that can't be determined, return false.
+static bool is_initial_thread (void)
+{
+#ifdef SYS_gettid
+  return syscall(SYS_gettid) == getpid();
+#else
+  return false;
+#endif
+}
+
+
+// Initialize the calling thread's counter state and register it for
+// merging at the end of the program.
+static void initialize_thread_state (void)
+{
+  thread_state = new ThreadState();
+  pthread_mutex_lock(&thread_state_lock);
+  if (bf_bb_freq)
+    thread_state->grow_bb_freq_counts(num_registered_bbs);
+  bf_thread_id = all_thread_states->size();
+  all_thread_states->push_back(thread_state);
+  pthread_mutex_unlock(&thread_state_lock);
   bf_push_basic_block();
+
+  // Threads other than the initial thread tally their remaining
+  // counts when they exit.  (The initial thread's counters remain
+  // valid until the end of the program.)  Whichever thread first
+  // runs instrumented code may be a worker.
+  if (!is_initial_thread()) {
+    static thread_local ThreadRetirer retire_at_exit(thread_state);
+    (void) retire_at_exit;
+  }
 }
 
 
 // Initialize on first use all top-level variables in all files.  This
 // is a kludge to work around the "C++ static initialization order
 // fiasco" (cf. the C++ FAQ).  bf_initialize_if_necessary() can safely
-// be called multiple times.
+// be called multiple times and from multiple threads.
 void bf_initialize_if_necessary (void)
 {
   static bool initialized = false;
-  if (!__builtin_expect(initialized, true)) {
-    initialize_byfl();
-    initialize_reuse();
-    initialize_symtable();
-    initialize_threading();
-    initialize_ubytes();
-    initialize_tallybytes();
-    initialize_vectors();
-    initialize_cache();
-    initialized = true;
+  static __thread bool thread_initialized = false;
+  static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+  if (!__builtin_expect(thread_initialized, true)) {
+    pthread_mutex_lock(&init_lock);
+    if (!initialized) {
+      initialize_byfl();
+      initialize_reuse();
+      initialize_symtable();
+      initialize_threading();
+      initialize_ubytes();
+      initialize_tallybytes();
+      initialize_vectors();
+      initialize_cache();
+      initialized = true;
+    }
+    pthread_mutex_unlock(&init_lock);
+    initialize_thread_state();
+    thread_initialized = true;
   }
 }
 
@@ -445,7 +817,7 @@ void bf_initialize_if_necessary (void)
 // Push a new basic block onto the stack (before a function call).
 void bf_push_basic_block (void)
 {
-  bb_totals().push_back(counter_memory_pool->allocate());
+  bb_totals().push_back(thread_state->counter_memory_pool.allocate());
 }
 
 
@@ -453,36 +825,96 @@ void bf_push_basic_block (void)
 // returns).
 void bf_pop_basic_block (void)
 {
-  counter_memory_pool->deallocate(bb_totals().back());
+  thread_state->counter_memory_pool.deallocate(bb_totals().back());
   bb_totals().pop_back();
 }
 
 
+// Append a module's table of function names to the program-wide
+// table.  Return the function ID corresponding to the module's first
+// function.  This is invoked by each instrumented module's
+// constructor.
+uint64_t bf_register_func_table (const char** funcnames, uint64_t num_funcs)
+{
+  pthread_mutex_lock(&func_table_lock);
+  vector<const char*>& id_to_name = func_id_to_name();
+  uint64_t first_id = id_to_name.size();
+  id_to_name.insert(id_to_name.end(), funcnames, funcnames + num_funcs);
+  pthread_mutex_unlock(&func_table_lock);
+  return first_id;
+}
+
+
+// Append a module's static basic-block counts to the program-wide
+// table.  Return the basic-block ID corresponding to the module's
+// first basic block.  This is invoked by each instrumented module's
+// constructor (-bf-bb-freq only).  Each basic block is described by
+// three consecutive elements of bb_table: the module-local ID of its
+// function, the index of its first {counter, increment} pair in
+// increments, and the number of such pairs.
+uint64_t bf_register_bb_table (const uint64_t* bb_table, uint64_t num_bbs,
+                               const uint64_t* increments, uint64_t first_funcid)
+{
+  pthread_mutex_lock(&func_table_lock);
+  vector<bb_static_counts_t>& id_to_counts = bb_id_to_counts();
+  uint64_t first_id = id_to_counts.size();
+  for (uint64_t i = 0; i < num_bbs; i++) {
+    bb_static_counts_t counts;
+    counts.funcid = first_funcid + bb_table[i*3];
+    counts.increments = increments + bb_table[i*3 + 1]*2;
+    counts.num_increments = bb_table[i*3 + 2];
+    id_to_counts.push_back(counts);
+  }
+  uint64_t num_bbs_now = id_to_counts.size();
+  pthread_mutex_unlock(&func_table_lock);
+
+  // Modules are normally registered before any thread starts, but a
+  // module loaded later (e.g., with dlopen()) may not fit in the
+  // existing threads' execution-count arrays.  (merge_thread_states()
+  // acquires func_table_lock while holding thread_state_lock, so we
+  // must not hold both.)
+  pthread_mutex_lock(&thread_state_lock);
+  num_registered_bbs = max(num_registered_bbs, num_bbs_now);
+  if (all_thread_states != NULL)
+    for (vector<ThreadState*>::iterator ts_iter = all_thread_states->begin();
+         ts_iter != all_thread_states->end();
+         ts_iter++)
+      (*ts_iter)->grow_bb_freq_counts(num_registered_bbs);
+  pthread_mutex_unlock(&thread_state_lock);
+  return first_id;
+}
+
+
 // Tally the number of calls to each function.
-void bf_incr_func_tally (const char* funcname)
+void bf_incr_func_tally (uint64_t funcid)
 {
-  const char* unique_name = bf_string_to_symbol(funcname);
-  func_call_tallies()[unique_name]++;
+  vector<uint64_t>& tallies = thread_state->func_id_tallies;
+  if (__builtin_expect(funcid >= tallies.size(), 0))
+    tallies.resize(funcid + 1, 0);
+  tallies[funcid]++;
 }
 
 
-// Push a function name onto the call stack.  Increment the invocation
-// count the call stack as a whole, and ensure the individual function
-// name also exists in the hash table.
-void bf_push_function (const char* funcname)
+// Enter a function's calling context, which also tallies the
+// invocation.
+void bf_push_function (uint64_t funcid)
 {
-  const char* unique_combined_name = call_stack->push_function(funcname);
-  bf_func_and_parents = unique_combined_name;
-  func_call_tallies()[bf_func_and_parents]++;
-  const char* unique_name = bf_string_to_symbol(funcname);
-  func_call_tallies()[unique_name] += 0;
+  thread_state->call_tree->push_function(funcid);
 }
 
 
-// Pop the top function name from the call stack.
+// Return to the caller's calling context.
 void bf_pop_function (void)
 {
-  bf_func_and_parents = call_stack->pop_function();
+  thread_state->call_tree->pop_function();
+}
+
+
+// Return the name of the current function followed by the names of
+// all of its ancestors.
+const char* bf_func_and_parents (void)
+{
+  return thread_state->call_tree->current->name();
 }
 
 
@@ -542,7 +974,7 @@ static bool suppress_output (void)
 
 // At the end of a basic block, accumulate the current counter
 // variables (bf_*_count) into the current basic block's counters and
-// into the global counters.
+// into the calling thread's counters.
 void bf_accumulate_bb_tallies (void)
 {
   // Add the current values to the per-BB totals.
@@ -559,14 +991,16 @@ void bf_accumulate_bb_tallies (void)
                          bf_fp_bits_count,
                          bf_op_count,
                          bf_op_bits_count);
-  global_totals.accumulate(current_bb);
-  const char* partition = bf_string_to_symbol(bf_categorize_counters());
+  thread_state->global_totals.accumulate(current_bb);
+  const char* partition = bf_categorize_counters();
   if (partition != NULL) {
-    counter_iterator sm_iter = user_defined_totals().find(partition);
-    if (sm_iter == per_func_totals().end())
-      user_defined_totals()[partition] = new ByteFlopCounters(*current_bb);
+    str2bfc_t& user_totals = thread_state->user_defined_totals;
+    partition = bf_string_to_symbol(partition);
+    counter_iterator sm_iter = user_totals.find(partition);
+    if (sm_iter == user_totals.end())
+      user_totals[partition] = new ByteFlopCounters(*current_bb);
     else
-      user_defined_totals()[partition]->accumulate(current_bb);
+      sm_iter->second->accumulate(current_bb);
   }
 }
 
@@ -577,17 +1011,42 @@ void bf_reset_bb_tallies (void)
   bb_totals().back()->reset();
 }
 
-// Report what we've measured for the current basic block.
-void bf_report_bb_tallies (void)
-{
-  static bool showed_header = false;         // true=already output our header
-
-  // Do nothing if our output is suppressed.
-  if (suppress_output())
-    return;
-
-  // If this is our first invocation, output a basic-block header line.
-  if (__builtin_expect(!showed_header, 0)) {
+// Buffer the -bf-every-bb output in a ring of fixed-size binary
+// records.  Instrumented code merely fills in a record; a background
+// thread formats the records and writes them to bfout.  Hence, the
+// application never allocates memory or performs formatted I/O at the
+// end of a basic block.
+//
+// Application threads claim slots with an atomic increment and mark
+// each filled slot with its record number, so enqueueing a record
+// normally takes no lock.  The writer sleeps until the ring passes a
+// fill threshold or finish() is called; only then do application
+// threads take the lock, to wake it.  Records enqueued after finish()
+// (e.g., by detached threads or static destructors) are output
+// directly under the lock.
+class BasicBlockReporter {
+private:
+  static const size_t num_records = 65536;   // Capacity of the ring (must be a power of two)
+  static const size_t wake_threshold = num_records/4;   // Queued records at which to wake the writer
+  static const uint64_t closed = uint64_t(1) << 63;     // Bit of head set by finish()
+  static const uint64_t unqueued = ~uint64_t(0);        // Number of a record output directly
+  bb_tallies_t* ring;         // Records not yet output
+  uint64_t* ready;            // 1 + the number of the record in each slot, once filled in
+  uint64_t head;              // Number of records ever reserved, plus closed once finished
+  char head_padding[64];      // Keep head and tail in separate cache lines
+  uint64_t tail;              // Number of records ever output
+  char tail_padding[64];
+  bool writer_waiting;        // true=the writer is waiting on not_empty
+  bool finished;              // true=no more records will be enqueued
+  uint64_t last_head;         // Number of records enqueued before finish()
+  bb_tallies_t direct;        // Record being output directly (protected by lock)
+  pthread_mutex_t lock;       // Protects the condition variables
+  pthread_cond_t not_empty;   // Signaled when the writer has work to do
+  pthread_cond_t not_full;    // Signaled when records are output
+  pthread_t writer;           // Thread that outputs records
+
+  // Output a BYFL_BB_HEADER line.
+  void output_header (void) {
     *bfout << bf_output_prefix
            << "BYFL_BB_HEADER: "
            << setw(HDR_COL_WIDTH) << "LD_bytes" << ' '
@@ -599,46 +1058,222 @@ void bf_report_bb_tallies (void)
            << setw(HDR_COL_WIDTH) << "Int_ops" << ' '
            << setw(HDR_COL_WIDTH) << "Int_op_bits";
     *bfout << '\n';
-    showed_header = true;
   }
 
-  // If we've accumulated enough basic blocks, output the aggregate of
-  // their values.
-  if (++num_merged >= bf_bb_merge) {
-    // Output the difference between the current counter values and
-    // our previously saved values.
-    ByteFlopCounters* counter_deltas = global_totals.difference(&prev_global_totals);
+  // Output a record as a BYFL_BB line.
+  void output_record (const bb_tallies_t& record) {
     *bfout << bf_output_prefix
            << "BYFL_BB:        "
-           << setw(HDR_COL_WIDTH) << counter_deltas->loads << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->stores << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->load_ins << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->store_ins << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->flops << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->fp_bits << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->ops << ' '
-           << setw(HDR_COL_WIDTH) << counter_deltas->op_bits;
+           << setw(HDR_COL_WIDTH) << record.loads << ' '
+           << setw(HDR_COL_WIDTH) << record.stores << ' '
+           << setw(HDR_COL_WIDTH) << record.load_ins << ' '
+           << setw(HDR_COL_WIDTH) << record.store_ins << ' '
+           << setw(HDR_COL_WIDTH) << record.flops << ' '
+           << setw(HDR_COL_WIDTH) << record.fp_bits << ' '
+           << setw(HDR_COL_WIDTH) << record.ops << ' '
+           << setw(HDR_COL_WIDTH) << record.op_bits;
     *bfout << '\n';
-    num_merged = 0;
-    prev_global_totals = global_totals;
-    delete counter_deltas;
   }
+
+  // Return true if record number r has been filled in.
+  bool is_ready (uint64_t r) {
+    return __atomic_load_n(&ready[r & (num_records - 1)], __ATOMIC_SEQ_CST) == r + 1;
+  }
+
+  // Repeatedly output all filled-in records until finish() is called
+  // and no records remain.  Records are output outside of the lock.
+  void write_records (void) {
+    output_header();
+    uint64_t next = 0;   // Next record to output
+    while (true) {
+      // Sleep until a record is available.  Setting writer_waiting
+      // before checking for a record ensures that an application
+      // thread that fills in a record either sees writer_waiting or is
+      // seen by is_ready().
+      pthread_mutex_lock(&lock);
+      __atomic_store_n(&writer_waiting, true, __ATOMIC_SEQ_CST);
+      while (!is_ready(next) && !finished)
+        pthread_cond_wait(&not_empty, &lock);
+      __atomic_store_n(&writer_waiting, false, __ATOMIC_SEQ_CST);
+      bool done = finished;
+      pthread_mutex_unlock(&lock);
+
+      // Output every consecutive filled-in record.  Once finish() is
+      // called, wait for records that were reserved but not yet
+      // filled in.
+      while (true) {
+        if (!is_ready(next)) {
+          if (!done || next == last_head)
+            break;
+          sched_yield();
+          continue;
+        }
+        output_record(ring[next & (num_records - 1)]);
+        next++;
+        if ((next & (wake_threshold - 1)) == 0)
+          release(next);
+      }
+      release(next);
+      if (done)
+        break;
+    }
+    bfout->flush();
+  }
+
+  // Let application threads reuse the slots of all records before
+  // number last.
+  void release (uint64_t last) {
+    __atomic_store_n(&tail, last, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&lock);
+    pthread_cond_broadcast(&not_full);
+    pthread_mutex_unlock(&lock);
+  }
+
+  // Wake the writer if it's waiting for records.
+  void wake_writer (void) {
+    if (__atomic_load_n(&writer_waiting, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock(&lock);
+      pthread_cond_signal(&not_empty);
+      pthread_mutex_unlock(&lock);
+    }
+  }
+
+  // Wrap write_records() for use by pthread_create().
+  static void* writer_thread (void* reporter) {
+    ((BasicBlockReporter*)reporter)->write_records();
+    return NULL;
+  }
+
+public:
+  // Allocate the ring and launch the writer thread.
+  BasicBlockReporter() {
+    ring = new bb_tallies_t[num_records];
+    ready = new uint64_t[num_records];
+    memset(ready, 0, num_records*sizeof(uint64_t));
+    head = 0;
+    tail = 0;
+    writer_waiting = false;
+    finished = false;
+    last_head = 0;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&not_empty, NULL);
+    pthread_cond_init(&not_full, NULL);
+    if (pthread_create(&writer, NULL, writer_thread, this) != 0) {
+      cerr << "Failed to create a thread for reporting basic-block tallies\n";
+      exit(1);
+    }
+  }
+
+  // Claim the next record to fill in, waiting for the writer to make
+  // room if necessary.  The caller must invoke commit() with the
+  // record number as soon as the record is filled in.  Once finish()
+  // is called, claim the direct-output record, holding the lock until
+  // commit().
+  bb_tallies_t* reserve (uint64_t* record_num) {
+    uint64_t r = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    if (__builtin_expect((r & closed) != 0, 0)) {
+      pthread_mutex_lock(&lock);
+      *record_num = unqueued;
+      return &direct;
+    }
+    if (__builtin_expect(r - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= num_records, 0)) {
+      wake_writer();
+      pthread_mutex_lock(&lock);
+      while (r - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= num_records)
+        pthread_cond_wait(&not_full, &lock);
+      pthread_mutex_unlock(&lock);
+    }
+    *record_num = r;
+    return &ring[r & (num_records - 1)];
+  }
+
+  // Make a reserved record available to the writer, waking the
+  // writer if enough records are waiting to be output.  (A full ring
+  // always passes the threshold, so a thread waiting in reserve() is
+  // never stranded behind a record filled in without a wakeup.)
+  void commit (uint64_t record_num) {
+    if (__builtin_expect(record_num == unqueued, 0)) {
+      output_record(direct);
+      bfout->flush();
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+    __atomic_store_n(&ready[record_num & (num_records - 1)], record_num + 1, __ATOMIC_SEQ_CST);
+    if ((__atomic_load_n(&head, __ATOMIC_RELAXED) & ~closed) - __atomic_load_n(&tail, __ATOMIC_RELAXED) >= wake_threshold)
+      wake_writer();
+  }
+
+  // Output all remaining records and terminate the writer thread.
+  // Records reserved before head is closed are still queued (so no
+  // reserve() waits forever); those reserved after are output
+  // directly.
+  void finish (void) {
+    pthread_mutex_lock(&lock);
+    last_head = __atomic_fetch_or(&head, closed, __ATOMIC_SEQ_CST);
+    finished = true;
+    pthread_cond_signal(&not_empty);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+  }
+};
+
+static BasicBlockReporter* bb_reporter = NULL;   // Formatter of BYFL_BB lines
+static pthread_once_t bb_reporter_once = PTHREAD_ONCE_INIT;
+
+// Create the basic-block reporter.
+static void create_bb_reporter (void)
+{
+  bb_reporter = new BasicBlockReporter();
 }
 
+// Report what we've measured for the current basic block.
+void bf_report_bb_tallies (void)
+{
+  // If we've accumulated enough basic blocks, output the aggregate of
+  // their values.
+  if (++thread_state->num_merged < bf_bb_merge)
+    return;
+  thread_state->num_merged = 0;
 
-// Associate the current counter values with a given function.
-void bf_assoc_counters_with_func (const char* funcname)
+  // Do nothing if our output is suppressed.
+  if (suppress_output())
+    return;
+
+  // Enqueue the difference between the current counter values and
+  // our previously reported values.
+  if (__builtin_expect(bb_reporter == NULL, 0))
+    pthread_once(&bb_reporter_once, create_bb_reporter);
+  ByteFlopCounters& totals = thread_state->global_totals;
+  bb_tallies_t& prev_totals = thread_state->prev_bb_tallies;
+  uint64_t record_num;
+  bb_tallies_t* deltas = bb_reporter->reserve(&record_num);
+  deltas->loads     = totals.loads     - prev_totals.loads;
+  deltas->stores    = totals.stores    - prev_totals.stores;
+  deltas->load_ins  = totals.load_ins  - prev_totals.load_ins;
+  deltas->store_ins = totals.store_ins - prev_totals.store_ins;
+  deltas->flops     = totals.flops     - prev_totals.flops;
+  deltas->fp_bits   = totals.fp_bits   - prev_totals.fp_bits;
+  deltas->ops       = totals.ops       - prev_totals.ops;
+  deltas->op_bits   = totals.op_bits   - prev_totals.op_bits;
+  bb_reporter->commit(record_num);
+  prev_totals.loads     = totals.loads;
+  prev_totals.stores    = totals.stores;
+  prev_totals.load_ins  = totals.load_ins;
+  prev_totals.store_ins = totals.store_ins;
+  prev_totals.flops     = totals.flops;
+  prev_totals.fp_bits   = totals.fp_bits;
+  prev_totals.ops       = totals.ops;
+  prev_totals.op_bits   = totals.op_bits;
+}
+
+
+// Add the current counter values to a given set of counters,
+// allocating the set if it doesn't yet exist.
+static inline void accumulate_current_counters (ByteFlopCounters*& func_counters)
 {
-  // Ensure that per_func_totals contains an ByteFlopCounters entry
-  // for funcname, then add the current counters to that entry.
-  if (bf_call_stack)
-    funcname = bf_func_and_parents;
-  else
-    funcname = bf_string_to_symbol(funcname);
-  counter_iterator sm_iter = per_func_totals().find(funcname);
-  if (sm_iter == per_func_totals().end())
-    // This is the first time we've seen this function name.
-    per_func_totals()[funcname] =
+  if (func_counters == NULL)
+    // This is the first time we've seen this function.
+    func_counters =
       new ByteFlopCounters(bf_mem_insts_count,
                            bf_inst_mix_histo,
                            bf_terminator_count,
@@ -651,10 +1286,9 @@ void bf_assoc_counters_with_func (const char* funcname)
                            bf_fp_bits_count,
                            bf_op_count,
                            bf_op_bits_count);
-  else {
+  else
     // Accumulate the current counter values into those associated
-    // with an existing function name.
-    ByteFlopCounters* func_counters = sm_iter->second;
+    // with an existing function.
     func_counters->accumulate(bf_mem_insts_count,
                               bf_inst_mix_histo,
                               bf_terminator_count,
@@ -667,13 +1301,186 @@ void bf_assoc_counters_with_func (const char* funcname)
                               bf_fp_bits_count,
                               bf_op_count,
                               bf_op_bits_count);
+}
+
+// Associate the current counter values with a given function.
+void bf_assoc_counters_with_func (uint64_t funcid)
+{
+  // In call-stack mode, tally by the current calling context.
+  if (bf_call_stack) {
+    accumulate_current_counters(thread_state->call_tree->current->counters);
+    return;
   }
+
+  // In the common case, index the thread's counters directly by
+  // function ID.
+  counter_vector_t& func_totals = thread_state->func_id_totals;
+  if (__builtin_expect(funcid >= func_totals.size(), 0))
+    func_totals.resize(funcid + 1, NULL);
+  accumulate_current_counters(func_totals[funcid]);
 }
 
 // At the end of the program, report what we measured.
 static class RunAtEndOfProgram {
 private:
   string separator;    // Horizontal rule to output between sections
+  size_t max_call_depth;   // Maximum call-stack depth across all threads
+
+  // Accumulate a set of counters into a mapping's entry for a given
+  // interned name.
+  static void accumulate_by_name (str2bfc_t& mapping, const char* unique_name,
+                                  ByteFlopCounters* counters) {
+    counter_iterator sm_iter = mapping.find(unique_name);
+    if (sm_iter == mapping.end())
+      mapping[unique_name] = new ByteFlopCounters(*counters);
+    else
+      sm_iter->second->accumulate(counters);
+  }
+
+  // Merge a thread's tallies keyed by its own strings into a
+  // program-wide mapping keyed by interned strings.
+  static void merge_counter_map (str2bfc_t& thread_map, str2bfc_t& merged_map) {
+    for (counter_iterator sm_iter = thread_map.begin();
+         sm_iter != thread_map.end();
+         sm_iter++)
+      accumulate_by_name(merged_map, bf_string_to_symbol(sm_iter->first), sm_iter->second);
+  }
+
+  // Compute a thread's tallies from its basic-block execution counts
+  // (-bf-bb-freq only) as the sum over all basic blocks of the
+  // execution count times the static counts.  Accumulate the result
+  // both into a given set of counters and into the thread's
+  // per-function tallies.
+  static void expand_bb_frequencies (ThreadState* state, ByteFlopCounters& totals) {
+    vector<bb_static_counts_t>& id_to_counts = bb_id_to_counts();
+    counter_vector_t& func_totals = state->func_id_totals;
+    for (size_t bbid = 0; bbid < id_to_counts.size(); bbid++) {
+      uint64_t freq = 0;
+      for (size_t i = 0; i < state->bb_freq_counts.size(); i++)
+        if (bbid < state->bb_freq_sizes[i])
+          freq += state->bb_freq_counts[i][bbid];
+      if (freq == 0)
+        continue;
+      const bb_static_counts_t& counts = id_to_counts[bbid];
+      ByteFlopCounters* func_counters = NULL;
+      if (bf_per_func) {
+        if (counts.funcid >= func_totals.size())
+          func_totals.resize(counts.funcid + 1, NULL);
+        if (func_totals[counts.funcid] == NULL)
+          func_totals[counts.funcid] = new ByteFlopCounters();
+        func_counters = func_totals[counts.funcid];
+      }
+      for (uint64_t i = 0; i < counts.num_increments; i++) {
+        uint64_t counter = counts.increments[i*2];
+        uint64_t amount = freq*counts.increments[i*2 + 1];
+        totals.accumulate_counter(counter, amount);
+        if (func_counters != NULL)
+          func_counters->accumulate_counter(counter, amount);
+      }
+    }
+  }
+
+  // Convert a thread's calling-context tree to exclusive tallies and
+  // invocation counts keyed by call path in the thread's own maps and
+  // to inclusive tallies in inclusive_totals().  Deeply recursive
+  // programs produce deep trees so we walk the tree iteratively.
+  static void merge_calling_contexts (ThreadState* state) {
+    // List every calling context after all of its ancestors.
+    vector<CallingContext*> contexts;
+    state->call_tree->root.get_children(contexts);
+    for (size_t i = 0; i < contexts.size(); i++)
+      contexts[i]->get_children(contexts);
+
+    // Visit every calling context before its ancestors, adding its
+    // inclusive tallies to its parent's.
+    unordered_map<CallingContext*, ByteFlopCounters*> inclusive;
+    for (vector<CallingContext*>::reverse_iterator c_iter = contexts.rbegin();
+         c_iter != contexts.rend();
+         c_iter++) {
+      CallingContext* context = *c_iter;
+      const char* unique_name = context->name();
+      ByteFlopCounters*& context_inclusive = inclusive[context];
+      if (context_inclusive == NULL)
+        context_inclusive = new ByteFlopCounters();
+      if (context->counters != NULL) {
+        context_inclusive->accumulate(context->counters);
+        accumulate_by_name(state->per_func_totals, unique_name, context->counters);
+      }
+      accumulate_by_name(inclusive_totals(), unique_name, context_inclusive);
+      ByteFlopCounters*& parent_inclusive = inclusive[context->parent];
+      if (parent_inclusive == NULL)
+        parent_inclusive = new ByteFlopCounters();
+      parent_inclusive->accumulate(context_inclusive);
+      state->func_call_tallies[unique_name] += context->invocations;
+      state->func_call_tallies[bf_string_to_symbol(func_id_name(context->funcid))] += 0;
+    }
+    for (unordered_map<CallingContext*, ByteFlopCounters*>::iterator i_iter = inclusive.begin();
+         i_iter != inclusive.end();
+         i_iter++)
+      delete i_iter->second;
+  }
+
+  // Combine the counters from every thread into the program-wide
+  // global_totals, per_func_totals(), user_defined_totals(), and
+  // func_call_tallies().
+  void merge_thread_states (void) {
+    max_call_depth = 0;
+    pthread_mutex_lock(&thread_state_lock);
+    for (vector<ThreadState*>::iterator ts_iter = all_thread_states->begin();
+         ts_iter != all_thread_states->end();
+         ts_iter++) {
+      ThreadState* state = *ts_iter;
+
+      // Accumulate the current values of all of the thread's counters
+      // into its totals.  These are nonzero only if we're not
+      // instrumented on the basic-block or function level.
+      state->flush_counters();
+
+      // In -bf-bb-freq mode, multiply each basic block's execution
+      // count by its static counts.
+      ByteFlopCounters bb_freq_totals;
+      if (bf_bb_freq)
+        expand_bb_frequencies(state, bb_freq_totals);
+
+      // Convert the thread's function-ID-indexed tallies to
+      // name-keyed tallies.
+      for (size_t funcid = 0; funcid < state->func_id_totals.size(); funcid++)
+        if (state->func_id_totals[funcid] != NULL)
+          accumulate_by_name(state->per_func_totals,
+                             bf_string_to_symbol(func_id_name(funcid)),
+                             state->func_id_totals[funcid]);
+      for (size_t funcid = 0; funcid < state->func_id_tallies.size(); funcid++)
+        if (state->func_id_tallies[funcid] > 0)
+          state->func_call_tallies[bf_string_to_symbol(func_id_name(funcid))] += state->func_id_tallies[funcid];
+      if (bf_call_stack)
+        merge_calling_contexts(state);
+
+      // If the thread's counter totals are empty, this means that we
+      // were tallying per-function data and resetting the counts
+      // after each tally.  We therefore reconstruct the lost counts
+      // from the per-function tallies.  In -bf-bb-freq mode the
+      // per-function tallies already include the static counts.
+      if (bf_bb_freq && !bf_per_func)
+        state->global_totals.accumulate(&bb_freq_totals);
+      else if (state->global_totals.terminators[BF_END_BB_ANY] == 0)
+        for (counter_iterator sm_iter = state->per_func_totals.begin();
+             sm_iter != state->per_func_totals.end();
+             sm_iter++)
+          state->global_totals.accumulate(sm_iter->second);
+      global_totals.accumulate(&state->global_totals);
+
+      // Merge the thread's per-function and user-defined tallies.
+      merge_counter_map(state->per_func_totals, per_func_totals());
+      merge_counter_map(state->user_defined_totals, user_defined_totals());
+      for (str2num_t::iterator sm_iter = state->func_call_tallies.begin();
+           sm_iter != state->func_call_tallies.end();
+           sm_iter++)
+        func_call_tallies()[bf_string_to_symbol(sm_iter->first)] += sm_iter->second;
+      if (state->call_tree->max_depth > max_call_depth)
+        max_call_depth = state->call_tree->max_depth;
+    }
+    pthread_mutex_unlock(&thread_state_lock);
+  }
 
   // Compare two strings.
   static bool compare_char_stars (const char* one, const char* two) {
@@ -691,6 +1498,28 @@ private:
       return compare_char_stars(one, two);
   }
 
+  // Compare two {site, misses} pairs, reporting which has more misses
+  // in the last level of the cache hierarchy, then in each level
+  // above it.  Break ties by comparing site descriptions.
+  typedef pair<const char*, vector<uint64_t> > site_misses;
+  static bool compare_site_misses (const site_misses& one, const site_misses& two) {
+    for (size_t i = one.second.size(); i > 0; i--)
+      if (one.second[i-1] != two.second[i-1])
+        return one.second[i-1] > two.second[i-1];
+    return compare_char_stars(one.first, two.first);
+  }
+
+  // Compare two cache lines, reporting which incurred more
+  // false-sharing invalidations, then more invalidations overall.
+  // Break ties by comparing addresses.
+  static bool compare_false_sharing (const false_sharing_t& one, const false_sharing_t& two) {
+    if (one.false_invalidations != two.false_invalidations)
+      return one.false_invalidations > two.false_invalidations;
+    if (one.invalidations != two.invalidations)
+      return one.invalidations > two.invalidations;
+    return one.address < two.address;
+  }
+
   // Compare two {name, tally} pairs, reporting which has the greater
   // tally.  Break ties by comparing names.
   typedef pair<const char*, uint64_t> name_tally;
@@ -701,6 +1530,137 @@ private:
       return strcmp(one.first, two.first);
   }
 
+  // Report per-call-path counter totals that include all callees.
+  void report_inclusive_by_call_path (void) {
+    // Output a header line.
+    *bfout << bf_output_prefix
+           << "BYFL_INCLUSIVE_HEADER: "
+           << setw(HDR_COL_WIDTH) << "LD_bytes" << ' '
+           << setw(HDR_COL_WIDTH) << "ST_bytes" << ' '
+           << setw(HDR_COL_WIDTH) << "LD_ops" << ' '
+           << setw(HDR_COL_WIDTH) << "ST_ops" << ' '
+           << setw(HDR_COL_WIDTH) << "Flops" << ' '
+           << setw(HDR_COL_WIDTH) << "FP_bits" << ' '
+           << setw(HDR_COL_WIDTH) << "Int_ops" << ' '
+           << setw(HDR_COL_WIDTH) << "Int_op_bits" << ' '
+           << setw(HDR_COL_WIDTH) << "Cond_brs" << ' '
+           << setw(HDR_COL_WIDTH) << "Invocations" << ' '
+           << "Function";
+    for (size_t i=0; i<max_call_depth-1; i++)
+      *bfout << ' '
+             << "Parent_func_" << i+1;
+    *bfout << '\n';
+
+    // Output the data by sorted call path.
+    vector<const char*>* all_path_names = inclusive_totals().sorted_keys(compare_char_stars);
+    for (vector<const char*>::iterator pn_iter = all_path_names->begin();
+         pn_iter != all_path_names->end();
+         pn_iter++) {
+      const char* path_name = *pn_iter;
+      ByteFlopCounters* path_counters = inclusive_totals()[path_name];
+      *bfout << bf_output_prefix
+             << "BYFL_INCLUSIVE:        "
+             << setw(HDR_COL_WIDTH) << path_counters->loads << ' '
+             << setw(HDR_COL_WIDTH) << path_counters->stores << ' '
+             << setw(HDR_COL_WIDTH) << path_counters->load_ins << ' '
+             << setw(HDR_COL_WIDTH) << path_counters->store_ins << ' '
+             << setw(HDR_COL_WIDTH) << path_counters->flops << ' '
+             << setw(HDR_COL_WIDTH) << path_counters->fp_bits << ' '
+             << setw(HDR_COL_WIDTH) << path_counters->ops << ' '
+             << setw(HDR_COL_WIDTH) << path_counters->op_bits << ' '
+             << setw(HDR_COL_WIDTH) << path_counters->terminators[BF_END_BB_DYNAMIC] << ' '
+             << setw(HDR_COL_WIDTH) << func_call_tallies()[path_name] << ' '
+             << path_name << '\n';
+    }
+    delete all_path_names;
+  }
+
+  // Report the bf_miss_sites memory instructions that incurred the
+  // most misses in the cache hierarchy described by BF_CACHE_HIERARCHY.
+  void report_miss_sites (void) {
+    size_t cache_levels = bf_get_cache_hierarchy().size();
+    if (cache_levels == 0)
+      return;
+
+    // Output a header line.
+    *bfout << bf_output_prefix
+           << "BYFL_MISS_SITE_HEADER: ";
+    for (size_t i = 0; i < cache_levels; i++) {
+      stringstream misses_name;
+      misses_name << 'L' << i + 1 << "_misses";
+      *bfout << setw(HDR_COL_WIDTH) << misses_name.str() << ' ';
+    }
+    *bfout << "Site\n";
+
+    // Output the sites with the most last-level misses.
+    vector<site_misses> all_sites = bf_get_miss_sites();
+    size_t num_sites = min(size_t(bf_miss_sites), all_sites.size());
+    partial_sort(all_sites.begin(), all_sites.begin() + num_sites, all_sites.end(),
+                 compare_site_misses);
+    for (size_t s = 0; s < num_sites; s++) {
+      *bfout << bf_output_prefix
+             << "BYFL_MISS_SITE:        ";
+      for (size_t i = 0; i < cache_levels; i++)
+        *bfout << setw(HDR_COL_WIDTH) << all_sites[s].second[i] << ' ';
+
+      // Sites are described as "<file>:<line> <function>".  Demangle
+      // the function name.
+      string site(all_sites[s].first);
+      size_t space = site.find(' ');
+      if (space == string::npos)
+        *bfout << site << '\n';
+      else {
+        string funcname = site.substr(space + 1);
+        string funcname_orig = demangle_func_name(funcname);
+        *bfout << site.substr(0, space) << ' ' << funcname_orig;
+        if (funcname_orig != funcname)
+          *bfout << " [" << funcname << ']';
+        *bfout << '\n';
+      }
+    }
+  }
+
+  // Report the cache lines that incurred the most false-sharing
+  // invalidations.
+  void report_false_sharing (void) {
+    // Output a header line.
+    *bfout << bf_output_prefix
+           << "BYFL_FALSE_SHARING_HEADER: "
+           << setw(HDR_COL_WIDTH) << "Invalidations" << ' '
+           << setw(HDR_COL_WIDTH) << "False_invalidations" << ' '
+           << setw(HDR_COL_WIDTH) << "Threads" << ' '
+           << setw(HDR_COL_WIDTH) << "Disjoint" << ' '
+           << setw(HDR_COL_WIDTH) << "Address" << ' '
+           << "Functions\n";
+
+    // Output the lines with the most false-sharing invalidations.
+    vector<false_sharing_t> all_lines = bf_get_false_sharing();
+    size_t num_lines = min(size_t(bf_get_false_sharing_report_size()), all_lines.size());
+    partial_sort(all_lines.begin(), all_lines.begin() + num_lines, all_lines.end(),
+                 compare_false_sharing);
+    for (size_t l = 0; l < num_lines; l++) {
+      const false_sharing_t& line = all_lines[l];
+      stringstream address;
+      address << "0x" << hex << line.address;
+      *bfout << bf_output_prefix
+             << "BYFL_FALSE_SHARING:        "
+             << setw(HDR_COL_WIDTH) << line.invalidations << ' '
+             << setw(HDR_COL_WIDTH) << line.false_invalidations << ' '
+             << setw(HDR_COL_WIDTH) << line.threads << ' '
+             << setw(HDR_COL_WIDTH) << (line.disjoint ? "Yes" : "No") << ' '
+             << setw(HDR_COL_WIDTH) << address.str();
+      for (size_t f = 0; f < line.funcs.size(); f++) {
+        const false_sharing_func_t& pair = line.funcs[f];
+        *bfout << (f == 0 ? " " : ", ")
+               << (pair.storer == NULL ? "?" : demangle_func_name(pair.storer))
+               << " -> "
+               << (pair.victim == NULL ? "?" : demangle_func_name(pair.victim))
+               << " (" << pair.invalidations << ')';
+      }
+      *bfout << '\n';
+    }
+  }
+
   // Report per-function counter totals.
   void report_by_function (void) {
     // Output a header line.
@@ -717,12 +1677,27 @@ private:
     if (bf_unique_bytes)
       *bfout << ' '
              << setw(HDR_COL_WIDTH) << "Uniq_bytes";
+    size_t cache_levels = bf_cache_model ? bf_get_cache_hierarchy().size() : 0;
+    const char* miss_kind_name[num_miss_kinds] = {"compulsory", "capacity", "conflict"};
+    for (size_t i = 0; i < cache_levels; i++) {
+      stringstream misses_name;
+      misses_name << 'L' << i + 1 << "_misses";
+      *bfout << ' '
+             << setw(HDR_COL_WIDTH) << misses_name.str();
+    }
+    for (size_t i = 0; i < cache_levels; i++)
+      for (int k = 0; k < num_miss_kinds; k++) {
+        stringstream kind_name;
+        kind_name << 'L' << i + 1 << '_' << miss_kind_name[k];
+        *bfout << ' '
+               << setw(HDR_COL_WIDTH) << kind_name.str();
+      }
     *bfout << ' '
            << setw(HDR_COL_WIDTH) << "Cond_brs" << ' '
            << setw(HDR_COL_WIDTH) << "Invocations" << ' '
            << "Function";
     if (bf_call_stack)
-      for (size_t i=0; i<call_stack->max_depth-1; i++)
+      for (size_t i=0; i<max_call_depth-1; i++)
         *bfout << ' '
                << "Parent_func_" << i+1;
     *bfout << '\n';
@@ -749,6 +1724,12 @@ private:
         *bfout << ' '
                << setw(HDR_COL_WIDTH)
                << (bf_mem_footprint ? bf_tally_unique_addresses_tb(funcname_c) : bf_tally_unique_addresses(funcname_c));
+      if (cache_levels > 0) {
+        vector<uint64_t> misses = bf_get_func_cache_misses(funcname_c);
+        for (size_t i = 0; i < cache_levels*(1 + num_miss_kinds); i++)
+          *bfout << ' '
+                 << setw(HDR_COL_WIDTH) << misses[i];
+      }
       *bfout << ' '
              << setw(HDR_COL_WIDTH) << func_counters->terminators[BF_END_BB_DYNAMIC] << ' '
              << setw(HDR_COL_WIDTH) << func_call_tallies()[funcname_c] << ' '
@@ -796,6 +1777,153 @@ private:
     }
   }
 
+  // Return the maximum-to-mean ratio of a list of values (1.0 for a
+  // perfectly balanced list).
+  static double imbalance (const vector<uint64_t>& values) {
+    uint64_t max_value = 0;
+    uint64_t total = 0;
+    for (vector<uint64_t>::const_iterator v_iter = values.begin();
+         v_iter != values.end();
+         v_iter++) {
+      total += *v_iter;
+      if (*v_iter > max_value)
+        max_value = *v_iter;
+    }
+    if (total == 0)
+      return 1.0;
+    return (double)max_value * (double)values.size() / (double)total;
+  }
+
+  // Report per-thread counter totals and the load imbalance across
+  // threads, both for the program as a whole and for each function.
+  void report_by_thread (void) {
+    // Temporarily disable digit separators so the output is easy to parse.
+    locale prev_locale = bfout->imbue(locale::classic());
+    ios_base::fmtflags prev_flags = bfout->flags();
+    streamsize prev_precision = bfout->precision();
+
+    // Output a header line.
+    *bfout << bf_output_prefix
+           << "BYFL_THREAD_HEADER: "
+           << setw(HDR_COL_WIDTH) << "Bytes" << ' '
+           << setw(HDR_COL_WIDTH) << "Flops" << ' '
+           << setw(HDR_COL_WIDTH) << "Ops";
+    if (bf_unique_bytes)
+      *bfout << ' '
+             << setw(HDR_COL_WIDTH) << "Uniq_bytes";
+    *bfout << ' '
+           << "Thread\n";
+
+    // Output one line per thread, keeping track of each metric as we go.
+    vector<uint64_t> bytes, flops, ops, unique_bytes;
+    size_t num_threads = all_thread_states->size();
+    for (size_t t = 0; t < num_threads; t++) {
+      ByteFlopCounters& totals = (*all_thread_states)[t]->global_totals;
+      bytes.push_back(totals.loads + totals.stores);
+      flops.push_back(totals.flops);
+      ops.push_back(totals.ops);
+      *bfout << bf_output_prefix
+             << "BYFL_THREAD:        "
+             << setw(HDR_COL_WIDTH) << bytes.back() << ' '
+             << setw(HDR_COL_WIDTH) << flops.back() << ' '
+             << setw(HDR_COL_WIDTH) << ops.back();
+      if (bf_unique_bytes) {
+        unique_bytes.push_back(bf_mem_footprint ? bf_tally_unique_addresses_tb(t) : bf_tally_unique_addresses(t));
+        *bfout << ' '
+               << setw(HDR_COL_WIDTH) << unique_bytes.back();
+      }
+      *bfout << ' '
+             << t << '\n';
+    }
+
+    // Output the maximum-to-mean ratio of each metric.
+    *bfout << bf_output_prefix
+           << "BYFL_THREAD_IMBALANCE_HEADER: "
+           << setw(HDR_COL_WIDTH) << "Bytes" << ' '
+           << setw(HDR_COL_WIDTH) << "Flops" << ' '
+           << setw(HDR_COL_WIDTH) << "Ops";
+    if (bf_unique_bytes)
+      *bfout << ' '
+             << setw(HDR_COL_WIDTH) << "Uniq_bytes";
+    *bfout << ' '
+           << setw(HDR_COL_WIDTH) << "Threads" << ' '
+           << "Function\n";
+    *bfout << bf_output_prefix
+           << "BYFL_THREAD_IMBALANCE:        "
+           << fixed << setprecision(4)
+           << setw(HDR_COL_WIDTH) << imbalance(bytes) << ' '
+           << setw(HDR_COL_WIDTH) << imbalance(flops) << ' '
+           << setw(HDR_COL_WIDTH) << imbalance(ops);
+    if (bf_unique_bytes)
+      *bfout << ' '
+             << setw(HDR_COL_WIDTH) << imbalance(unique_bytes);
+    *bfout << ' '
+           << setw(HDR_COL_WIDTH) << num_threads << ' '
+           << "[PROGRAM]\n";
+
+    // Output the maximum-to-mean ratio of each metric for each
+    // function.  Threads that never executed the function count as
+    // zero so that a function run by only one thread shows up as
+    // imbalanced.
+    if (bf_per_func) {
+      typedef CachedUnorderedMap<const char*, vector<uint64_t>*> str2vec_t;
+      str2vec_t func_bytes, func_flops, func_ops;
+      str2num_t func_threads;      // Number of threads that executed each function
+      str2num_t func_last_thread;  // 1 + the last thread counted in func_threads
+      for (size_t t = 0; t < num_threads; t++) {
+        str2bfc_t& thread_funcs = (*all_thread_states)[t]->per_func_totals;
+        for (counter_iterator sm_iter = thread_funcs.begin();
+             sm_iter != thread_funcs.end();
+             sm_iter++) {
+          const char* funcname = bf_string_to_symbol(sm_iter->first);
+          ByteFlopCounters* func_counters = sm_iter->second;
+          if (func_bytes.find(funcname) == func_bytes.end()) {
+            func_bytes[funcname] = new vector<uint64_t>(num_threads, 0);
+            func_flops[funcname] = new vector<uint64_t>(num_threads, 0);
+            func_ops[funcname] = new vector<uint64_t>(num_threads, 0);
+          }
+          if (func_last_thread[funcname] != t + 1) {
+            func_last_thread[funcname] = t + 1;
+            func_threads[funcname]++;
+          }
+          (*func_bytes[funcname])[t] += func_counters->loads + func_counters->stores;
+          (*func_flops[funcname])[t] += func_counters->flops;
+          (*func_ops[funcname])[t] += func_counters->ops;
+        }
+      }
+      vector<const char*>* all_func_names = func_bytes.sorted_keys(compare_char_stars);
+      for (vector<const char*>::iterator fn_iter = all_func_names->begin();
+           fn_iter != all_func_names->end();
+           fn_iter++) {
+        const char* funcname = *fn_iter;
+        *bfout << bf_output_prefix
+               << "BYFL_THREAD_IMBALANCE:        "
+               << setw(HDR_COL_WIDTH) << imbalance(*func_bytes[funcname]) << ' '
+               << setw(HDR_COL_WIDTH) << imbalance(*func_flops[funcname]) << ' '
+               << setw(HDR_COL_WIDTH) << imbalance(*func_ops[funcname]);
+        if (bf_unique_bytes) {
+          vector<uint64_t> func_unique_bytes;
+          for (size_t t = 0; t < num_threads; t++)
+            func_unique_bytes.push_back(bf_mem_footprint
+                                        ? bf_tally_unique_addresses_tb(funcname, t)
+                                        : bf_tally_unique_addresses(funcname, t));
+          *bfout << ' '
+                 << setw(HDR_COL_WIDTH) << imbalance(func_unique_bytes);
+        }
+        *bfout << ' '
+               << setw(HDR_COL_WIDTH) << func_threads[funcname] << ' '
+               << funcname << '\n';
+        delete func_bytes[funcname];
+        delete func_flops[funcname];
+        delete func_ops[funcname];
+      }
+      delete all_func_names;
+    }
+    bfout->flags(prev_flags);
+    bfout->precision(prev_precision);
+    bfout->imbue(prev_locale);
+  }
+
   // Report the total counter values across all basic blocks.
   void report_totals (const char* partition, ByteFlopCounters& counter_totals) {
     uint64_t global_bytes = counter_totals.loads + counter_totals.stores;
@@ -1084,6 +2212,58 @@ private:
     // *bfout << tag << ": "
     //       << setw(25) << running_total_bytes << " bytes cover "
     //       << fixed << setw(5) << setprecision(1) << hit_rate*100.0 << "% of memory accesses\n";
+  // Write a binary cache dump (see byfl-cache-dump.h).
+  void write_cache_dump (const char* filename, const bf_cache_dump_header_t& header,
+                         const vector<HitHistogram>& hits) {
+    ofstream dumpfile(filename, ios::binary);
+    dumpfile.write((const char*)&header, sizeof(header));
+    uint64_t offset = sizeof(header) + hits.size()*sizeof(bf_cache_dump_index_t);
+    for (size_t set = 0; set < hits.size(); set++) {
+      bf_cache_dump_index_t entry;
+      entry.offset = offset;
+      entry.bins = hits[set].bins().size();
+      dumpfile.write((const char*)&entry, sizeof(entry));
+      offset += entry.bins*sizeof(uint64_t);
+    }
+    for (size_t set = 0; set < hits.size(); set++) {
+      const vector<uint64_t>& bins = hits[set].bins();
+      dumpfile.write((const char*)bins.data(), bins.size()*sizeof(uint64_t));
+    }
+    dumpfile.close();
+    if (!dumpfile)
+      cerr << "Failed to write " << filename << '\n';
+  }
+
+  // Write a text cache dump.  Sampling parameters are included only
+  // if the cache model was sampled.
+  void write_text_cache_dump (const char* filename, const bf_cache_dump_header_t& header,
+                              const vector<HitHistogram>& hits, bool sampled) {
+    ofstream dumpfile(filename);
+    dumpfile << "Total cache accesses\t" << header.accesses << endl;
+    dumpfile << "Cold misses\t" << header.cold_misses << endl;
+    dumpfile << "Split accesses\t" << header.split_accesses << endl;
+    dumpfile << "Line size\t" << header.line_size << endl;
+    dumpfile << "Capacity misses\t" << header.capacity_misses << endl;
+    if (sampled) {
+      dumpfile << "Sampling threshold\t" << header.sample_threshold << endl;
+      dumpfile << "Sampling modulus\t" << header.sample_modulus << endl;
+      dumpfile << "Sampled lines\t" << header.sampled_lines << endl;
+    }
+    if (header.exact_distance != 0)
+      dumpfile << "Exact distance\t" << header.exact_distance << endl;
+    for(uint64_t set = 0; set < hits.size(); ++set){
+      dumpfile << "Sets\t" << (1 << set) << '\n';
+      const vector<uint64_t>& bins = hits[set].bins();
+      for(uint64_t bin = 0; bin < bins.size(); ++bin){
+        if (bins[bin] != 0)
+          dumpfile << HitHistogram::distance(bin) << '\t' << bins[bin] << '\n';
+      }
+    }
+    dumpfile.close();
+    if (!dumpfile)
+      cerr << "Failed to write " << filename << '\n';
+  }
+
   // Report cache performance if it was used.
   void report_cache (void) {
     /* where n different dump files are created. */
@@ -1091,44 +2271,263 @@ private:
     uint64_t accesses[n] = {bf_get_private_cache_accesses(), 
                             bf_get_shared_cache_accesses(),
                             bf_get_shared_cache_accesses()};
-    vector<unordered_map<uint64_t,uint64_t> > hits[n] = {bf_get_private_cache_hits(), 
-                                                         bf_get_shared_cache_hits(),
-                                                         bf_get_remote_shared_cache_hits()};
+    vector<HitHistogram> hits[n] = {bf_get_private_cache_hits(),
+                                    bf_get_shared_cache_hits(),
+                                    bf_get_remote_shared_cache_hits()};
     uint64_t cold_misses[n] = {bf_get_private_cold_misses(), 
                                bf_get_shared_cold_misses(),
                                bf_get_shared_cold_misses()};
+    uint64_t capacity_misses[n] = {bf_get_private_capacity_misses(),
+                                   bf_get_shared_capacity_misses(),
+                                   bf_get_shared_capacity_misses()};
     uint64_t split_accesses[n] = {bf_get_private_split_accesses(), 
                                   bf_get_shared_split_accesses(),
                                   bf_get_shared_split_accesses()};
+    uint64_t sample_threshold[n] = {bf_get_private_sample_threshold(),
+                                    bf_get_shared_sample_threshold(),
+                                    bf_get_shared_sample_threshold()};
+    uint64_t sampled_lines[n] = {bf_get_private_sampled_lines(),
+                                 bf_get_shared_sampled_lines(),
+                                 bf_get_shared_sampled_lines()};
+    double sample_error[2] = {bf_get_private_sample_error(),
+                              bf_get_shared_sample_error()};
+    WritebackHistogram writebacks[2] = {bf_get_private_writebacks(),
+                                        bf_get_shared_writebacks()};
+    PrefetchHistogram prefetches[2] = {bf_get_private_prefetches(),
+                                       bf_get_shared_prefetches()};
+    bool sampled = bf_cache_sample_threshold < BF_CACHE_SAMPLE_MODULUS || bf_cache_sample_lines != 0;
+
+    bf_cache_dump_header_t headers[n];
+    for(int i = 0; i < n; ++i){
+      bf_cache_dump_header_t& header = headers[i];
+      memcpy(header.magic, BF_CACHE_DUMP_MAGIC, sizeof(header.magic));
+      header.version = BF_CACHE_DUMP_VERSION;
+      header.accesses = accesses[i];
+      header.cold_misses = cold_misses[i];
+      header.split_accesses = split_accesses[i];
+      header.line_size = bf_line_size;
+      header.capacity_misses = capacity_misses[i];
+      header.sample_threshold = sample_threshold[i];
+      header.sample_modulus = BF_CACHE_SAMPLE_MODULUS;
+      header.sampled_lines = sampled_lines[i];
+      header.exact_distance = bf_cache_exact_distance;
+      header.num_histograms = bf_max_set_bits;
+    }
 
+    // Additional line sizes (BF_LINE_SIZES) are dumped to files whose
+    // names include the line size.
+    const vector<uint64_t>& line_sizes = bf_get_line_sizes();
     if (bf_dump_cache){
-      string names[n]{"private-cache.dump",
-                      "shared-cache.dump",
-                      "remote-shared-cache.dump"};
-      ofstream dumpfiles[n];
+      const char* names[n] = {"private-cache.dump",
+                              "shared-cache.dump",
+                              "remote-shared-cache.dump"};
       for(int i = 0; i < n; ++i){
-        dumpfiles[i].open(names[i]);
-        dumpfiles[i] << "Total cache accesses\t" << accesses[i] << endl;
-        dumpfiles[i] << "Cold misses\t" << cold_misses[i] << endl;
-        dumpfiles[i] << "Split accesses\t" << split_accesses[i] << endl;
-        dumpfiles[i] << "Line size\t" << bf_line_size << endl;
+        write_text_cache_dump(names[i], headers[i], hits[i], sampled);
       }
-      for(uint64_t set = 0; set < bf_max_set_bits; ++set){
-        // dump the same things for both shared and private caches
-        for(int i = 0; i < n; ++i){
-          dumpfiles[i] << "Sets\t" << (1 << set) << endl;
-          for(const auto& elem : hits[i][set]){
-            dumpfiles[i] << elem.first << "\t" << elem.second << endl;
-          }
+      for(size_t ls = 1; ls < line_sizes.size(); ++ls){
+        for(int i = 0; i < 2; ++i){
+          stringstream name;
+          name << (i == 0 ? "private" : "shared") << "-cache-" << line_sizes[ls] << ".dump";
+          write_text_cache_dump(name.str().c_str(), bf_get_cache_summary(ls, i == 1),
+                                bf_get_cache_hits_by_line_size(ls, i == 1), sampled);
         }
       }
+    }
+    if (bf_dump_cache_binary){
+      const char* names[n] = {"private-cache.bdump",
+                              "shared-cache.bdump",
+                              "remote-shared-cache.bdump"};
       for(int i = 0; i < n; ++i){
-        dumpfiles[i].close();
+        write_cache_dump(names[i], headers[i], hits[i]);
+      }
+      for(size_t ls = 1; ls < line_sizes.size(); ++ls){
+        for(int i = 0; i < 2; ++i){
+          stringstream name;
+          name << (i == 0 ? "private" : "shared") << "-cache-" << line_sizes[ls] << ".bdump";
+          write_cache_dump(name.str().c_str(), bf_get_cache_summary(ls, i == 1),
+                           bf_get_cache_hits_by_line_size(ls, i == 1));
+        }
+      }
+    }
+
+    // Dump write-backs in the text format with either kind of cache
+    // dump.  Each line gives the change in the number of write-backs
+    // when the number of ways reaches the given distance, so a cache
+    // with W ways incurs the sum of the changes at distances up to W.
+    if (bf_dump_cache || bf_dump_cache_binary){
+      string wb_names[2]{"private-writebacks.dump",
+                         "shared-writebacks.dump"};
+      for(int i = 0; i < 2; ++i){
+        ofstream wb_dumpfile(wb_names[i]);
+        wb_dumpfile << "Line size\t" << bf_line_size << endl;
+        for(uint64_t set = 0; set < bf_max_set_bits; ++set){
+          wb_dumpfile << "Sets\t" << (1 << set) << '\n';
+          const vector<uint64_t>& from = writebacks[i].from[set].bins();
+          const vector<uint64_t>& until = writebacks[i].until[set].bins();
+          for(uint64_t bin = 0; bin < max(from.size(), until.size()); ++bin){
+            int64_t change = int64_t(bin < from.size() ? from[bin] : 0)
+              - int64_t(bin < until.size() ? until[bin] : 0);
+            if (change != 0)
+              wb_dumpfile << HitHistogram::distance(bin) << '\t' << change << '\n';
+          }
+        }
+        wb_dumpfile.close();
       }
     }
 
     string tag(bf_output_prefix + "BYFL_SUMMARY");
     *bfout << tag << ": " << setw(25) << accesses[0] << " Total cache accesses\n";
+    if (bf_prefetching())
+      *bfout << tag << ": " << setw(25) << prefetches[0].issued << " Total prefetches\n";
+
+    // Report each level of the cache hierarchy, if one was described.
+    // As in bf-parse-cache-dump, a level's misses are the accesses
+    // that miss in a cache of that geometry, and the levels above it
+    // are assumed to filter its accesses.  Levels that don't use LRU
+    // replacement were simulated directly instead, though their
+    // write-backs are still estimated as for LRU.
+    const vector<cache_level_t>& hierarchy = bf_get_cache_hierarchy();
+    vector<uint64_t> simulated_misses = bf_get_simulated_misses();
+    const char* policy_name[] = {"LRU", "pseudo-LRU", "SRRIP", "BRRIP", "random"};
+    uint64_t level_accesses = accesses[0];
+    uint64_t level_writebacks = 0;
+    for (size_t i = 0; i < hierarchy.size(); ++i) {
+      const cache_level_t& level = hierarchy[i];
+      int model = level.shared ? 1 : 0;
+      uint64_t model_misses = simulated_misses[i];
+      if (level.policy == REPLACE_LRU) {
+        uint64_t model_hits = hits[model][level.set_bits].hits_within(level.ways);
+        model_misses = accesses[model] - min(model_hits, accesses[model]);
+      }
+      uint64_t misses = min(model_misses, level_accesses);
+      uint64_t level_hits = level_accesses - misses;
+      level_writebacks = writebacks[model].writebacks(level.set_bits, level.ways);
+      *bfout << tag << ": " << setw(25) << level_accesses << " L" << i + 1
+             << " cache accesses (" << level.size << " bytes, " << level.ways
+             << "-way, " << (level.shared ? "shared" : "private") << ", "
+             << policy_name[level.policy] << ")\n";
+      *bfout << tag << ": " << setw(25) << level_hits << " L" << i + 1 << " cache hits\n";
+      *bfout << tag << ": " << setw(25) << misses << " L" << i + 1 << " cache misses\n";
+      *bfout << tag << ": " << fixed << setw(25) << setprecision(4)
+             << (level_accesses == 0 ? 0.0 : double(misses)/double(level_accesses))
+             << " L" << i + 1 << " cache miss rate\n";
+
+      // Split the misses into compulsory misses (first touches),
+      // capacity misses (those a fully associative LRU cache of the
+      // same capacity also incurs), and conflict misses (the rest).
+      uint64_t level_lines = level.ways << level.set_bits;
+      uint64_t fa_hits = hits[model][0].hits_within(level_lines);
+      uint64_t fa_misses = accesses[model] - min(fa_hits, accesses[model]);
+      uint64_t compulsory = min(cold_misses[model], misses);
+      uint64_t capacity = min(fa_misses - min(cold_misses[model], fa_misses), misses - compulsory);
+      *bfout << tag << ": " << setw(25) << compulsory << " L" << i + 1 << " compulsory misses\n";
+      *bfout << tag << ": " << setw(25) << capacity << " L" << i + 1 << " capacity misses\n";
+      *bfout << tag << ": " << setw(25) << misses - compulsory - capacity << " L" << i + 1 << " conflict misses\n";
+      *bfout << tag << ": " << setw(25) << level_writebacks << " L" << i + 1 << " cache write-backs\n";
+      if (bf_prefetching()) {
+        const PrefetchHistogram& level_prefetches = prefetches[model];
+        uint64_t useful = level_prefetches.useful(level.set_bits, level.ways);
+        uint64_t late = level_prefetches.late(level.set_bits, level.ways);
+        uint64_t redundant = level_prefetches.redundant_within(level.set_bits, level.ways);
+        uint64_t useless = level_prefetches.issued - min(useful + late + redundant, level_prefetches.issued);
+        *bfout << tag << ": " << setw(25) << useful << " L" << i + 1 << " useful prefetches\n";
+        *bfout << tag << ": " << setw(25) << late << " L" << i + 1 << " late prefetches\n";
+        *bfout << tag << ": " << setw(25) << redundant << " L" << i + 1 << " redundant prefetches\n";
+        *bfout << tag << ": " << setw(25) << useless << " L" << i + 1 << " useless prefetches\n";
+      }
+      level_accesses = misses;
+    }
+    if (!hierarchy.empty()) {
+      // Memory supplies the last level's misses and absorbs its
+      // write-backs.
+      *bfout << tag << ": " << setw(25) << level_accesses*bf_line_size
+             << " bytes read from memory\n";
+      *bfout << tag << ": " << setw(25) << level_writebacks*bf_line_size
+             << " bytes written to memory\n";
+    }
+
+    // Report the LRU misses of each level of the hierarchy for each
+    // additional line size, keeping each level's capacity and ways.
+    for (size_t ls = 1; ls < line_sizes.size(); ++ls) {
+      uint64_t ls_accesses[2] = {bf_get_cache_summary(ls, false).accesses,
+                                 bf_get_cache_summary(ls, true).accesses};
+      vector<HitHistogram> ls_hits[2] = {bf_get_cache_hits_by_line_size(ls, false),
+                                         bf_get_cache_hits_by_line_size(ls, true)};
+      *bfout << tag << ": " << setw(25) << ls_accesses[0] << " Total cache accesses ("
+             << line_sizes[ls] << "-byte lines)\n";
+      const vector<cache_level_t>& ls_hierarchy = bf_get_cache_hierarchy_by_line_size(ls);
+      uint64_t ls_level_accesses = ls_accesses[0];
+      for (size_t i = 0; i < ls_hierarchy.size(); ++i) {
+        // Skip the levels that can't be modeled with this line size
+        // (initialize_cache() said why), letting the next level see
+        // the misses of the last one reported.
+        const cache_level_t& level = ls_hierarchy[i];
+        if (level.ways == 0)
+          continue;
+        int model = level.shared ? 1 : 0;
+        uint64_t model_hits = ls_hits[model][level.set_bits].hits_within(level.ways);
+        uint64_t misses = min(ls_accesses[model] - min(model_hits, ls_accesses[model]), ls_level_accesses);
+        *bfout << tag << ": " << setw(25) << misses << " L" << i + 1
+               << " cache misses (" << line_sizes[ls] << "-byte lines)\n";
+        *bfout << tag << ": " << fixed << setw(25) << setprecision(4)
+               << (ls_level_accesses == 0 ? 0.0 : double(misses)/double(ls_level_accesses))
+               << " L" << i + 1 << " cache miss rate (" << line_sizes[ls] << "-byte lines)\n";
+        ls_level_accesses = misses;
+      }
+    }
+
+    // Report coherence traffic if false sharing was sought.
+    if (bf_get_false_sharing_report_size() > 0) {
+      uint64_t invalidations, false_invalidations;
+      bf_get_coherence_invalidations(&invalidations, &false_invalidations);
+      *bfout << tag << ": " << setw(25) << invalidations
+             << " coherence invalidations\n";
+      *bfout << tag << ": " << setw(25) << false_invalidations
+             << " false-sharing invalidations\n";
+    }
+
+    // Report each level of the TLB hierarchy, if one was described,
+    // for each page size.  Levels filter each other's accesses as in
+    // the cache hierarchy, so the last level's misses are page walks.
+    const vector<tlb_level_t>& tlb_hierarchy = bf_get_tlb_hierarchy();
+    vector<uint64_t> page_sizes = bf_get_tlb_page_sizes();
+    for (size_t p = 0; p < page_sizes.size() && !tlb_hierarchy.empty(); ++p) {
+      uint64_t page_accesses = bf_get_tlb_accesses(p);
+      vector<HitHistogram> page_hits = bf_get_tlb_hits(p);
+      uint64_t tlb_accesses = page_accesses;
+      for (size_t i = 0; i < tlb_hierarchy.size(); ++i) {
+        const tlb_level_t& level = tlb_hierarchy[i];
+        uint64_t model_hits = page_hits[level.set_bits].hits_within(level.ways);
+        uint64_t misses = min(page_accesses - min(model_hits, page_accesses), tlb_accesses);
+        *bfout << tag << ": " << setw(25) << misses << " L" << i + 1
+               << " dTLB misses (" << level.entries << " entries, " << level.ways
+               << "-way, " << page_sizes[p] << "-byte pages)\n";
+        *bfout << tag << ": " << fixed << setw(25) << setprecision(4)
+               << (tlb_accesses == 0 ? 0.0 : double(misses)/double(tlb_accesses))
+               << " L" << i + 1 << " dTLB miss rate (" << page_sizes[p]
+               << "-byte pages)\n";
+        tlb_accesses = misses;
+      }
+    }
+    uint64_t late_accesses = bf_get_shared_late_accesses();
+    if (late_accesses > 0)
+      *bfout << tag << ": " << setw(25) << late_accesses
+             << " accesses replayed out of order by the shared cache model\n";
+    if (sampled) {
+      const char* model_name[2] = {"private", "shared"};
+      for (int i = 0; i < 2; ++i) {
+        double rate = double(sample_threshold[i])/double(BF_CACHE_SAMPLE_MODULUS);
+        *bfout << tag << ": " << fixed << setw(25) << setprecision(4)
+               << rate*100.0 << "% of cache lines modeled by the "
+               << model_name[i] << " cache model\n";
+        *bfout << tag << ": " << setw(25) << sampled_lines[i]
+               << " distinct cache lines modeled by the "
+               << model_name[i] << " cache model\n";
+        *bfout << tag << ": " << fixed << setw(25) << setprecision(4)
+               << sample_error[i] << " bound on the error in " << model_name[i]
+               << "-cache miss ratios (95% confidence)\n";
+      }
+    }
     *bfout << tag << ": " << separator << '\n';
 
   }
@@ -1136,6 +2535,7 @@ private:
 public:
   RunAtEndOfProgram() {
     separator = "-----------------------------------------------------------------";
+    max_call_depth = 0;
   }
 
   ~RunAtEndOfProgram() {
@@ -1144,40 +2544,33 @@ public:
     if (suppress_output())
       return;
 
+    // Output any buffered basic-block tallies.
+    if (bb_reporter != NULL)
+      bb_reporter->finish();
+
+    // Combine all threads' counters into a single set of totals.
+    merge_thread_states();
+
     // Report per-function counter totals.
     if (bf_per_func)
       report_by_function();
 
+    // Report per-call-path totals including callees.
+    if (bf_call_stack)
+      report_inclusive_by_call_path();
+
+    // Report the memory instructions that incurred the most cache
+    // misses.
+    if (bf_cache_model && bf_miss_sites > 0)
+      report_miss_sites();
+
+    // Report the cache lines most subject to false sharing.
+    if (bf_cache_model && bf_get_false_sharing_report_size() > 0)
+      report_false_sharing();
+
     // Output a histogram of vector usage.
     if (bf_vectors)
-      bf_report_vector_operations(call_stack->max_depth);
-
-    // If we're not instrumented on the basic-block level, then we
-    // need to accumulate the current values of all of our counters
-    // into the global totals.
-    if (!bf_every_bb)
-      global_totals.accumulate(bf_mem_insts_count,
-                               bf_inst_mix_histo,
-                               bf_terminator_count,
-                               bf_mem_intrin_count,
-                               bf_load_count,
-                               bf_store_count,
-                               bf_load_ins_count,
-                               bf_store_ins_count,
-                               bf_flop_count,
-                               bf_fp_bits_count,
-                               bf_op_count,
-                               bf_op_bits_count);
-
-    // If the global counter totals are empty, this means that we were
-    // tallying per-function data and resetting the global counts
-    // after each tally.  We therefore reconstruct the lost global
-    // counts from the per-function tallies.
-    if (global_totals.terminators[BF_END_BB_ANY] == 0)
-      for (counter_iterator sm_iter = per_func_totals().begin();
-           sm_iter != per_func_totals().end();
-           sm_iter++)
-        global_totals.accumulate(sm_iter->second);
+      bf_report_vector_operations(max_call_depth);
 
     // Report user-defined counter totals, if any.
     vector<const char*>* all_tag_names = user_defined_totals().sorted_keys(compare_char_stars);
@@ -1191,6 +2584,11 @@ public:
     // Report the global counter totals across all basic blocks.
     report_totals(NULL, global_totals);
 
+    // Report the per-thread counter totals and load imbalance if the
+    // program is multithreaded.
+    if (bf_thread_safe)
+      report_by_thread();
+
     // Report the cache performance if it was turned on.
     if (bf_cache_model) {
       report_cache();
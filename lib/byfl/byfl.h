@@ -25,11 +25,13 @@
 #include <wordexp.h>
 
 #include "byfl-common.h"
+#include "byfl-cache-dump.h"
 #include "cachemap.h"
 #include "opcode2name.h"
 
 // The following constants are defined by the instrumented code.
 extern uint64_t bf_bb_merge;         // Number of basic blocks to merge to compress the output
+extern uint8_t  bf_bb_freq;          // 1=count only basic-block executions
 extern uint8_t  bf_call_stack;       // 1=maintain a function call stack
 extern uint8_t  bf_every_bb;         // 1=tally and output per-basic-block data
 extern uint64_t bf_max_reuse_distance;  // Maximum reuse distance to consider */
@@ -37,6 +39,7 @@ extern const char* bf_option_string; // -bf-* command-line options
 extern uint8_t  bf_per_func;         // 1=tally and output per-function data
 extern uint8_t  bf_mem_footprint;    // 1=keep track of how many times each byte of memory is accessed
 extern uint8_t  bf_tally_inst_mix;   // 1=maintain instruction mix histogram
+extern uint8_t  bf_thread_safe;      // 1=program is multithreaded
 extern uint8_t  bf_types;            // 1=count loads/stores per type
 extern uint8_t  bf_unique_bytes;     // 1=tally and output unique bytes
 extern uint8_t  bf_vectors;          // 1=bin then output vector characteristics
@@ -44,6 +47,12 @@ extern uint8_t  bf_cache_model;      // 1=use the simple cache model
 extern uint64_t bf_line_size;        // cache line size in bytes
 extern uint8_t  bf_dump_cache;       // 1=dump all cache information to a file
 extern uint64_t bf_max_set_bits;     // log base 2 of max number of sets to model
+extern uint64_t bf_cache_max_bytes;  // largest cache size to model (0=unlimited)
+extern uint64_t bf_cache_sample_threshold;  // model lines whose hash is below this (out of 2^24)
+extern uint64_t bf_cache_sample_lines;      // lines to model before sampling fewer (0=fixed rate)
+extern uint64_t bf_miss_sites;       // number of memory instructions with the most misses to report
+extern uint64_t bf_cache_exact_distance;    // largest reuse distance counted exactly (0=all)
+extern uint8_t  bf_dump_cache_binary;       // 1=dump cache information in binary
 
 // The following function is expected to be overridden by user code.
 extern "C" {
@@ -56,8 +65,113 @@ namespace bytesflops {
   const bytecount_t bf_max_bytecount = ~(bytecount_t)(0);  // Clamp to this value
   typedef pair<bytecount_t, bytecount_t> bf_addr_tally_t;  // Number of times a count was seen ({count, multiplier})
 
+  // Count cache hits by reuse distance in a dense array of bins
+  // (cf. bf_cache_distance_to_bin()).
+  class HitHistogram {
+  public:
+    // Add hits at a given reuse distance.
+    void add (uint64_t distance, uint64_t count) {
+      add_to_bin(bf_cache_distance_to_bin(distance, bf_cache_exact_distance), count);
+    }
+
+    // Add hits to a given bin.
+    void add_to_bin (uint64_t bin, uint64_t count) {
+      if (bin >= counts.size())
+        counts.resize(bin + 1, 0);
+      counts[bin] += count;
+    }
+
+    // Return the hit count in each bin.
+    const vector<uint64_t>& bins (void) const {
+      return counts;
+    }
+
+    // Return the largest reuse distance counted by a given bin.
+    static uint64_t distance (uint64_t bin) {
+      return bf_cache_bin_to_distance(bin, bf_cache_exact_distance);
+    }
+
+    // Return the number of hits at a reuse distance no greater than
+    // a given distance.
+    uint64_t hits_within (uint64_t max_distance) const {
+      uint64_t total = 0;
+      for (uint64_t bin = 0; bin < counts.size() && distance(bin) <= max_distance; bin++)
+        total += counts[bin];
+      return total;
+    }
+
+  private:
+    vector<uint64_t> counts;   // Number of hits in each bin
+  };
+
+  // Count write-backs of dirty lines for each set count.  A cache
+  // with a given number of ways writes back a line that is evicted
+  // between two accesses if the line was stored to since the last
+  // time the cache missed on it.  Each write-back is counted in
+  // "from" at the fewest ways that incur it and in "until" at the
+  // fewest ways that avoid it (if any).
+  class WritebackHistogram {
+  public:
+    vector<HitHistogram> from;    // Write-backs by the fewest ways that incur them
+    vector<HitHistogram> until;   // Write-backs by the fewest ways that avoid them
+
+    WritebackHistogram (size_t set_counts) : from(set_counts), until(set_counts) {}
+
+    // Return the number of write-backs in a cache with 2^set_bits
+    // sets and the given number of ways.
+    uint64_t writebacks (uint64_t set_bits, uint64_t ways) const {
+      uint64_t incurred = from[set_bits].hits_within(ways);
+      uint64_t avoided = until[set_bits].hits_within(ways);
+      return incurred > avoided ? incurred - avoided : 0;
+    }
+  };
+
+  // Count prefetches for each set count.  A prefetch is redundant in
+  // a cache with a given number of ways if the line was already there
+  // (its reuse distance at the prefetch is no greater than that).  It
+  // is useful if the line was not there and the next access to the
+  // line hits before the cache evicts it.  Useful prefetches whose
+  // access came before the line could have arrived are counted as
+  // late instead.  As with WritebackHistogram, useful and late
+  // prefetches are counted in "from" at the fewest ways that benefit
+  // and in "until" at the fewest ways that already held the line.
+  class PrefetchHistogram {
+  public:
+    uint64_t issued;                  // Prefetches issued
+    vector<HitHistogram> useful_from; // Timely useful prefetches by the fewest ways that benefit
+    vector<HitHistogram> useful_until;// Timely useful prefetches by the fewest ways that held the line
+    vector<HitHistogram> late_from;   // Late useful prefetches by the fewest ways that benefit
+    vector<HitHistogram> late_until;  // Late useful prefetches by the fewest ways that held the line
+    vector<HitHistogram> redundant;   // Prefetches by reuse distance of the prefetched line
+
+    PrefetchHistogram (size_t set_counts) :
+      issued(0), useful_from(set_counts), useful_until(set_counts),
+      late_from(set_counts), late_until(set_counts), redundant(set_counts) {}
+
+    // Return the number of timely useful, late, and redundant
+    // prefetches in a cache with 2^set_bits sets and the given number
+    // of ways.
+    uint64_t useful (uint64_t set_bits, uint64_t ways) const {
+      return within(useful_from[set_bits], useful_until[set_bits], ways);
+    }
+    uint64_t late (uint64_t set_bits, uint64_t ways) const {
+      return within(late_from[set_bits], late_until[set_bits], ways);
+    }
+    uint64_t redundant_within (uint64_t set_bits, uint64_t ways) const {
+      return redundant[set_bits].hits_within(ways);
+    }
+
+  private:
+    static uint64_t within (const HitHistogram& from, const HitHistogram& until, uint64_t ways) {
+      uint64_t benefit = from.hits_within(ways);
+      uint64_t held = until.hits_within(ways);
+      return benefit > held ? benefit - held : 0;
+    }
+  };
+
   // The following library functions are used in files other than the
   // one in which they're defined.
+  extern const char* bf_func_and_parents(void);
   extern void bf_get_address_tally_hist (vector<bf_addr_tally_t>& histogram, uint64_t* total);
   extern void bf_get_median_reuse_distance(uint64_t* median_value, uint64_t* mad_value);
   extern void bf_get_reuse_distance(vector<uint64_t>** hist, uint64_t* unique_addrs);
@@ -69,6 +183,10 @@ namespace bytesflops {
   extern uint64_t bf_tally_unique_addresses_tb(const char* funcname);
   extern uint64_t bf_tally_unique_addresses_tb(void);
   extern uint64_t bf_tally_unique_addresses(void);
+  extern uint64_t bf_tally_unique_addresses_tb(size_t thread_id);
+  extern uint64_t bf_tally_unique_addresses(size_t thread_id);
+  extern uint64_t bf_tally_unique_addresses_tb(const char* funcname, size_t thread_id);
+  extern uint64_t bf_tally_unique_addresses(const char* funcname, size_t thread_id);
   extern const char* bf_string_to_symbol(const char *nonunique);
   extern void initialize_byfl(void);
   extern void initialize_reuse(void);
@@ -79,18 +197,98 @@ namespace bytesflops {
   extern void initialize_vectors(void);
   extern void initialize_cache(void);
   extern uint64_t bf_get_private_cache_accesses(void);
-  extern vector<unordered_map<uint64_t,uint64_t> > bf_get_private_cache_hits(void);
+  extern vector<HitHistogram> bf_get_private_cache_hits(void);
   extern uint64_t bf_get_private_cold_misses(void);
+  extern uint64_t bf_get_private_capacity_misses(void);
   extern uint64_t bf_get_private_split_accesses(void);
   extern uint64_t bf_get_shared_cache_accesses(void);
-  extern vector<unordered_map<uint64_t,uint64_t> > bf_get_shared_cache_hits(void);
+  extern vector<HitHistogram> bf_get_shared_cache_hits(void);
   extern uint64_t bf_get_shared_cold_misses(void);
+  extern uint64_t bf_get_shared_capacity_misses(void);
   extern uint64_t bf_get_shared_split_accesses(void);
-  extern vector<unordered_map<uint64_t,uint64_t> > bf_get_remote_shared_cache_hits(void);
+  extern uint64_t bf_get_shared_late_accesses(void);
+  extern vector<HitHistogram> bf_get_remote_shared_cache_hits(void);
+  extern WritebackHistogram bf_get_private_writebacks(void);
+  extern WritebackHistogram bf_get_shared_writebacks(void);
+  extern PrefetchHistogram bf_get_private_prefetches(void);
+  extern PrefetchHistogram bf_get_shared_prefetches(void);
+  extern bool bf_prefetching(void);
+  extern uint64_t bf_get_private_sample_threshold(void);
+  extern uint64_t bf_get_shared_sample_threshold(void);
+  extern uint64_t bf_get_private_sampled_lines(void);
+  extern uint64_t bf_get_shared_sampled_lines(void);
+  extern double bf_get_private_sample_error(void);
+  extern double bf_get_shared_sample_error(void);
+
+  // Enumerate the replacement policies a cache level can use.
+  typedef enum {
+    REPLACE_LRU,          // True LRU, derived from reuse distances
+    REPLACE_PLRU,         // Tree pseudo-LRU
+    REPLACE_SRRIP,        // Static re-reference interval prediction
+    REPLACE_BRRIP,        // Bimodal re-reference interval prediction
+    REPLACE_RANDOM        // Random replacement
+  } replacement_t;
+
+  // Describe one level of the cache hierarchy given by BF_CACHE_HIERARCHY.
+  typedef struct {
+    uint64_t size;        // Capacity in bytes
+    uint64_t ways;        // Associativity
+    uint64_t set_bits;    // Log base 2 of the number of sets
+    bool shared;          // true=shared by all threads; false=one per thread
+    replacement_t policy; // Replacement policy
+  } cache_level_t;
+  extern const vector<cache_level_t>& bf_get_cache_hierarchy(void);
+  // Classify cache misses by cause.
+  typedef enum {
+    MISS_COMPULSORY,      // First access to a line
+    MISS_CAPACITY,        // Also a miss in a fully associative cache of the same capacity
+    MISS_CONFLICT,        // A hit in a fully associative cache of the same capacity
+    num_miss_kinds
+  } miss_kind_t;
+  extern vector<uint64_t> bf_get_func_cache_misses(const char* funcname);
+  extern vector<uint64_t> bf_get_simulated_misses(void);
+  extern const vector<uint64_t>& bf_get_line_sizes(void);
+  extern bf_cache_dump_header_t bf_get_cache_summary(size_t line_size_index, bool shared);
+  extern vector<HitHistogram> bf_get_cache_hits_by_line_size(size_t line_size_index, bool shared);
+  extern const vector<cache_level_t>& bf_get_cache_hierarchy_by_line_size(size_t line_size_index);
+
+  // Describe one level of the TLB hierarchy given by BF_TLB_HIERARCHY.
+  typedef struct {
+    uint64_t entries;     // Number of translations held
+    uint64_t ways;        // Associativity
+    uint64_t set_bits;    // Log base 2 of the number of sets
+  } tlb_level_t;
+  extern const vector<tlb_level_t>& bf_get_tlb_hierarchy(void);
+
+  // Describe invalidations of a line by stores in one function of
+  // copies last accessed by another function.
+  typedef struct {
+    const char* storer;             // Function whose store invalidated a copy (NULL=unknown)
+    const char* victim;             // Function that last accessed the invalidated copy (NULL=unknown)
+    uint64_t invalidations;         // Number of such invalidations
+  } false_sharing_func_t;
+
+  // Describe a cache line on which one thread's store invalidated
+  // another thread's copy.
+  typedef struct {
+    uint64_t address;               // Address of the line
+    uint64_t invalidations;         // Copies invalidated by other threads' stores
+    uint64_t false_invalidations;   // Invalidations of copies whose bytes weren't stored to
+    uint64_t threads;               // Number of threads that touched the line
+    bool disjoint;                  // true=no thread touched bytes another thread wrote
+    vector<false_sharing_func_t> funcs;  // Some of the invalidating and invalidated functions
+  } false_sharing_t;
+  extern uint64_t bf_get_false_sharing_report_size(void);
+  extern void bf_get_coherence_invalidations(uint64_t* invalidations, uint64_t* false_invalidations);
+  extern vector<false_sharing_t> bf_get_false_sharing(void);
+  extern vector<uint64_t> bf_get_tlb_page_sizes(void);
+  extern uint64_t bf_get_tlb_accesses(size_t page_size_index);
+  extern vector<HitHistogram> bf_get_tlb_hits(size_t page_size_index);
+  extern vector<pair<const char*,vector<uint64_t> > > bf_get_miss_sites(void);
 
   // The following library variables are used in files other than the
   // one in which they're defined.
-  extern const char* bf_func_and_parents;   // Name of the current function and its parents
+  extern __thread size_t bf_thread_id;      // Dense, zero-based ID of the current thread
   extern string bf_output_prefix;           // Prefix appearing before each line of output
   extern const char* opcode2name[];         // Map from an LLVM opcode to its name
 }
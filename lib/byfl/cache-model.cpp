@@ -5,7 +5,16 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <iterator>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <set>
 #include <thread>
 #include <mutex>
 #include <fstream>
@@ -18,135 +27,2139 @@ static __thread unsigned cache_id = 0;
 using namespace bytesflops;
 using namespace std;
 
+// Count, for one cache set, how many distinct lines were accessed
+// more recently than a given line.  Each line in the set is stamped
+// with a set-local time of last access, and a Fenwick tree over those
+// times counts the lines accessed after any given time in O(log N).
+// Stale times are squeezed out whenever the tree fills up.
+class SetRecency {
+  public:
+    SetRecency() : next_time_{1}, oldest_time_{1}, live_lines_{0} {}
+
+    // Return the number of lines last accessed after a given time.
+    uint64_t newerThan(uint32_t time) const {
+      return live_lines_ - prefixSum(time);
+    }
+
+    // Forget the access to a line at a given time.
+    void remove(uint32_t time) {
+      add(time, -1);
+      owners_[time] = no_owner;
+      --live_lines_;
+    }
+
+    // Return the least recently accessed line.  The set must not be
+    // empty.
+    uint32_t oldest() {
+      while(owners_[oldest_time_] == no_owner){
+        ++oldest_time_;
+      }
+      return owners_[oldest_time_];
+    }
+
+    // Return true if there is no room for another access time.
+    bool full() const { return next_time_ >= tree_.size(); }
+
+    // Record an access to a line (identified by the caller's index)
+    // and return its access time.  The caller must ensure first that
+    // the tree isn't full().
+    uint32_t append(uint32_t owner) {
+      auto time = next_time_++;
+      add(time, 1);
+      owners_[time] = owner;
+      ++live_lines_;
+      return time;
+    }
+
+    // Renumber the live access times consecutively from 1, preserving
+    // their order, and make room for at least as many new accesses.
+    // Invoke renumber(owner, new_time) for each live line.
+    template<typename F>
+    void compact(F renumber) {
+      vector<uint32_t> live;
+      live.reserve(live_lines_);
+      for(uint32_t time = 1; time < next_time_; ++time){
+        if(owners_[time] != no_owner){
+          live.push_back(owners_[time]);
+        }
+      }
+      auto capacity = max<size_t>(2*live.size() + 1, 64);
+      tree_.assign(capacity, 0);
+      owners_.assign(capacity, no_owner);
+      next_time_ = 1;
+      oldest_time_ = 1;
+      live_lines_ = 0;
+      for(auto owner : live){
+        renumber(owner, next_time_);
+        owners_[next_time_] = owner;
+        tree_[next_time_] = 1;
+        ++next_time_;
+        ++live_lines_;
+      }
+      // Build the Fenwick tree in place in linear time.
+      for(size_t i = 1; i < capacity; ++i){
+        auto parent = i + (i & -i);
+        if(parent < capacity){
+          tree_[parent] += tree_[i];
+        }
+      }
+    }
+
+  private:
+    static const uint32_t no_owner = ~0U;
+    vector<uint32_t> tree_;    // Fenwick tree over access times (1-based)
+    vector<uint32_t> owners_;  // line index at each access time, or no_owner
+    uint32_t next_time_;       // next access time to assign
+    uint32_t oldest_time_;     // no live line was accessed before this time
+    uint32_t live_lines_;      // number of lines in the set
+
+    void add(size_t time, int32_t delta) {
+      for(; time < tree_.size(); time += time & -time){
+        tree_[time] += delta;
+      }
+    }
+
+    uint32_t prefixSum(size_t time) const {
+      uint32_t sum = 0;
+      for(; time > 0; time -= time & -time){
+        sum += tree_[time];
+      }
+      return sum;
+    }
+};
+
+const uint32_t SetRecency::no_owner;
+
+// Describe the hardware prefetcher given by BF_PREFETCH.
+typedef struct {
+  enum { none, next_line, stride } kind;
+  uint64_t streams;   // number of streams a stride prefetcher tracks
+  uint64_t degree;    // lines prefetched per triggering access
+  uint64_t distance;  // how many lines (or strides) ahead to prefetch
+  uint64_t latency;   // line accesses before a prefetched line arrives
+} prefetch_config_t;
+
+static prefetch_config_t prefetch_config = {prefetch_config_t::none, 16, 1, 1, 8};
+static const prefetch_config_t no_prefetch = {prefetch_config_t::none, 16, 1, 1, 8};
+
+// Model a hardware prefetcher that watches the stream of demand line
+// accesses and proposes lines to bring into the cache.  A next-line
+// prefetcher fetches the lines that follow each newly accessed line.
+// A stride prefetcher keeps a small table of streams, each matched to
+// accesses within 64 lines of its last access, and fetches ahead of a
+// stream once an access repeats its stride.
+class Prefetcher {
+  public:
+    Prefetcher(const prefetch_config_t& config) :
+      config_(config), streams_(config.streams), clock_{0},
+      last_line_{~uint64_t(0)} {}
+
+    // Observe a demand access to a line and append the line numbers
+    // to prefetch to a vector.
+    void observe(uint64_t line_num, vector<uint64_t>& prefetches) {
+      if(config_.kind == prefetch_config_t::next_line){
+        if(line_num == last_line_){
+          return;
+        }
+        last_line_ = line_num;
+        for(uint64_t i = 0; i < config_.degree; ++i){
+          prefetches.push_back(line_num + config_.distance + i);
+        }
+        return;
+      }
+      ++clock_;
+      stream_t* victim = &streams_[0];
+      for(auto& stream : streams_){
+        if(stream.last_used != 0 &&
+           uint64_t(int64_t(line_num - stream.last_line) + window) <= 2*window){
+          train(stream, line_num, prefetches);
+          return;
+        }
+        if(stream.last_used < victim->last_used){
+          victim = &stream;
+        }
+      }
+      *victim = stream_t{line_num, 0, 0, clock_};
+    }
+
+  private:
+    static const int64_t window = 64;   // lines within which an access continues a stream
+    typedef struct {
+      uint64_t last_line;   // line most recently accessed by the stream
+      int64_t stride;       // difference between the last two lines
+      uint64_t confidence;  // consecutive repetitions of stride
+      uint64_t last_used;   // clock_ at the last access (0=unused)
+    } stream_t;
+    prefetch_config_t config_;
+    vector<stream_t> streams_;
+    uint64_t clock_;        // number of accesses observed
+    uint64_t last_line_;    // line most recently observed by a next-line prefetcher
+
+    // Continue a stream with an access to a line.
+    void train(stream_t& stream, uint64_t line_num, vector<uint64_t>& prefetches) {
+      stream.last_used = clock_;
+      int64_t stride = int64_t(line_num - stream.last_line);
+      if(stride == 0){
+        return;
+      }
+      stream.confidence = stride == stream.stride ? stream.confidence + 1 : 0;
+      stream.stride = stride;
+      stream.last_line = line_num;
+      if(stream.confidence == 0){
+        return;
+      }
+      for(uint64_t i = 0; i < config_.degree; ++i){
+        prefetches.push_back(line_num + stride*int64_t(config_.distance + i));
+      }
+    }
+};
+
+const int64_t Prefetcher::window;
+
+// Simulate one set-associative cache level directly, for replacement
+// policies that the stack-distance model, which implies true LRU,
+// can't capture.  Tree pseudo-LRU keeps one bit per internal node of a
+// binary tree over each set's ways, pointing toward the half to evict
+// from.  SRRIP keeps a 2-bit re-reference prediction value per line,
+// inserts lines with a long predicted interval, and promotes them on
+// a hit.  BRRIP inserts most lines with a distant interval instead,
+// which resists thrashing.
+class SetAssocSim {
+  public:
+    SetAssocSim(uint64_t set_bits, uint64_t ways, replacement_t policy) :
+      set_mask_{(uint64_t(1) << set_bits) - 1}, ways_{ways}, policy_{policy},
+      tags_(ways << set_bits, no_line), rrpv_(ways << set_bits, max_rrpv),
+      plru_bits_(uint64_t(1) << set_bits, 0),
+      rng_state_{0x9E3779B97F4A7C15ULL}, misses_{0} {}
+
+    // Access a line and return true if it missed.  Only demand misses
+    // are counted.
+    bool access(uint64_t line_num, bool demand) {
+      auto set = line_num & set_mask_;
+      auto first = set*ways_;
+      for(uint64_t way = 0; way < ways_; ++way){
+        if(tags_[first + way] == line_num){
+          touch(set, way, true);
+          return false;
+        }
+      }
+      if(demand){
+        ++misses_;
+      }
+      auto way = victim(set);
+      tags_[first + way] = line_num;
+      touch(set, way, false);
+      return true;
+    }
+
+    uint64_t getMisses() const { return misses_; }
+
+  private:
+    static const uint64_t no_line = ~uint64_t(0);
+    static const uint8_t max_rrpv = 3;          // most distant re-reference
+    static const uint64_t brrip_long_odds = 32; // BRRIP inserts 1 in this many lines nearer
+    uint64_t set_mask_;
+    uint64_t ways_;
+    replacement_t policy_;
+    vector<uint64_t> tags_;       // line number in each way of each set
+    vector<uint8_t> rrpv_;        // re-reference prediction value of each way
+    vector<uint64_t> plru_bits_;  // tree bits of each set (bit n=node n)
+    uint64_t rng_state_;          // xorshift state for random choices
+    uint64_t misses_;
+
+    uint64_t random() {
+      rng_state_ ^= rng_state_ << 13;
+      rng_state_ ^= rng_state_ >> 7;
+      rng_state_ ^= rng_state_ << 17;
+      return rng_state_;
+    }
+
+    // Choose a way of a set to replace.
+    uint64_t victim(uint64_t set) {
+      auto first = set*ways_;
+      for(uint64_t way = 0; way < ways_; ++way){
+        if(tags_[first + way] == no_line){
+          return way;
+        }
+      }
+      switch(policy_){
+        case REPLACE_PLRU: {
+          // Nodes are numbered as in a binary heap, with the ways as
+          // leaves ways_ through 2*ways_ - 1.
+          uint64_t node = 1;
+          while(node < ways_){
+            node = 2*node + (plru_bits_[set] >> node & 1);
+          }
+          return node - ways_;
+        }
+        case REPLACE_SRRIP:
+        case REPLACE_BRRIP:
+          while(true){
+            for(uint64_t way = 0; way < ways_; ++way){
+              if(rrpv_[first + way] == max_rrpv){
+                return way;
+              }
+            }
+            for(uint64_t way = 0; way < ways_; ++way){
+              ++rrpv_[first + way];
+            }
+          }
+        default:
+          return random() % ways_;
+      }
+    }
+
+    // Update a set's replacement state after a hit on or a fill of a way.
+    void touch(uint64_t set, uint64_t way, bool hit) {
+      switch(policy_){
+        case REPLACE_PLRU:
+          // Point every node on the way's path toward the other half.
+          for(uint64_t node = way + ways_; node > 1; node /= 2){
+            if(node & 1){
+              plru_bits_[set] &= ~(uint64_t(1) << node/2);
+            } else {
+              plru_bits_[set] |= uint64_t(1) << node/2;
+            }
+          }
+          break;
+        case REPLACE_SRRIP:
+          rrpv_[set*ways_ + way] = hit ? 0 : max_rrpv - 1;
+          break;
+        case REPLACE_BRRIP:
+          rrpv_[set*ways_ + way] =
+            hit ? 0 : random() % brrip_long_odds == 0 ? max_rrpv - 1 : max_rrpv;
+          break;
+        default:
+          break;
+      }
+    }
+};
+
+const uint64_t SetAssocSim::no_line;
+const uint8_t SetAssocSim::max_rrpv;
+const uint64_t SetAssocSim::brrip_long_odds;
+
 class Cache {
   public:
-    void access(uint64_t baseaddr, uint64_t numaddrs);
-    Cache(uint64_t line_size, uint64_t max_set_bits, bool record_thread_id) :
+    void access(uint64_t baseaddr, uint64_t numaddrs, unsigned thread_id,
+                const char* func, uint64_t site, bool is_store);
+    static const uint32_t sample_modulus = BF_CACHE_SAMPLE_MODULUS;
+
+    Cache(uint64_t line_size, uint64_t max_set_bits, bool record_thread_id,
+          uint64_t max_bytes, uint64_t sample_threshold,
+          uint64_t sample_lines, const prefetch_config_t& prefetch) :
       line_size_{line_size}, accesses_{0}, split_accesses_{0},
       log2_line_size_{0}, max_set_bits_{max_set_bits}, cold_misses_{0},
+      capacity_misses_{0}, max_lines_{max_bytes / line_size},
+      sample_threshold_{uint32_t(min<uint64_t>(sample_threshold, sample_modulus))},
+      sample_lines_{sample_lines}, sampled_lines_{0}, modeled_accesses_{0},
+      retired_square_refs_{0}, rng_state_{0x2545F4914F6CDD1DULL},
+      sample_shift_{0}, sample_leader_{nullptr},
+      num_levels_{0}, last_func_{nullptr}, last_func_misses_{nullptr},
       hits_(max_set_bits_), record_thread_id_{record_thread_id},
-      remote_hits_(max_set_bits_) {
+      remote_hits_(max_set_bits_), dirty_from_(max_set_bits_),
+      dirty_until_(max_set_bits_), sets_(max_set_bits_), line_clock_{0},
+      prefetch_latency_{prefetch.latency}, prefetches_issued_{0},
+      useful_from_(max_set_bits_), useful_until_(max_set_bits_),
+      late_from_(max_set_bits_), late_until_(max_set_bits_),
+      redundant_prefetches_(max_set_bits_) {
+        if(prefetch.kind != prefetch_config_t::none){
+          prefetcher_.reset(new Prefetcher(prefetch));
+        }
+        sampling_ = sample_threshold_ != sample_modulus || sample_lines_ != 0;
         auto lsize = line_size_;
         while(lsize >>= 1) ++log2_line_size_;
+        for(uint64_t set_bits = 0; set_bits < max_set_bits_; ++set_bits){
+          sets_[set_bits].resize(uint64_t(1) << set_bits);
+        }
+        if(max_bytes != 0){
+          // Remember evicted lines in a Bloom filter with 16 bits per
+          // tracked line (at least 2^20 bits).
+          uint64_t filter_bits = 1 << 20;
+          while(filter_bits < 16*max_lines_) filter_bits <<= 1;
+          evicted_.resize(filter_bits / 64, 0);
+          if(max_lines_ == 0) max_lines_ = 1;
+        }
     }
     uint64_t getAccesses() const { return accesses_; }
-    vector<unordered_map<uint64_t,uint64_t> > getHits() const { return hits_; }
-    uint64_t getColdMisses() const { return cold_misses_; }
+    uint64_t getLineSize() const { return line_size_; }
+
+    // Sample lines by the block_size-byte block containing them so
+    // that models of different line sizes sample the same addresses.
+    // A cache with a leader (nullptr=none) adopts the leader's
+    // sampling threshold instead of adjusting its own.  This must
+    // precede the first access.
+    void shareSampling(uint64_t block_size, const Cache* leader){
+      sample_shift_ = 0;
+      while((line_size_ << sample_shift_) < block_size) ++sample_shift_;
+      sample_leader_ = leader;
+    }
+
+    // Add this cache's hits (or hits to lines last touched by
+    // another thread) to a histogram of each set count's hits.
+    void addHits(vector<HitHistogram>& totals) const { addScaledHits(hits_, totals); }
+    void addRemoteHits(vector<HitHistogram>& totals) const { addScaledHits(remote_hits_, totals); }
+
+    // Add this cache's write-backs, including those of the lines
+    // still dirty at the end of the run, to a histogram of each set
+    // count's write-backs.
+    void addWritebacks(WritebackHistogram& totals) const {
+      addScaledHits(dirty_from_, totals.from);
+      addScaledHits(dirty_until_, totals.until);
+      vector<HitHistogram> still_dirty(max_set_bits_);
+      auto weight = (sample_modulus + sample_threshold_/2) / sample_threshold_;
+      for(const auto& elem : line_index_){
+        for(uint64_t set_bits = 0; set_bits < max_set_bits_; ++set_bits){
+          auto dirty = dirty_dists_[elem.second*max_set_bits_ + set_bits];
+          if(dirty != clean){
+            still_dirty[set_bits].add(dirty, weight);
+          }
+        }
+      }
+      addScaledHits(still_dirty, totals.from);
+    }
+
+    // Add this cache's prefetches to a tally of each set count's
+    // useful, late, and redundant prefetches.
+    void addPrefetches(PrefetchHistogram& totals) const {
+      totals.issued += scaleCount(prefetches_issued_);
+      addScaledHits(useful_from_, totals.useful_from);
+      addScaledHits(useful_until_, totals.useful_until);
+      addScaledHits(late_from_, totals.late_from);
+      addScaledHits(late_until_, totals.late_until);
+      addScaledHits(redundant_prefetches_, totals.redundant);
+    }
+    uint64_t getColdMisses() const { return scaleCount(cold_misses_); }
+    uint64_t getCapacityMisses() const { return scaleCount(capacity_misses_); }
     uint64_t getSplitAccesses() const { return split_accesses_; }
-    int getRightMatch(uint64_t a, uint64_t b);
-    vector<unordered_map<uint64_t,uint64_t> > getRemoteHits() const { return remote_hits_; }
+    uint64_t getSampleThreshold() const { return sampleThreshold(); }
+    uint64_t getSampledLines() const { return sampled_lines_; }
+    uint64_t getModeledAccesses() const { return modeled_accesses_; }
+
+    // Return the sum over all sampled lines of the square of the
+    // number of accesses each line stands for.
+    double getSquareLineAccesses() const {
+      if(!sampling_) return 0.0;
+      auto sum = retired_square_refs_;
+      for(const auto& elem : line_index_){
+        sum += double(line_refs_[elem.second])*line_refs_[elem.second];
+      }
+      return sum;
+    }
+
+    // Simulate each of a hierarchy's shared (or private) levels that
+    // doesn't use LRU replacement.  This must precede
+    // attributeMisses().
+    void simulateLevels(const vector<cache_level_t>& hierarchy, bool shared){
+      for(size_t i = 0; i < hierarchy.size(); ++i){
+        if(hierarchy[i].shared == shared && hierarchy[i].policy != REPLACE_LRU){
+          sims_.push_back(SetAssocSim(hierarchy[i].set_bits, hierarchy[i].ways,
+                                      hierarchy[i].policy));
+          sim_levels_.push_back(i);
+        }
+      }
+      sim_missed_.resize(sims_.size());
+    }
+
+    // Add each simulated level's misses to a per-level total.
+    void addSimulatedMisses(vector<uint64_t>& totals) const {
+      for(size_t i = 0; i < sims_.size(); ++i){
+        totals[sim_levels_[i]] += sims_[i].getMisses();
+      }
+    }
+
+    // Return true if some line accesses must be seen by this cache
+    // even if they aren't sampled.
+    bool needsAllAccesses() const { return prefetcher_ || !sims_.empty(); }
+
+    // Attribute misses in each of a hierarchy's shared (or private)
+    // levels to the function and instruction that made the access.
+    void attributeMisses(const vector<cache_level_t>& hierarchy, bool shared){
+      num_levels_ = hierarchy.size();
+      for(size_t i = 0; i < hierarchy.size(); ++i){
+        if(hierarchy[i].shared == shared){
+          auto sim = find(begin(sim_levels_), end(sim_levels_), i) - begin(sim_levels_);
+          judged_.push_back(judged_level_t{i, hierarchy[i].set_bits, hierarchy[i].ways,
+                hierarchy[i].ways << hierarchy[i].set_bits,
+                size_t(sim) < sims_.size() ? size_t(sim) : no_sim});
+        }
+      }
+      distances_.resize(max_set_bits_);
+    }
+
+    // Get each function's misses in each level of the hierarchy.
+    unordered_map<const char*,vector<uint64_t> > getFuncMisses() const {
+      auto scaled = func_misses_;
+      for(auto& elem : scaled){
+        for(auto& count : elem.second){
+          count = scaleCount(count);
+        }
+      }
+      return scaled;
+    }
+
+    // Get each memory instruction's misses in each level of the
+    // hierarchy, indexed by site ID times the number of levels.
+    vector<uint64_t> getSiteMisses() const {
+      auto scaled = site_misses_;
+      for(auto& count : scaled){
+        count = scaleCount(count);
+      }
+      return scaled;
+    }
+    size_t getNumLevels() const { return num_levels_; }
+
+    // Return true if any line an access touches is sampled.
+    bool samples(uint64_t baseaddr, uint64_t numaddrs) const;
+
+    // Account for line accesses that touched no sampled line without
+    // modeling them.
+    void skip(uint64_t num_accesses, uint64_t split_accesses){
+      followLeader();
+      accesses_ += num_accesses;
+      split_accesses_ += split_accesses;
+    }
+
+  private:
+    uint64_t line_size_;
+    uint64_t accesses_;
+    uint64_t split_accesses_;
+    uint64_t log2_line_size_; // log base 2 of line size
+    uint64_t max_set_bits_; // log base 2 of max number of sets
+    uint64_t cold_misses_;
+    uint64_t capacity_misses_; // misses to lines evicted from tracking
+    uint64_t max_lines_; // max number of lines to track (0=unlimited)
+    uint32_t sample_threshold_; // sample lines whose hash is below this
+    uint64_t sample_lines_; // lines to track before lowering the threshold (0=fixed)
+    bool sampling_; // true=model only a sample of the lines
+    uint64_t sampled_lines_; // number of distinct lines ever sampled
+    uint64_t modeled_accesses_; // accesses the sampled line accesses stand for
+    double retired_square_refs_; // sum of squared line_refs_ of untracked lines
+    uint64_t rng_state_; // xorshift state for rounding rescaled counts
+    uint64_t sample_shift_; // log base 2 of lines per sampled block
+    const Cache* sample_leader_; // cache whose sampling threshold to follow (nullptr=none)
+    // a hierarchy level whose misses this cache attributes to functions
+    typedef struct {
+      size_t level;       // index into the hierarchy
+      uint64_t set_bits;  // log base 2 of the level's number of sets
+      uint64_t ways;      // the level's associativity
+      uint64_t lines;     // the level's capacity in lines
+      size_t sim;         // index into sims_ (no_sim=LRU via reuse distance)
+    } judged_level_t;
+    static const size_t no_sim = ~size_t(0);
+    // simulators for the levels that don't use LRU replacement
+    vector<SetAssocSim> sims_;
+    // for each simulator, its index into the hierarchy
+    vector<size_t> sim_levels_;
+    // for each simulator, 1 if the current line access missed
+    vector<uint8_t> sim_missed_;
+    size_t num_levels_; // number of levels in the hierarchy
+    const char* last_func_; // function most recently looked up in func_misses_
+    vector<uint64_t>* last_func_misses_; // func_misses_[last_func_]
+    vector<judged_level_t> judged_;
+    // reuse distance of the current access for each set count
+    vector<uint64_t> distances_;
+    // for each function, its misses in each level of the hierarchy,
+    // followed by its compulsory, capacity, and conflict misses in
+    // each level (see miss_kind_t)
+    unordered_map<const char*,vector<uint64_t> > func_misses_;
+    // for each memory instruction, its misses in each level of the
+    // hierarchy (site ID times num_levels_ plus level)
+    vector<uint64_t> site_misses_;
+    // for each set count, a histogram of distance to access count
+    vector<HitHistogram> hits_;
+    bool record_thread_id_;
+    // for each set count, a histogram of distance to remote access count
+    vector<HitHistogram> remote_hits_;
+    // A dirty line evicted between two accesses is written back by
+    // caches with at least as many ways as the largest reuse distance
+    // since the line was last stored to but fewer ways than the reuse
+    // distance of the second access.  For each set count, histograms
+    // of those two distances over all write-backs.
+    vector<HitHistogram> dirty_from_;
+    vector<HitHistogram> dirty_until_;
+    // for each line index, the largest reuse distance since the line
+    // was last stored to for each set count (clean=not stored to)
+    vector<uint32_t> dirty_dists_;
+    static const uint32_t clean = ~uint32_t(0);
+    // map from line address to line index
+    unordered_map<uint64_t,uint32_t> line_index_;
+    // for each line index, its access time within its set for each set count
+    vector<uint32_t> times_;
+    // associate thread id with each line index. only used if record_thread_id_.
+    vector<unsigned> thread_ids_;
+    // for each set count, the recency of the lines within each set
+    vector<vector<SetRecency> > sets_;
+    // for each line index, its line address
+    vector<uint64_t> line_addrs_;
+    // line indexes freed by eviction
+    vector<uint32_t> free_lines_;
+    // Bloom filter of line numbers evicted from tracking
+    vector<uint64_t> evicted_;
+    // (hash, line index) of each tracked line. only used if sample_lines_.
+    set<pair<uint32_t,uint32_t> > by_hash_;
+    // for each line index, the accesses it stands for. only used if sampling_.
+    vector<uint64_t> line_refs_;
+    // Prefetched lines are modeled like demand accesses except that
+    // they count neither as accesses nor as hits.  A prefetch whose
+    // reuse distance is P is redundant in caches with at least P
+    // ways.  If the next demand access to the line has reuse distance
+    // D, the prefetch is useful in caches with at least D but fewer
+    // than P ways, or late if the access came too soon after the
+    // prefetch was issued.
+    unique_ptr<Prefetcher> prefetcher_; // nullptr=no prefetching
+    uint64_t line_clock_; // number of demand line accesses so far
+    uint64_t prefetch_latency_; // line accesses before a prefetch is timely
+    uint64_t prefetches_issued_;
+    // for each line index, line_clock_ when it was prefetched. only
+    // used if prefetcher_.
+    vector<uint64_t> prefetch_times_;
+    static const uint64_t not_prefetched = ~uint64_t(0);
+    // for each line index, the largest reuse distance of the
+    // prefetches since its last demand access for each set count
+    // (unbounded=the line wasn't tracked). only used if prefetcher_.
+    vector<uint32_t> prefetch_dists_;
+    static const uint32_t unbounded = ~uint32_t(0);
+    // lines proposed by the prefetcher for the current access
+    vector<uint64_t> prefetches_;
+    // for each set count, histograms of the two distances bounding
+    // useful and late prefetches (see PrefetchHistogram), and of the
+    // reuse distance of every prefetch
+    vector<HitHistogram> useful_from_;
+    vector<HitHistogram> useful_until_;
+    vector<HitHistogram> late_from_;
+    vector<HitHistogram> late_until_;
+    vector<HitHistogram> redundant_prefetches_;
+
+    // Scale a count so that the modeled accesses add up to the actual
+    // number of accesses.  This keeps hits and misses consistent with
+    // the total even when a few heavily used lines are over- or
+    // underrepresented in the sample.
+    uint64_t scaleCount(uint64_t count) const {
+      if(modeled_accesses_ == accesses_ || modeled_accesses_ == 0){
+        return count;
+      }
+      return uint64_t(double(count)*accesses_/modeled_accesses_ + 0.5);
+    }
+
+    void addScaledHits(const vector<HitHistogram>& hits,
+                       vector<HitHistogram>& totals) const {
+      for(size_t set_bits = 0; set_bits < hits.size(); ++set_bits){
+        const auto& bins = hits[set_bits].bins();
+        for(size_t bin = bins.size(); bin-- > 0;){
+          if(bins[bin] != 0){
+            totals[set_bits].add_to_bin(bin, scaleCount(bins[bin]));
+          }
+        }
+      }
+    }
+
+    // Return a line number's sampling hash.
+    static uint32_t sampleHash(uint64_t line_num) {
+      line_num ^= line_num >> 33;
+      line_num *= 0xFF51AFD7ED558CCDULL;
+      line_num ^= line_num >> 33;
+      line_num *= 0xC4CEB9FE1A85EC53ULL;
+      line_num ^= line_num >> 33;
+      return line_num & (sample_modulus - 1);
+    }
+
+    // Return a line number's sampling hash, that of the block
+    // containing it.
+    uint32_t lineHash(uint64_t line_num) const {
+      return sampleHash(line_num >> sample_shift_);
+    }
+
+    // The shared cache's threshold can drop while application threads
+    // filter their accesses against it.
+    uint32_t sampleThreshold() const {
+      return __atomic_load_n(&sample_threshold_, __ATOMIC_RELAXED);
+    }
+
+    // Return the number of accesses each sampled access stands for,
+    // randomly rounded to an integer so that totals stay unbiased.
+    uint64_t sampleWeight() {
+      auto threshold = sample_threshold_;
+      if(threshold == sample_modulus) return 1;
+      rng_state_ ^= rng_state_ << 13;
+      rng_state_ ^= rng_state_ >> 7;
+      rng_state_ ^= rng_state_ << 17;
+      return sample_modulus / threshold +
+        (rng_state_ % threshold < sample_modulus % threshold);
+    }
+
+    // Return a function's misses in each level of the hierarchy.
+    vector<uint64_t>& funcMisses(const char* func) {
+      if(func != last_func_){
+        last_func_ = func;
+        last_func_misses_ = &func_misses_[func];
+        last_func_misses_->resize(num_levels_*(1 + num_miss_kinds), 0);
+      }
+      return *last_func_misses_;
+    }
+
+    // Scale a reuse distance among sampled lines to the full trace.
+    uint64_t scaleDistance(uint64_t idx) const {
+      auto threshold = sample_threshold_;
+      if(threshold == sample_modulus) return idx;
+      return 1 + ((idx - 1)*sample_modulus + threshold/2) / threshold;
+    }
+
+    // Return the set containing a line for a given set count.
+    SetRecency& setOf(uint64_t line_num, uint64_t set_bits) {
+      return sets_[set_bits][line_num & ((uint64_t(1) << set_bits) - 1)];
+    }
+
+    // Return the two Bloom-filter bit positions for a line number.
+    pair<uint64_t,uint64_t> evictedBits(uint64_t line_num) const {
+      auto mask = evicted_.size()*64 - 1;
+      return make_pair((line_num * 0x9E3779B97F4A7C15ULL >> 20) & mask,
+                       (line_num * 0xC2B2AE3D27D4EB4FULL >> 20) & mask);
+    }
+
+    // Return true if a line was probably evicted from tracking.
+    bool wasEvicted(uint64_t line_num) const {
+      if(evicted_.empty()) return false;
+      auto bits = evictedBits(line_num);
+      return (evicted_[bits.first / 64] >> (bits.first % 64) & 1) &&
+             (evicted_[bits.second / 64] >> (bits.second % 64) & 1);
+    }
+
+    // Return true if a line is modeled under the current sampling
+    // threshold.
+    bool sampledLine(uint64_t line_num) const {
+      return sample_threshold_ == sample_modulus ||
+             lineHash(line_num) < sample_threshold_;
+    }
+
+    // Model an access to a single line, either on demand or by the
+    // prefetcher.
+    void accessLine(uint64_t addr, unsigned thread_id, const char* func,
+                    uint64_t site, bool is_store, bool prefetch);
+
+    // Stop tracking a line, remembering it as evicted if requested.
+    void evictLine(uint32_t line, bool remember);
+
+    // Stop tracking the least recently used line.
+    void evictLRU() { evictLine(sets_[0][0].oldest(), true); }
+
+    // Lower the sampling threshold until at most sample_lines_ lines
+    // are tracked.
+    void lowerSampleThreshold();
+
+    // Lower the sampling threshold to a given value.
+    void dropUnsampledLines(uint32_t threshold);
+
+    // Adopt the leader's sampling threshold if it has dropped.
+    void followLeader(){
+      if(sample_leader_ != nullptr){
+        auto threshold = sample_leader_->sampleThreshold();
+        if(threshold < sample_threshold_) dropUnsampledLines(threshold);
+      }
+    }
+
+    // Start tracking a new line and return its index.
+    uint32_t allocateLine(uint64_t addr);
+};
+
+const uint32_t Cache::sample_modulus;
+const uint32_t Cache::clean;
+const uint64_t Cache::not_prefetched;
+const uint32_t Cache::unbounded;
+const size_t Cache::no_sim;
+
+void Cache::evictLine(uint32_t line, bool remember){
+  auto addr = line_addrs_[line];
+  auto line_num = addr >> log2_line_size_;
+  for(uint64_t set_bits = 0; set_bits < max_set_bits_; ++set_bits){
+    setOf(line_num, set_bits).remove(times_[line*max_set_bits_ + set_bits]);
+  }
+
+  // A dirty line leaving the model is written back by every cache
+  // in which it is still dirty.
+  uint64_t weight = 0;
+  for(uint64_t set_bits = 0; set_bits < max_set_bits_; ++set_bits){
+    auto dirty = dirty_dists_[line*max_set_bits_ + set_bits];
+    if(dirty != clean){
+      if(weight == 0) weight = sampleWeight();
+      dirty_from_[set_bits].add(dirty, weight);
+    }
+  }
+  line_index_.erase(addr);
+  free_lines_.push_back(line);
+  if(sampling_){
+    retired_square_refs_ += double(line_refs_[line])*line_refs_[line];
+  }
+  if(sample_lines_ != 0){
+    by_hash_.erase(make_pair(lineHash(line_num), line));
+  }
+  if(remember){
+    auto bits = evictedBits(line_num);
+    evicted_[bits.first / 64] |= uint64_t(1) << (bits.first % 64);
+    evicted_[bits.second / 64] |= uint64_t(1) << (bits.second % 64);
+  }
+}
+
+void Cache::lowerSampleThreshold(){
+  while(line_index_.size() > sample_lines_){
+    dropUnsampledLines(by_hash_.rbegin()->first);
+  }
+}
+
+void Cache::dropUnsampledLines(uint32_t threshold){
+  // Lines at or above the new threshold are no longer sampled, so
+  // they leave the model entirely rather than counting as evicted.
+  __atomic_store_n(&sample_threshold_, threshold, __ATOMIC_RELAXED);
+  while(!by_hash_.empty() && by_hash_.rbegin()->first >= threshold){
+    evictLine(by_hash_.rbegin()->second, false);
+  }
+}
+
+bool Cache::samples(uint64_t baseaddr, uint64_t numaddrs) const{
+  auto threshold = sampleThreshold();
+  if(threshold == sample_modulus) return true;
+  auto block_size = line_size_ << sample_shift_;
+  auto log2_block_size = log2_line_size_ + sample_shift_;
+  for(uint64_t addr = baseaddr / block_size * block_size;
+      addr <= (baseaddr + numaddrs ) / block_size * block_size;
+      addr += block_size){
+    if(sampleHash(addr >> log2_block_size) < threshold){
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t Cache::allocateLine(uint64_t addr){
+  uint32_t line;
+  if(free_lines_.empty()){
+    line = line_addrs_.size();
+    line_addrs_.push_back(addr);
+    if(sampling_){
+      line_refs_.push_back(0);
+    }
+    times_.resize(times_.size() + max_set_bits_);
+    dirty_dists_.resize(dirty_dists_.size() + max_set_bits_);
+    if(record_thread_id_){
+      thread_ids_.push_back(0);
+    }
+    if(prefetcher_){
+      prefetch_times_.push_back(not_prefetched);
+      prefetch_dists_.resize(prefetch_dists_.size() + max_set_bits_);
+    }
+  } else {
+    line = free_lines_.back();
+    free_lines_.pop_back();
+    line_addrs_[line] = addr;
+    if(sampling_){
+      line_refs_[line] = 0;
+    }
+  }
+  line_index_[addr] = line;
+  if(sample_lines_ != 0){
+    by_hash_.insert(make_pair(lineHash(addr >> log2_line_size_), line));
+  }
+  return line;
+}
+
+void Cache::access(uint64_t baseaddr, uint64_t numaddrs, unsigned thread_id,
+                   const char* func, uint64_t site, bool is_store){
+  followLeader();
+  uint64_t num_accesses = 0; // running total of number of lines accessed
+  for(uint64_t addr = baseaddr / line_size_ * line_size_;
+      addr <= (baseaddr + numaddrs ) / line_size_ * line_size_;
+      addr += line_size_){
+    ++num_accesses;
+    ++line_clock_;
+    auto line_num = addr >> log2_line_size_;
+    for(size_t i = 0; i < sims_.size(); ++i){
+      sim_missed_[i] = sims_[i].access(line_num, true);
+    }
+    if(sampledLine(line_num)){
+      accessLine(addr, thread_id, func, site, is_store, false);
+    }
+
+    // The prefetcher and the simulators see every access, sampled or
+    // not, and prefetches follow the access that triggered them.
+    if(prefetcher_){
+      prefetcher_->observe(line_num, prefetches_);
+      for(auto prefetch_line : prefetches_){
+        for(auto& sim : sims_){
+          sim.access(prefetch_line, false);
+        }
+        if(sampledLine(prefetch_line)){
+          accessLine(prefetch_line << log2_line_size_, thread_id, nullptr,
+                     BF_NO_MISS_SITE, false, true);
+        }
+      }
+      prefetches_.clear();
+    }
+  }
+
+  // we've made all our accesses
+  accesses_ += num_accesses;
+  if(num_accesses != 1){
+    ++split_accesses_;
+  }
+}
+
+void Cache::accessLine(uint64_t addr, unsigned thread_id, const char* func,
+                       uint64_t site, bool is_store, bool prefetch){
+  auto line_num = addr >> log2_line_size_;
+  auto weight = sampleWeight();
+  if(prefetch){
+    prefetches_issued_ += weight;
+  } else {
+    modeled_accesses_ += weight;
+  }
+  auto line_iter = line_index_.find(addr);
+  bool found = line_iter != line_index_.end();
+  bool cold = false;
+  uint32_t line;
+  if(found){
+    line = line_iter->second;
+    unsigned last_thread = record_thread_id_ ? thread_ids_[line] : 0;
+    bool pending = prefetcher_ && prefetch_times_[line] != not_prefetched;
+    bool was_prefetched = !prefetch && pending;
+    bool late = was_prefetched &&
+      line_clock_ - prefetch_times_[line] <= prefetch_latency_;
+    for(uint64_t set_bits = 0; set_bits < max_set_bits_; ++set_bits){
+      // The reuse distance within the set is the number of distinct
+      // lines in the set accessed since this line, plus this line.
+      auto& set = setOf(line_num, set_bits);
+      auto& time = times_[line*max_set_bits_ + set_bits];
+      auto idx = scaleDistance(set.newerThan(time) + 1);
+      set.remove(time);
+      auto& dirty = dirty_dists_[line*max_set_bits_ + set_bits];
+      if(dirty != clean){
+        if(dirty < idx){
+          dirty_from_[set_bits].add(dirty, weight);
+          dirty_until_[set_bits].add(idx, weight);
+        }
+        dirty = uint32_t(min<uint64_t>(max<uint64_t>(dirty, idx), clean - 1));
+      }
+      if(prefetch){
+        // A chain of prefetches benefits every cache that any of
+        // them filled and that kept the line since.
+        redundant_prefetches_[set_bits].add(idx, weight);
+        auto& dist = prefetch_dists_[line*max_set_bits_ + set_bits];
+        auto clamped = uint32_t(min<uint64_t>(idx, unbounded - 1));
+        dist = pending ? max(dist, clamped) : clamped;
+        continue;
+      }
+      hits_[set_bits].add(idx, weight);
+      if(was_prefetched){
+        auto dist = prefetch_dists_[line*max_set_bits_ + set_bits];
+        if(idx < dist){
+          (late ? late_from_ : useful_from_)[set_bits].add(idx, weight);
+          if(dist != unbounded){
+            (late ? late_until_ : useful_until_)[set_bits].add(dist, weight);
+          }
+        }
+      }
+      if(!judged_.empty()){
+        distances_[set_bits] = idx;
+      }
+      if(record_thread_id_ &&
+         last_thread != thread_id){
+        remote_hits_[set_bits].add(idx, weight);
+      }
+    }
+  } else {
+    // Distinguish first touches from lines we stopped tracking,
+    // making room for the new line if necessary.  Prefetches don't
+    // miss.
+    if(wasEvicted(line_num)){
+      if(!prefetch) capacity_misses_ += weight;
+    } else {
+      if(!prefetch) cold_misses_ += weight;
+      ++sampled_lines_;
+      cold = true;
+    }
+    if(max_lines_ != 0 && line_index_.size() >= max_lines_){
+      evictLRU();
+    }
+    line = allocateLine(addr);
+    fill_n(begin(dirty_dists_) + line*max_set_bits_, max_set_bits_, clean);
+    if(prefetch){
+      fill_n(begin(prefetch_dists_) + line*max_set_bits_, max_set_bits_, unbounded);
+    }
+  }
+  if(is_store){
+    fill_n(begin(dirty_dists_) + line*max_set_bits_, max_set_bits_, 0);
+  }
+  if(prefetcher_){
+    prefetch_times_[line] = prefetch ? line_clock_ : not_prefetched;
+  }
+  if(!prefetch && !judged_.empty() &&
+     (func != nullptr || site != BF_NO_MISS_SITE)){
+    auto* func_misses = func != nullptr ? funcMisses(func).data() : nullptr;
+    uint64_t* site_misses = nullptr;
+    if(site != BF_NO_MISS_SITE){
+      if(site_misses_.size() < (site + 1)*num_levels_){
+        site_misses_.resize((site + 1)*num_levels_, 0);
+      }
+      site_misses = &site_misses_[site*num_levels_];
+    }
+    for(const auto& level : judged_){
+      bool missed = level.sim != no_sim ? sim_missed_[level.sim] != 0
+        : !found || distances_[level.set_bits] > level.ways;
+      if(missed){
+        if(func_misses != nullptr){
+          // A miss that a fully associative LRU cache of the same
+          // capacity would also incur is a capacity miss, unless the
+          // line was never seen before.
+          auto kind = cold ? MISS_COMPULSORY
+            : !found || distances_[0] > level.lines ? MISS_CAPACITY : MISS_CONFLICT;
+          func_misses[level.level] += weight;
+          func_misses[num_levels_ + level.level*num_miss_kinds + kind] += weight;
+        }
+        if(site_misses != nullptr) site_misses[level.level] += weight;
+      }
+    }
+  }
+
+  // move up this address to mru position
+  for(uint64_t set_bits = 0; set_bits < max_set_bits_; ++set_bits){
+    auto& set = setOf(line_num, set_bits);
+    if(set.full()){
+      set.compact([&](uint32_t owner, uint32_t new_time){
+          times_[owner*max_set_bits_ + set_bits] = new_time;
+        });
+    }
+    times_[line*max_set_bits_ + set_bits] = set.append(line);
+  }
+  if(record_thread_id_){
+    thread_ids_[line] = thread_id;
+  }
+  if(sampling_ && !prefetch){
+    line_refs_[line] += weight;
+  }
+  if(sample_lines_ != 0 && sample_leader_ == nullptr &&
+     line_index_.size() > sample_lines_){
+    lowerSampleThreshold();
+  }
+}
+
+// Detect coherence traffic and false sharing among threads.  For each
+// line, track the bytes each thread has touched and written and which
+// threads hold a valid copy, as in an invalidation-based protocol.  A
+// store invalidates every other thread's copy.  The invalidation is
+// false sharing if the stored bytes don't overlap any byte the
+// invalidated thread has touched.
+//
+// A line touched by only one thread keeps just its owner and a
+// 64-bit mask of the owner's touched and written bytes (one bit per
+// line_size/64 bytes for lines longer than 64 bytes).  Per-thread
+// state is allocated only once a second thread touches the line.  If
+// max_lines is nonzero, the least recently used line stops being
+// tracked when another would exceed it; lines with invalidations
+// that are forgotten this way are remembered only while they're among
+// the report_size worst.
+class CoherenceTracker {
+  public:
+    static const size_t max_funcs = 8;   // function pairs to remember per line
+
+    CoherenceTracker(uint64_t line_size, uint64_t max_lines, uint64_t report_size) :
+      line_size_{line_size}, mask_words_{(line_size + 63) / 64},
+      granule_{max<uint64_t>(line_size / 64, 1)}, max_lines_{max_lines},
+      report_size_{report_size}, invalidations_{0}, false_invalidations_{0},
+      newest_{no_slot}, oldest_{no_slot} {}
+
+    // Apply an access by a given thread and function (nullptr=unknown)
+    // to every line it touches.
+    void access(uint64_t baseaddr, uint64_t numaddrs, unsigned thread_id,
+                const char* func, bool is_store) {
+      auto end = baseaddr + max<uint64_t>(numaddrs, 1);
+      for(uint64_t addr = baseaddr / line_size_ * line_size_; addr < end;
+          addr += line_size_){
+        auto first = max(baseaddr, addr) - addr;
+        auto last = min(end, addr + line_size_) - addr;
+        accessLine(lookup(addr), first, last, thread_id, func, is_store);
+      }
+    }
+
+    uint64_t getInvalidations() const { return invalidations_; }
+    uint64_t getFalseInvalidations() const { return false_invalidations_; }
+
+    // Describe every line that incurred an invalidation, including the
+    // worst of those no longer tracked.
+    vector<false_sharing_t> getSharedLines() const {
+      auto shared = retired_;
+      for(const auto& slot : slots_){
+        if(slot.shared != no_line && shared_[slot.shared].invalidations != 0){
+          shared.push_back(describe(slot));
+        }
+      }
+      return shared;
+    }
+
+  private:
+    typedef vector<uint64_t> byte_mask_t;   // one bit per byte of a line
+    typedef struct {
+      unsigned thread;
+      bool valid;            // true=thread holds a copy of the line
+      byte_mask_t touched;   // bytes the thread read or wrote
+      byte_mask_t written;   // bytes the thread wrote
+      const char* func;      // function of the thread's latest access
+    } sharer_t;
+    // a line touched by more than one thread
+    typedef struct {
+      vector<sharer_t> sharers;
+      uint64_t invalidations;
+      uint64_t false_invalidations;
+      vector<false_sharing_func_t> funcs;   // storing and invalidated functions
+    } line_t;
+    // a tracked line
+    typedef struct {
+      uint64_t addr;
+      uint32_t shared;       // index into shared_ (no_line=touched by one thread)
+      uint32_t newer;        // next more recently used slot (no_slot=none)
+      uint32_t older;        // next less recently used slot (no_slot=none)
+      unsigned owner;        // the thread that touched the line, if only one (no_owner=none)
+      uint64_t touched;      // granules the owner touched, if only one thread
+      uint64_t written;      // granules the owner wrote, if only one thread
+      const char* func;      // function of the owner's latest access
+    } slot_t;
+    static const uint32_t no_line = ~uint32_t(0);
+    static const uint32_t no_slot = ~uint32_t(0);
+    static const unsigned no_owner = ~0U;
+    uint64_t line_size_;
+    uint64_t mask_words_;   // 64-bit words per byte_mask_t
+    uint64_t granule_;      // bytes per bit of a slot_t's masks
+    uint64_t max_lines_;    // lines to track (0=unlimited)
+    uint64_t report_size_;  // forgotten lines to remember
+    uint64_t invalidations_;
+    uint64_t false_invalidations_;
+    unordered_map<uint64_t,uint32_t> index_;   // map from line address to slot
+    vector<slot_t> slots_;
+    vector<uint32_t> free_slots_;
+    vector<line_t> shared_;
+    vector<uint32_t> free_shared_;
+    uint32_t newest_;       // most recently used slot
+    uint32_t oldest_;       // least recently used slot
+    vector<false_sharing_t> retired_;   // forgotten lines with invalidations
+    byte_mask_t access_mask_;   // bytes touched by the current access
+
+    static bool overlaps(const byte_mask_t& a, const byte_mask_t& b) {
+      for(size_t i = 0; i < a.size(); ++i){
+        if(a[i] & b[i]) return true;
+      }
+      return false;
+    }
+
+    static void merge(byte_mask_t& into, const byte_mask_t& from) {
+      for(size_t i = 0; i < into.size(); ++i){
+        into[i] |= from[i];
+      }
+    }
+
+    // Order lines from most to least falsely shared.
+    static bool worse(const false_sharing_t& one, const false_sharing_t& two) {
+      if(one.false_invalidations != two.false_invalidations){
+        return one.false_invalidations > two.false_invalidations;
+      }
+      return one.invalidations > two.invalidations;
+    }
+
+    // Return the granules of a slot_t mask that bytes [first, last)
+    // fall in.
+    uint64_t granules(uint64_t first, uint64_t last) const {
+      uint64_t mask = 0;
+      for(auto g = first / granule_; g <= (last - 1) / granule_; ++g){
+        mask |= uint64_t(1) << g;
+      }
+      return mask;
+    }
+
+    // Expand a slot_t mask to a byte mask.
+    byte_mask_t expand(uint64_t mask) const {
+      byte_mask_t bytes(mask_words_, 0);
+      for(uint64_t byte = 0; byte < line_size_; ++byte){
+        if(mask >> (byte / granule_) & 1){
+          bytes[byte / 64] |= uint64_t(1) << (byte % 64);
+        }
+      }
+      return bytes;
+    }
+
+    false_sharing_t describe(const slot_t& slot) const {
+      const auto& line = shared_[slot.shared];
+      // The bytes a line's threads touch are disjoint if no thread
+      // touched a byte that another thread wrote.
+      bool disjoint = true;
+      for(const auto& one : line.sharers){
+        for(const auto& other : line.sharers){
+          if(&one != &other && overlaps(one.touched, other.written)){
+            disjoint = false;
+          }
+        }
+      }
+      return false_sharing_t{slot.addr, line.invalidations,
+          line.false_invalidations, line.sharers.size(), disjoint, line.funcs};
+    }
+
+    void unlink(uint32_t s) {
+      auto& slot = slots_[s];
+      (slot.newer == no_slot ? newest_ : slots_[slot.newer].older) = slot.older;
+      (slot.older == no_slot ? oldest_ : slots_[slot.older].newer) = slot.newer;
+    }
+
+    void pushNewest(uint32_t s) {
+      auto& slot = slots_[s];
+      slot.newer = no_slot;
+      slot.older = newest_;
+      (newest_ == no_slot ? oldest_ : slots_[newest_].newer) = s;
+      newest_ = s;
+    }
+
+    // Stop tracking the least recently used line, remembering it if
+    // it's among the worst falsely shared.
+    void evictOldest() {
+      auto s = oldest_;
+      auto& slot = slots_[s];
+      if(slot.shared != no_line){
+        if(shared_[slot.shared].invalidations != 0 && report_size_ != 0){
+          retired_.push_back(describe(slot));
+          if(retired_.size() >= 2*report_size_){
+            nth_element(begin(retired_), begin(retired_) + report_size_,
+                        end(retired_), worse);
+            retired_.resize(report_size_);
+          }
+        }
+        shared_[slot.shared] = line_t();
+        free_shared_.push_back(slot.shared);
+      }
+      unlink(s);
+      index_.erase(slot.addr);
+      free_slots_.push_back(s);
+    }
+
+    // Return the slot of a line, tracking it if necessary, and make
+    // it the most recently used.
+    uint32_t lookup(uint64_t addr) {
+      auto iter = index_.find(addr);
+      if(iter != index_.end()){
+        if(iter->second != newest_){
+          unlink(iter->second);
+          pushNewest(iter->second);
+        }
+        return iter->second;
+      }
+      if(max_lines_ != 0 && index_.size() >= max_lines_){
+        evictOldest();
+      }
+      uint32_t s;
+      if(free_slots_.empty()){
+        s = slots_.size();
+        slots_.push_back(slot_t());
+      } else {
+        s = free_slots_.back();
+        free_slots_.pop_back();
+      }
+      slots_[s] = slot_t{addr, no_line, no_slot, no_slot, no_owner, 0, 0, nullptr};
+      index_[addr] = s;
+      pushNewest(s);
+      return s;
+    }
+
+    // Give a line per-thread state, starting with its owner's.
+    void share(slot_t& slot) {
+      uint32_t idx;
+      if(free_shared_.empty()){
+        idx = shared_.size();
+        shared_.push_back(line_t());
+      } else {
+        idx = free_shared_.back();
+        free_shared_.pop_back();
+      }
+      auto& line = shared_[idx];
+      line.invalidations = 0;
+      line.false_invalidations = 0;
+      line.sharers.push_back(sharer_t{slot.owner, true, expand(slot.touched),
+            expand(slot.written), slot.func});
+      slot.shared = idx;
+    }
+
+    // Record that a store by one function invalidated a copy last
+    // accessed by another.
+    static void recordFuncs(line_t& line, const char* storer, const char* victim) {
+      if(storer == nullptr && victim == nullptr){
+        return;
+      }
+      for(auto& pair : line.funcs){
+        if(pair.storer == storer && pair.victim == victim){
+          ++pair.invalidations;
+          return;
+        }
+      }
+      if(line.funcs.size() < max_funcs){
+        line.funcs.push_back(false_sharing_func_t{storer, victim, 1});
+      }
+    }
+
+    // Apply an access to bytes [first, last) of a line.
+    void accessLine(uint32_t s, uint64_t first, uint64_t last,
+                    unsigned thread_id, const char* func, bool is_store) {
+      auto& slot = slots_[s];
+      if(slot.shared == no_line){
+        if(slot.owner == no_owner || slot.owner == thread_id){
+          auto mask = granules(first, last);
+          slot.owner = thread_id;
+          slot.touched |= mask;
+          if(is_store){
+            slot.written |= mask;
+          }
+          slot.func = func;
+          return;
+        }
+        share(slot);
+      }
+      auto& line = shared_[slot.shared];
+      access_mask_.assign(mask_words_, 0);
+      for(auto byte = first; byte < last; ++byte){
+        access_mask_[byte / 64] |= uint64_t(1) << (byte % 64);
+      }
+      sharer_t* self = nullptr;
+      for(auto& sharer : line.sharers){
+        if(sharer.thread == thread_id){
+          self = &sharer;
+        } else if(is_store && sharer.valid){
+          sharer.valid = false;
+          ++line.invalidations;
+          ++invalidations_;
+          if(!overlaps(access_mask_, sharer.touched)){
+            ++line.false_invalidations;
+            ++false_invalidations_;
+          }
+          recordFuncs(line, func, sharer.func);
+        }
+      }
+      if(self == nullptr){
+        line.sharers.push_back(sharer_t{thread_id, false,
+              byte_mask_t(mask_words_, 0), byte_mask_t(mask_words_, 0), nullptr});
+        self = &line.sharers.back();
+      }
+      self->valid = true;
+      merge(self->touched, access_mask_);
+      if(is_store){
+        merge(self->written, access_mask_);
+      }
+      self->func = func;
+    }
+};
+
+const size_t CoherenceTracker::max_funcs;
+const uint32_t CoherenceTracker::no_line;
+const uint32_t CoherenceTracker::no_slot;
+const unsigned CoherenceTracker::no_owner;
+
+// Return the number of line_size-byte lines an access touches.
+static uint64_t lines_touched(uint64_t baseaddr, uint64_t numaddrs,
+                              uint64_t line_size){
+  return (baseaddr + numaddrs) / line_size - baseaddr / line_size + 1;
+}
+
+// Apply an access to the models of the BF_LINE_SIZES line sizes.
+// They sample the same blocks as the bf_line_size model that leads
+// them, so if it samples none of the access's blocks, they only
+// count the access.
+static void touch_extra_caches(const Cache* leader, const vector<Cache*>& extras,
+                               uint64_t baseaddr, uint64_t numaddrs,
+                               unsigned thread_id, bool is_store){
+  if(extras.empty()) return;
+  if(leader->samples(baseaddr, numaddrs)){
+    for(auto extra : extras){
+      extra->access(baseaddr, numaddrs, thread_id, nullptr, BF_NO_MISS_SITE,
+                    is_store);
+    }
+  } else {
+    for(auto extra : extras){
+      auto num_accesses = lines_touched(baseaddr, numaddrs, extra->getLineSize());
+      extra->skip(num_accesses, num_accesses != 1);
+    }
+  }
+}
+
+// One access destined for the shared-cache model.
+typedef struct {
+  uint64_t time;        // nanoseconds on the calling thread's monotonic clock
+  uint64_t baseaddr;
+  uint64_t numaddrs;
+  unsigned thread_id;
+  const char* func;     // function to charge for misses (nullptr=none)
+  uint64_t site;        // memory instruction to charge for misses
+  bool is_store;
+} shared_access_t;
+
+// A fixed-size batch of one thread's accesses in timestamp order.  The
+// owning thread appends records and then advances count_, so the
+// merger can replay a batch's prefix while the batch is still being
+// filled in.
+class AccessBatch {
+  public:
+    static const size_t capacity = 4096;
+    atomic<size_t> count_;       // records filled in
+    size_t replayed_;            // records replayed (merger only)
+    bool published_;             // true=the owner is done with the batch (merger only)
+    shared_access_t records_[capacity];
+
+    AccessBatch() : count_{0}, replayed_{0}, published_{false} {}
+};
+
+const size_t AccessBatch::capacity;
+
+// A thread's accesses not yet replayed into the shared-cache model.
+class AccessLog {
+  public:
+    atomic<AccessBatch*> batch_;      // batch being filled in (nullptr=none)
+    vector<AccessBatch*> published_;  // batches the thread is done with (merger's mutex)
+    // for each line size, lines touched by accesses to no sampled
+    // block, and such accesses that touched multiple lines
+    vector<uint64_t> skipped_accesses_;
+    vector<uint64_t> skipped_splits_;
+    deque<AccessBatch*> stream_;      // batches not yet fully replayed (merger only)
+
+    AccessLog(size_t num_line_sizes) : batch_{nullptr},
+      skipped_accesses_(num_line_sizes, 0), skipped_splits_(num_line_sizes, 0) {}
+};
+
+// Replay all threads' accesses into the shared-cache model in
+// timestamp order on a separate thread.  Each thread stamps its
+// accesses with its own reading of the monotonic clock, so logging an
+// access touches no memory shared with other threads.  Application
+// threads synchronize with the merger only once per batch.
+//
+// Every tick, the merger replays, in timestamp order, all visible
+// accesses made more than a grace period before the tick began.
+// Partial batches of idle threads are therefore replayed after at
+// most a grace period plus a tick.  An access that becomes visible
+// only after later accesses were replayed (because its thread was
+// descheduled between reading the clock and logging the access) is
+// replayed as soon as it's seen and counted as late.
+//
+// At most max_spare_batches batches beyond one per thread exist at a
+// time.  A thread that needs a batch when none is free waits for the
+// merger to recycle one.
+class SharedCacheMerger {
+  public:
+    static const size_t max_spare_batches = 64;
+    static constexpr chrono::microseconds tick{1000};   // time between merges
+    static constexpr chrono::microseconds grace{1000};  // age at which an access is replayed
+
+    SharedCacheMerger(Cache* shared_cache, const vector<Cache*>& extra_caches,
+                      CoherenceTracker* coherence) :
+      cache_{shared_cache}, extra_caches_(extra_caches),
+      coherence_{coherence}, finished_{false}, starved_{false},
+      num_batches_{0}, late_accesses_{0} {
+        merger_ = thread(&SharedCacheMerger::run, this);
+    }
+
+    // Return the current time on the calling thread's monotonic clock.
+    static uint64_t now() {
+      return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Make a thread's log visible to the merger.
+    void addLog(AccessLog* log){
+      lock_guard<mutex> guard(mutex_);
+      logs_.push_back(log);
+    }
+
+    // Append an access to a thread's log.
+    void append(AccessLog* log, const shared_access_t& access){
+      auto batch = log->batch_.load(memory_order_relaxed);
+      if(batch == nullptr){
+        batch = newBatch();
+        log->batch_.store(batch, memory_order_release);
+      }
+      auto count = batch->count_.load(memory_order_relaxed);
+      batch->records_[count] = access;
+      batch->count_.store(count + 1, memory_order_release);
+      if(count + 1 == AccessBatch::capacity){
+        publish(log);
+      }
+    }
+
+    // Hand a log's batch back to the merger.
+    void publish(AccessLog* log){
+      lock_guard<mutex> guard(mutex_);
+      auto batch = log->batch_.load(memory_order_relaxed);
+      if(batch != nullptr){
+        log->published_.push_back(batch);
+        log->batch_.store(nullptr, memory_order_release);
+      }
+    }
+
+    // Replay everything and stop the merger.
+    void finish(){
+      {
+        lock_guard<mutex> guard(mutex_);
+        finished_ = true;
+        ready_.notify_one();
+        room_.notify_all();
+      }
+      merger_.join();
+      for(auto log : logs_){
+        cache_->skip(log->skipped_accesses_[0], log->skipped_splits_[0]);
+        for(size_t i = 0; i < extra_caches_.size(); ++i){
+          extra_caches_[i]->skip(log->skipped_accesses_[i + 1],
+                                 log->skipped_splits_[i + 1]);
+        }
+      }
+    }
+
+    // Return the number of accesses replayed after later ones.
+    uint64_t getLateAccesses() const { return late_accesses_; }
 
   private:
-    vector<uint64_t> lines_; // back is mru, front is lru
-    uint64_t line_size_;
-    uint64_t accesses_;
-    uint64_t split_accesses_;
-    uint64_t log2_line_size_; // log base 2 of line size
-    uint64_t max_set_bits_; // log base 2 of max number of sets
-    uint64_t cold_misses_;
-    // for each set count, a map of distance to access count
-    vector<unordered_map<uint64_t,uint64_t> > hits_;  // back is lru, front is mru
-    bool record_thread_id_;
-    // associate thread id with each line in cache. only used if record_thread_id_.
-    vector<unsigned> thread_ids_;
-    // for each set count, a map of distance to access count
-    vector<unordered_map<uint64_t,uint64_t> > remote_hits_;  // back is lru, front is mru
-};
+    // A position within a log's unreplayed accesses, ordered by
+    // timestamp and then by log.
+    typedef struct {
+      uint64_t time;
+      size_t log;
+    } cursor_t;
+    struct later {
+      bool operator()(const cursor_t& a, const cursor_t& b) const {
+        return a.time != b.time ? a.time > b.time : a.log > b.log;
+      }
+    };
 
-inline int Cache::getRightMatch(uint64_t a, uint64_t b){
-  // number of 0s, counting from left, ignoring all line bits.
-  // also need to mask off all bits higher than max_set_bits_.
-  auto diff_bits = ((a ^ b) >> log2_line_size_) | (1 << (max_set_bits_ - 1));
-  return __builtin_ctzll(diff_bits);
-}
+    Cache* cache_;                    // the shared-cache model
+    vector<Cache*> extra_caches_;     // shared-cache models for BF_LINE_SIZES
+    CoherenceTracker* coherence_;     // the false-sharing detector (nullptr=none)
+    thread merger_;                   // thread that replays accesses
+    mutex mutex_;                     // protects everything below except late_accesses_
+    condition_variable ready_;        // signaled when a thread is starved or on finish
+    condition_variable room_;         // signaled when batches are recycled
+    vector<AccessLog*> logs_;         // every thread's log
+    vector<AccessBatch*> free_;       // replayed batches available for reuse
+    bool finished_;                   // true=replay everything and exit
+    bool starved_;                    // true=a thread is waiting for a batch
+    size_t num_batches_;              // batches ever allocated
+    uint64_t late_accesses_;          // accesses replayed after later ones (merger only)
 
-void Cache::access(uint64_t baseaddr, uint64_t numaddrs){
-  uint64_t num_accesses = 0; // running total of number of lines accessed
-  for(uint64_t addr = baseaddr / line_size_ * line_size_;
-      addr <= (baseaddr + numaddrs ) / line_size_ * line_size_;
-      addr += line_size_){
-    ++num_accesses;
-    bool found = false;
-    unsigned last_thread = 0;
-    vector<uint64_t> right_match_tally(max_set_bits_, 0);
-    for(int line_idx = lines_.size() - 1; line_idx >= 0; --line_idx){
-      auto& line = lines_[line_idx];
-      int right_match = getRightMatch(addr, line); // returns 0 <= val = max_set_bits_
-      ++right_match_tally[right_match];
-      if(addr == line){
-        found = true;
-        // erase this line.
-        lines_.erase(begin(lines_) + line_idx);
-        if(record_thread_id_){
-          last_thread = thread_ids_[line_idx];
-          thread_ids_.erase(begin(thread_ids_) + line_idx);
-        }
-        break;
+    // Return an empty batch, waiting for one to be recycled if too
+    // many exist.
+    AccessBatch* newBatch(){
+      unique_lock<mutex> lock(mutex_);
+      while(free_.empty() && !finished_ &&
+            num_batches_ >= logs_.size() + max_spare_batches){
+        starved_ = true;
+        ready_.notify_one();
+        room_.wait(lock);
+      }
+      if(free_.empty()){
+        ++num_batches_;
+        return new AccessBatch();
       }
+      auto batch = free_.back();
+      free_.pop_back();
+      return batch;
     }
 
-    if(found){
-      // rolling sum of right match tally for reuse dists
-      uint64_t sum = 0;
-      for(auto tally = right_match_tally.rbegin();
-          tally != right_match_tally.rend(); 
-          ++tally){
-        *tally += sum;
-        sum = *tally;
+    // Append to a log's stream every batch its thread has started.
+    // The current batch is read before the published ones so that a
+    // batch published in the meantime is still seen.
+    void gather(AccessLog* log){
+      auto current = log->batch_.load(memory_order_acquire);
+      for(auto batch : log->published_){
+        if(log->stream_.empty() || log->stream_.back() != batch){
+          log->stream_.push_back(batch);
+        }
+        batch->published_ = true;
+      }
+      log->published_.clear();
+      if(current != nullptr &&
+         (log->stream_.empty() || log->stream_.back() != current)){
+        log->stream_.push_back(current);
       }
-      for(uint64_t set = 0; set < max_set_bits_; ++set){
-        auto idx = right_match_tally[set];
-        ++hits_[set][idx];
-        if(record_thread_id_ && 
-           last_thread != cache_id){
-          ++remote_hits_[set][idx];
+    }
+
+    // Return a log's oldest unreplayed access (nullptr=none visible),
+    // recycling batches that are used up.
+    const shared_access_t* next(AccessLog* log, vector<AccessBatch*>& used_up){
+      while(!log->stream_.empty()){
+        auto batch = log->stream_.front();
+        if(batch->replayed_ < batch->count_.load(memory_order_acquire)){
+          return &batch->records_[batch->replayed_];
         }
+        if(!batch->published_){
+          return nullptr;
+        }
+        log->stream_.pop_front();
+        used_up.push_back(batch);
       }
-    } else {
-      ++cold_misses_;
+      return nullptr;
     }
 
-    // move up this address to mru position
-    lines_.push_back(addr);
-    if(record_thread_id_){
-      thread_ids_.push_back(cache_id);
+    // Replay one access into every shared model.
+    void replay(const shared_access_t& rec){
+      cache_->access(rec.baseaddr, rec.numaddrs, rec.thread_id, rec.func,
+                     rec.site, rec.is_store);
+      touch_extra_caches(cache_, extra_caches_, rec.baseaddr, rec.numaddrs,
+                         rec.thread_id, rec.is_store);
+      if(coherence_ != nullptr){
+        coherence_->access(rec.baseaddr, rec.numaddrs, rec.thread_id,
+                           rec.func, rec.is_store);
+      }
     }
-  }
 
-  // we've made all our accesses
-  accesses_ += num_accesses;
-  if(num_accesses != 1){
-    ++split_accesses_;
-  }
-}
+    void run(){
+      vector<AccessLog*> logs;
+      vector<AccessBatch*> used_up;
+      uint64_t last_time = 0;   // timestamp of the latest access replayed
+      unique_lock<mutex> lock(mutex_);
+      while(true){
+        ready_.wait_for(lock, tick, [&]{ return finished_ || starved_; });
+        starved_ = false;
+        bool done = finished_;
+
+        // Accesses stamped before the watermark are assumed to be
+        // visible already.  Read the clock before the logs.
+        auto watermark = done ? ~uint64_t(0) :
+          now() - chrono::duration_cast<chrono::nanoseconds>(grace).count();
+        for(auto log : logs_){
+          gather(log);
+        }
+        logs = logs_;
+        for(auto batch : used_up){
+          batch->count_.store(0, memory_order_relaxed);
+          batch->replayed_ = 0;
+          batch->published_ = false;
+        }
+        free_.insert(end(free_), begin(used_up), end(used_up));
+        if(!used_up.empty()){
+          room_.notify_all();
+        }
+        used_up.clear();
+        lock.unlock();
+
+        // Merge the logs by timestamp.
+        priority_queue<cursor_t, vector<cursor_t>, later> heads;
+        for(size_t i = 0; i < logs.size(); ++i){
+          auto rec = next(logs[i], used_up);
+          if(rec != nullptr && rec->time < watermark){
+            heads.push(cursor_t{rec->time, i});
+          }
+        }
+        while(!heads.empty()){
+          auto i = heads.top().log;
+          auto log = logs[i];
+          heads.pop();
+          auto batch = log->stream_.front();
+          const auto& rec = batch->records_[batch->replayed_];
+          if(rec.time < last_time){
+            ++late_accesses_;
+          }
+          last_time = max(last_time, rec.time);
+          replay(rec);
+          ++batch->replayed_;
+          auto following = next(log, used_up);
+          if(following != nullptr && following->time < watermark){
+            heads.push(cursor_t{following->time, i});
+          }
+        }
+
+        lock.lock();
+        if(done){
+          break;
+        }
+      }
+    }
+};
+
+const size_t SharedCacheMerger::max_spare_batches;
+constexpr chrono::microseconds SharedCacheMerger::tick;
+constexpr chrono::microseconds SharedCacheMerger::grace;
+
+// Publish a thread's remaining accesses when the thread exits.
+class AccessLogFlusher {
+  private:
+    SharedCacheMerger* merger_;
+    AccessLog* log_;
+  public:
+    AccessLogFlusher(SharedCacheMerger* merger, AccessLog* log) :
+      merger_{merger}, log_{log} {}
+    ~AccessLogFlusher() {
+      merger_->publish(log_);
+    }
+};
 
 namespace bytesflops{
 
 static __thread Cache* cache = nullptr;
+static __thread AccessLog* access_log = nullptr;
 static vector<Cache*>* caches = nullptr;
 static Cache* global_cache = nullptr;
-static mutex cache_vector_mutex, global_cache_mutex;
+static SharedCacheMerger* shared_merger = nullptr;
+static mutex cache_vector_mutex;
+static once_flag shared_merger_finished;
 static unsigned thread_counter = 0;
+static vector<cache_level_t>* cache_hierarchy = nullptr;
+static CoherenceTracker* coherence = nullptr;
+
+// Line sizes modeled in addition to bf_line_size (BF_LINE_SIZES).
+// Each has its own private and shared Cache, but they share the
+// shared-cache log and its timestamps with the bf_line_size model.
+// Every model samples lines by the block of the largest line size
+// containing them and follows the bf_line_size model's sampling
+// threshold, so the sampled lines of each size cover the same
+// addresses and one sampling decision serves them all.
+static vector<uint64_t>* line_sizes = nullptr;   // bf_line_size, then the others
+static uint64_t sample_block_size = 0;           // bytes sampled together
+static vector<vector<cache_level_t> >* line_size_hierarchies = nullptr;  // [line size][level] (ways=0: not modeled)
+static __thread vector<Cache*>* extra_caches = nullptr;
+static vector<vector<Cache*> >* all_extra_caches = nullptr;  // [line size - 1][thread]
+static vector<Cache*>* extra_global_caches = nullptr;        // [line size - 1]
+static bool log_all_shared_accesses = false;  // true=even unsampled accesses go to the shared log
+static uint64_t false_sharing_lines = 0;   // lines to report (0=no detection)
+
+// The TLB model tracks pages of every size in tlb_page_sizes at once,
+// each with its own Cache per thread whose "lines" are pages.  The
+// page sizes are a constant array so that they're usable before this
+// file's static constructors run.
+static const uint64_t tlb_page_sizes[] = {uint64_t(4) << 10,
+                                          uint64_t(2) << 20,
+                                          uint64_t(1) << 30};
+static const size_t num_tlb_page_sizes = sizeof(tlb_page_sizes) / sizeof(tlb_page_sizes[0]);
+static __thread Cache* tlbs[num_tlb_page_sizes];
+static vector<Cache*>* all_tlbs[num_tlb_page_sizes];  // every thread's TLB models
+static vector<tlb_level_t>* tlb_hierarchy = nullptr;
+static uint64_t tlb_set_bits = 0;   // set counts to model for TLBs (log base 2 of max + 1)
+
+// Parse a nonnegative integer with an optional K, M, or G suffix.
+static bool parse_size(const string& text, uint64_t& value){
+  char* end;
+  value = strtoull(text.c_str(), &end, 10);
+  if(end == text.c_str()){
+    return false;
+  }
+  switch(*end){
+    case 'K': case 'k': value <<= 10; ++end; break;
+    case 'M': case 'm': value <<= 20; ++end; break;
+    case 'G': case 'g': value <<= 30; ++end; break;
+    default: break;
+  }
+  return *end == '\0';
+}
+
+// Parse a cache hierarchy of the form
+// <size>:<ways>[:<line size>][:private|:shared],... with levels listed
+// from closest to farthest from the processor.  Zero ways means fully
+// associative.  Return an empty string on success or a description of
+// the problem on failure.
+static string parse_cache_hierarchy(const char* description,
+                                    vector<cache_level_t>& hierarchy){
+  istringstream levels(description);
+  string level_text;
+  bool seen_shared = false;
+  while(getline(levels, level_text, ',')){
+    vector<string> fields;
+    istringstream field_stream(level_text);
+    string field;
+    while(getline(field_stream, field, ':')){
+      fields.push_back(field);
+    }
+    cache_level_t level{0, 0, 0, false, REPLACE_LRU};
+    static const char* policy_names[] = {"lru", "plru", "srrip", "brrip", "random"};
+    while(fields.size() > 2){
+      auto policy = find(begin(policy_names), end(policy_names), fields.back());
+      if(fields.back() == "private" || fields.back() == "shared"){
+        level.shared = fields.back() == "shared";
+      } else if(policy != end(policy_names)){
+        level.policy = replacement_t(policy - begin(policy_names));
+      } else {
+        break;
+      }
+      fields.pop_back();
+    }
+    if(fields.size() < 2 || fields.size() > 3){
+      return "expected <size>:<ways>[:<line size>][:private|:shared][:<policy>] but saw \"" + level_text + '"';
+    }
+    uint64_t line_size = bf_line_size;
+    if(!parse_size(fields[0], level.size) || level.size == 0 ||
+       !parse_size(fields[1], level.ways) ||
+       (fields.size() == 3 && !parse_size(fields[2], line_size))){
+      return "invalid number in \"" + level_text + '"';
+    }
+    if(line_size != bf_line_size){
+      return "line sizes must match -bf-line-size";
+    }
+    if(level.ways == 0){
+      level.ways = level.size / line_size;
+    }
+    if(level.ways == 0 || level.size % (line_size*level.ways) != 0){
+      return "size of \"" + level_text + "\" is not a multiple of its line size times its ways";
+    }
+    auto sets = level.size / (line_size*level.ways);
+    while(sets > 1 && sets % 2 == 0){
+      sets /= 2;
+      ++level.set_bits;
+    }
+    if(sets != 1){
+      return "number of sets in \"" + level_text + "\" is not a power of two";
+    }
+    if(level.set_bits >= bf_max_set_bits){
+      return "\"" + level_text + "\" has more sets than -bf-max-set-bits allows";
+    }
+    if(level.policy == REPLACE_PLRU &&
+       (level.ways > 64 || (level.ways & (level.ways - 1)) != 0)){
+      return "pseudo-LRU in \"" + level_text + "\" needs a power-of-two number of ways up to 64";
+    }
+    if(seen_shared && !level.shared){
+      return "a private level cannot follow a shared level";
+    }
+    seen_shared = level.shared;
+    hierarchy.push_back(level);
+  }
+  return "";
+}
+
+// Recompute a cache level's number of sets for a different line size,
+// keeping its capacity and either its ways or, for a level with a
+// single set, its full associativity.  Return an empty string on
+// success or a description of the problem on failure.
+static string resize_cache_lines(cache_level_t& level, uint64_t line_size){
+  if(level.set_bits == 0){
+    level.ways = level.size / line_size;
+    if(level.ways == 0 || level.size % line_size != 0){
+      return "its size is not a multiple of the line size";
+    }
+    return "";
+  }
+  if(level.size % (line_size*level.ways) != 0){
+    return "its size is not a multiple of the line size times its ways";
+  }
+  auto sets = level.size / (line_size*level.ways);
+  level.set_bits = 0;
+  while(sets > 1 && sets % 2 == 0){
+    sets /= 2;
+    ++level.set_bits;
+  }
+  if(sets != 1){
+    return "its number of sets is not a power of two";
+  }
+  if(level.set_bits >= bf_max_set_bits){
+    return "it has more sets than -bf-max-set-bits allows";
+  }
+  return "";
+}
+
+// Parse a prefetcher of the form
+// next-line|stride[:streams=<n>][:degree=<n>][:distance=<n>][:latency=<n>].
+// Return an empty string on success or a description of the problem
+// on failure.
+static string parse_prefetcher(const char* description,
+                               prefetch_config_t& config){
+  istringstream fields(description);
+  string field;
+  getline(fields, field, ':');
+  if(field == "next-line"){
+    config.kind = prefetch_config_t::next_line;
+  } else if(field == "stride"){
+    config.kind = prefetch_config_t::stride;
+  } else {
+    return "expected \"next-line\" or \"stride\" but saw \"" + field + '"';
+  }
+  while(getline(fields, field, ':')){
+    auto equals = field.find('=');
+    string name = field.substr(0, equals);
+    uint64_t value;
+    if(equals == string::npos || !parse_size(field.substr(equals + 1), value)){
+      return "expected <name>=<number> but saw \"" + field + '"';
+    }
+    if(name == "streams"){
+      config.streams = value;
+    } else if(name == "degree"){
+      config.degree = value;
+    } else if(name == "distance"){
+      config.distance = value;
+    } else if(name == "latency"){
+      config.latency = value;
+    } else {
+      return "unknown prefetcher parameter \"" + name + '"';
+    }
+  }
+  if(config.streams == 0 || config.degree == 0 || config.distance == 0){
+    return "streams, degree, and distance must be positive";
+  }
+  return "";
+}
+
+// Parse a TLB hierarchy of the form <entries>:<ways>,... with levels
+// listed from closest to farthest from the processor.  Zero ways means
+// fully associative.  Return an empty string on success or a
+// description of the problem on failure.
+static string parse_tlb_hierarchy(const char* description,
+                                  vector<tlb_level_t>& hierarchy){
+  istringstream levels(description);
+  string level_text;
+  while(getline(levels, level_text, ',')){
+    auto colon = level_text.find(':');
+    tlb_level_t level{0, 0, 0};
+    if(colon == string::npos){
+      return "expected <entries>:<ways> but saw \"" + level_text + '"';
+    }
+    if(!parse_size(level_text.substr(0, colon), level.entries) ||
+       level.entries == 0 ||
+       !parse_size(level_text.substr(colon + 1), level.ways)){
+      return "invalid number in \"" + level_text + '"';
+    }
+    if(level.ways == 0){
+      level.ways = level.entries;
+    }
+    if(level.entries % level.ways != 0){
+      return "entries in \"" + level_text + "\" are not a multiple of its ways";
+    }
+    auto sets = level.entries / level.ways;
+    while(sets > 1 && sets % 2 == 0){
+      sets /= 2;
+      ++level.set_bits;
+    }
+    if(sets != 1){
+      return "number of sets in \"" + level_text + "\" is not a power of two";
+    }
+    if(level.set_bits >= bf_max_set_bits){
+      return "\"" + level_text + "\" has more sets than -bf-max-set-bits allows";
+    }
+    hierarchy.push_back(level);
+  }
+  return "";
+}
+
+// Parse a comma-separated list of line sizes to model in addition to
+// bf_line_size.  Return an empty string on success or a description
+// of the problem on failure.
+static string parse_line_sizes(const char* description,
+                               vector<uint64_t>& sizes){
+  istringstream size_stream(description);
+  string size_text;
+  while(getline(size_stream, size_text, ',')){
+    uint64_t size;
+    if(!parse_size(size_text, size) || size == 0 || (size & (size - 1)) != 0){
+      return "\"" + size_text + "\" is not a power of two";
+    }
+    if(find(begin(sizes), end(sizes), size) == end(sizes)){
+      sizes.push_back(size);
+    }
+  }
+  return "";
+}
 
 void initialize_cache(void){
   if(caches == nullptr){
     caches = new vector<Cache*>();
   }
-  global_cache = new Cache(bf_line_size, bf_max_set_bits, true);
+  cache_hierarchy = new vector<cache_level_t>();
+  const char* description = getenv("BF_CACHE_HIERARCHY");
+  if(bf_cache_model && description != nullptr){
+    auto problem = parse_cache_hierarchy(description, *cache_hierarchy);
+    if(!problem.empty()){
+      cerr << "Ignoring BF_CACHE_HIERARCHY (\"" << description << "\"): "
+           << problem << '\n';
+      cache_hierarchy->clear();
+    }
+  }
+  tlb_hierarchy = new vector<tlb_level_t>();
+  description = getenv("BF_TLB_HIERARCHY");
+  if(bf_cache_model && description != nullptr){
+    auto problem = parse_tlb_hierarchy(description, *tlb_hierarchy);
+    if(!problem.empty()){
+      cerr << "Ignoring BF_TLB_HIERARCHY (\"" << description << "\"): "
+           << problem << '\n';
+      tlb_hierarchy->clear();
+    }
+  }
+  // Model only as many sets as the largest TLB level has, not the
+  // cache model's bf_max_set_bits.
+  for(const auto& level : *tlb_hierarchy){
+    tlb_set_bits = max(tlb_set_bits, level.set_bits + 1);
+  }
+  for(size_t i = 0; i < num_tlb_page_sizes; ++i){
+    all_tlbs[i] = new vector<Cache*>();
+  }
+  description = getenv("BF_PREFETCH");
+  if(bf_cache_model && description != nullptr){
+    auto problem = parse_prefetcher(description, prefetch_config);
+    if(!problem.empty()){
+      cerr << "Ignoring BF_PREFETCH (\"" << description << "\"): "
+           << problem << '\n';
+      prefetch_config.kind = prefetch_config_t::none;
+    }
+  }
+  global_cache = new Cache(bf_line_size, bf_max_set_bits, true,
+                           bf_cache_max_bytes, bf_cache_sample_threshold,
+                           bf_cache_sample_lines, prefetch_config);
+  global_cache->simulateLevels(*cache_hierarchy, true);
+  if(bf_per_func || bf_miss_sites > 0){
+    global_cache->attributeMisses(*cache_hierarchy, true);
+  }
+  description = getenv("BF_FALSE_SHARING");
+  if(bf_cache_model && description != nullptr){
+    if(!parse_size(description, false_sharing_lines)){
+      cerr << "Ignoring BF_FALSE_SHARING (\"" << description
+           << "\"): expected a number of lines\n";
+      false_sharing_lines = 0;
+    }
+    if(false_sharing_lines > 0){
+      coherence = new CoherenceTracker(bf_line_size,
+                                       bf_cache_max_bytes / bf_line_size,
+                                       false_sharing_lines);
+    }
+  }
+  line_sizes = new vector<uint64_t>(1, bf_line_size);
+  description = getenv("BF_LINE_SIZES");
+  if(bf_cache_model && description != nullptr){
+    auto problem = parse_line_sizes(description, *line_sizes);
+    if(!problem.empty()){
+      cerr << "Ignoring BF_LINE_SIZES (\"" << description << "\"): "
+           << problem << '\n';
+      line_sizes->resize(1);
+    }
+  }
+  line_size_hierarchies = new vector<vector<cache_level_t> >(1, *cache_hierarchy);
+  for(size_t i = 1; i < line_sizes->size(); ++i){
+    line_size_hierarchies->push_back(*cache_hierarchy);
+    for(size_t j = 0; j < cache_hierarchy->size(); ++j){
+      auto& level = line_size_hierarchies->back()[j];
+      auto problem = resize_cache_lines(level, (*line_sizes)[i]);
+      if(!problem.empty()){
+        cerr << "Not modeling L" << j + 1 << " with " << (*line_sizes)[i]
+             << "-byte lines (BF_LINE_SIZES): " << problem << '\n';
+        level.ways = 0;
+      }
+    }
+  }
+  sample_block_size = *max_element(begin(*line_sizes), end(*line_sizes));
+  global_cache->shareSampling(sample_block_size, nullptr);
+  all_extra_caches = new vector<vector<Cache*> >(line_sizes->size() - 1);
+  extra_global_caches = new vector<Cache*>();
+  for(size_t i = 1; i < line_sizes->size(); ++i){
+    extra_global_caches->push_back(new Cache((*line_sizes)[i], bf_max_set_bits,
+                                             false, bf_cache_max_bytes,
+                                             bf_cache_sample_threshold,
+                                             bf_cache_sample_lines, no_prefetch));
+    extra_global_caches->back()->shareSampling(sample_block_size, global_cache);
+  }
+
+  // The shared-cache log drops accesses to unsampled blocks unless
+  // the shared cache must see every access.  The other line sizes'
+  // models sample the same blocks, so they'd ignore those accesses
+  // too.
+  log_all_shared_accesses = global_cache->needsAllAccesses();
+  if(bf_cache_model){
+    shared_merger = new SharedCacheMerger(global_cache, *extra_global_caches,
+                                          coherence);
+  }
+}
+
+// Wait for the shared-cache model to see every access.
+static void finish_shared_cache(void){
+  if(shared_merger != nullptr){
+    call_once(shared_merger_finished, [](){ shared_merger->finish(); });
+  }
 }
 
-// Access the cache model with this address.
-void bf_touch_cache(uint64_t baseaddr, uint64_t numaddrs){
+// Access the cache model with this address, charging misses to a
+// given function (nullptr=none) and memory instruction
+// (BF_NO_MISS_SITE=none).
+static void touch_cache(const char* func, uint64_t site,
+                        uint64_t baseaddr, uint64_t numaddrs, bool is_store){
   if(cache == nullptr){
     // Only let one thread update caches at a time.
     lock_guard<mutex> guard(cache_vector_mutex);
-    cache = new Cache(bf_line_size, bf_max_set_bits, false);
+    cache = new Cache(bf_line_size, bf_max_set_bits, false,
+                      bf_cache_max_bytes, bf_cache_sample_threshold,
+                      bf_cache_sample_lines, prefetch_config);
+    cache->shareSampling(sample_block_size, nullptr);
+    cache->simulateLevels(*cache_hierarchy, false);
+    if(bf_per_func || bf_miss_sites > 0){
+      cache->attributeMisses(*cache_hierarchy, false);
+    }
     caches->push_back(cache);
+    extra_caches = new vector<Cache*>();
+    for(size_t i = 1; i < line_sizes->size(); ++i){
+      extra_caches->push_back(new Cache((*line_sizes)[i], bf_max_set_bits,
+                                        false, bf_cache_max_bytes,
+                                        bf_cache_sample_threshold,
+                                        bf_cache_sample_lines, no_prefetch));
+      extra_caches->back()->shareSampling(sample_block_size, cache);
+      (*all_extra_caches)[i - 1].push_back(extra_caches->back());
+    }
+    if(!tlb_hierarchy->empty()){
+      for(size_t i = 0; i < num_tlb_page_sizes; ++i){
+        tlbs[i] = new Cache(tlb_page_sizes[i], tlb_set_bits, false, 0,
+                            Cache::sample_modulus, 0, no_prefetch);
+        all_tlbs[i]->push_back(tlbs[i]);
+      }
+    }
     cache_id = thread_counter++;
+    access_log = new AccessLog(line_sizes->size());
+    shared_merger->addLog(access_log);
+    static thread_local AccessLogFlusher flush_at_exit(shared_merger, access_log);
+  }
+  cache->access(baseaddr, numaddrs, cache_id, func, site, is_store);
+  touch_extra_caches(cache, *extra_caches, baseaddr, numaddrs, cache_id, is_store);
+  if(tlbs[0] != nullptr){
+    for(auto tlb : tlbs){
+      tlb->access(baseaddr, numaddrs, cache_id, nullptr, BF_NO_MISS_SITE, is_store);
+    }
+  }
+
+  // Only count accesses that the shared cache won't model.
+  if(!log_all_shared_accesses && !global_cache->samples(baseaddr, numaddrs)){
+    for(size_t i = 0; i < line_sizes->size(); ++i){
+      auto num_accesses = lines_touched(baseaddr, numaddrs, (*line_sizes)[i]);
+      access_log->skipped_accesses_[i] += num_accesses;
+      if(num_accesses != 1){
+        ++access_log->skipped_splits_[i];
+      }
+    }
+    return;
+  }
+
+  // Log the access for the shared cache.
+  shared_merger->append(access_log, shared_access_t{SharedCacheMerger::now(),
+        baseaddr, numaddrs, cache_id, func, site, is_store});
+}
+
+// Access the cache model with this address.  memop is BF_OP_LOAD or
+// BF_OP_STORE.
+void bf_touch_cache(uint64_t baseaddr, uint64_t numaddrs, uint64_t memop){
+  touch_cache(nullptr, BF_NO_MISS_SITE, baseaddr, numaddrs, memop == BF_OP_STORE);
+}
+
+// Access the cache model with this address on behalf of a given
+// function (or, with -bf-call-stack, the current call path) and
+// memory instruction.  Either may be absent.
+void bf_touch_cache_from(const char* funcname, uint64_t site_id,
+                         uint64_t baseaddr, uint64_t numaddrs, uint64_t memop){
+  if(funcname != nullptr && bf_call_stack){
+    funcname = bf_func_and_parents();
   }
-  cache->access(baseaddr, numaddrs);
-  lock_guard<mutex> guard(global_cache_mutex);
-  global_cache->access(baseaddr, numaddrs);
+  touch_cache(funcname, site_id, baseaddr, numaddrs, memop == BF_OP_STORE);
+}
+
+// Map each memory-instruction ID assigned by the instrumentation pass
+// to a "file:line function" description of the instruction.
+static vector<const char*>& site_id_to_name(){
+  static vector<const char*>* mapping = new vector<const char*>();
+  return *mapping;
+}
+static mutex site_table_mutex;  // protects site_id_to_name()
+
+// Append a module's table of memory-instruction descriptions to the
+// program-wide table.  Return the ID of the module's first memory
+// instruction.  This is invoked by each instrumented module's
+// constructor (-bf-miss-sites only).
+uint64_t bf_register_site_table(const char** sitenames, uint64_t num_sites){
+  lock_guard<mutex> guard(site_table_mutex);
+  auto& id_to_name = site_id_to_name();
+  uint64_t first_id = id_to_name.size();
+  id_to_name.insert(end(id_to_name), sitenames, sitenames + num_sites);
+  return first_id;
 }
 
 // Get cache accesses
@@ -166,41 +2179,75 @@ vector<T> vecsum(const vector<T>& a, const vector<T>& b){
   return out;
 }
 
-template<typename T>
-T mapsum(const T& a, const T& b){
-  T out(a);
-  for(const auto& elem : b){
-    out[elem.first] += elem.second;
-  }
-  return out;
-}
-
 // Get cache hits
 uint64_t bf_get_shared_cache_accesses(void){
+  finish_shared_cache();
   return global_cache->getAccesses();
 }
 
 // Get cache hits
-vector<unordered_map<uint64_t,uint64_t> > bf_get_private_cache_hits(void){
+vector<HitHistogram> bf_get_private_cache_hits(void){
   // The total hits to a cache size N is equal to the sum of unique hits to all
   // caches sized N or smaller.  We'll aggregate the cache performance across
   // all threads; global L1 accesses is equivalent to the sum of individual L1
-  // accesses, etc.
-  vector<unordered_map<uint64_t,uint64_t> > tot_hits(bf_max_set_bits + 1);
+  // accesses, etc.  Each thread's histograms are added in place.
+  vector<HitHistogram> tot_hits(bf_max_set_bits);
   for(auto& cache: *caches){
-    auto hits = cache->getHits();
-    transform(begin(hits), end(hits), begin(tot_hits), begin(tot_hits), mapsum<unordered_map<uint64_t,uint64_t> >);
+    cache->addHits(tot_hits);
   }
 
   return tot_hits;
 }
 
-vector<unordered_map<uint64_t,uint64_t> > bf_get_shared_cache_hits(void){
-  return global_cache->getHits();
+vector<HitHistogram> bf_get_shared_cache_hits(void){
+  finish_shared_cache();
+  vector<HitHistogram> hits(bf_max_set_bits);
+  global_cache->addHits(hits);
+  return hits;
+}
+
+vector<HitHistogram> bf_get_remote_shared_cache_hits(void){
+  finish_shared_cache();
+  vector<HitHistogram> hits(bf_max_set_bits);
+  global_cache->addRemoteHits(hits);
+  return hits;
+}
+
+// Get write-backs of dirty lines
+WritebackHistogram bf_get_private_writebacks(void){
+  WritebackHistogram tot_writebacks(bf_max_set_bits);
+  for(auto& cache: *caches){
+    cache->addWritebacks(tot_writebacks);
+  }
+  return tot_writebacks;
+}
+
+WritebackHistogram bf_get_shared_writebacks(void){
+  finish_shared_cache();
+  WritebackHistogram writebacks(bf_max_set_bits);
+  global_cache->addWritebacks(writebacks);
+  return writebacks;
+}
+
+// Get prefetches issued by the BF_PREFETCH prefetcher
+PrefetchHistogram bf_get_private_prefetches(void){
+  PrefetchHistogram tot_prefetches(bf_max_set_bits);
+  for(auto& cache: *caches){
+    cache->addPrefetches(tot_prefetches);
+  }
+  return tot_prefetches;
+}
+
+PrefetchHistogram bf_get_shared_prefetches(void){
+  finish_shared_cache();
+  PrefetchHistogram prefetches(bf_max_set_bits);
+  global_cache->addPrefetches(prefetches);
+  return prefetches;
 }
 
-vector<unordered_map<uint64_t,uint64_t> > bf_get_remote_shared_cache_hits(void){
-  return global_cache->getRemoteHits();
+// Report whether BF_PREFETCH enabled a prefetcher
+bool bf_prefetching(void){
+  return prefetch_config.kind != prefetch_config_t::none;
 }
 
 uint64_t bf_get_private_cold_misses(void){
@@ -211,7 +2258,21 @@ uint64_t bf_get_private_cold_misses(void){
   return res;
 }
 
+uint64_t bf_get_private_capacity_misses(void){
+  uint64_t res = 0;
+  for(auto& cache: *caches){
+    res += cache->getCapacityMisses();
+  }
+  return res;
+}
+
+uint64_t bf_get_shared_capacity_misses(void){
+  finish_shared_cache();
+  return global_cache->getCapacityMisses();
+}
+
 uint64_t bf_get_shared_cold_misses(void){
+  finish_shared_cache();
   return global_cache->getColdMisses();
 }
 
@@ -224,7 +2285,259 @@ uint64_t bf_get_private_split_accesses(void){
 }
 
 uint64_t bf_get_shared_split_accesses(void){
+  finish_shared_cache();
   return global_cache->getSplitAccesses();
 }
 
+// Get the number of accesses the shared-cache model replayed after
+// accesses stamped later
+uint64_t bf_get_shared_late_accesses(void){
+  finish_shared_cache();
+  return shared_merger != nullptr ? shared_merger->getLateAccesses() : 0;
+}
+
+// Get the cache hierarchy described by BF_CACHE_HIERARCHY
+const vector<cache_level_t>& bf_get_cache_hierarchy(void){
+  return *cache_hierarchy;
+}
+
+// Get the misses in each level of the cache hierarchy that was
+// simulated directly (0 for LRU levels)
+vector<uint64_t> bf_get_simulated_misses(void){
+  finish_shared_cache();
+  vector<uint64_t> misses(cache_hierarchy->size(), 0);
+  for(auto& cache: *caches){
+    cache->addSimulatedMisses(misses);
+  }
+  global_cache->addSimulatedMisses(misses);
+  return misses;
+}
+
+// Get every modeled line size, starting with bf_line_size
+const vector<uint64_t>& bf_get_line_sizes(void){
+  return *line_sizes;
+}
+
+// Get the cache hierarchy as modeled with the i-th line size (ways=0
+// for each level it can't model)
+const vector<cache_level_t>& bf_get_cache_hierarchy_by_line_size(size_t line_size_index){
+  return (*line_size_hierarchies)[line_size_index];
+}
+
+// Summarize the private (or shared) cache model for the i-th line
+// size in the form of a cache-dump header
+bf_cache_dump_header_t bf_get_cache_summary(size_t line_size_index, bool shared){
+  vector<Cache*> models;
+  if(line_size_index == 0){
+    models = shared ? vector<Cache*>(1, global_cache) : *caches;
+  } else if(shared){
+    models.push_back((*extra_global_caches)[line_size_index - 1]);
+  } else {
+    models = (*all_extra_caches)[line_size_index - 1];
+  }
+  if(shared){
+    finish_shared_cache();
+  }
+  bf_cache_dump_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BF_CACHE_DUMP_MAGIC, sizeof(header.magic));
+  header.version = BF_CACHE_DUMP_VERSION;
+  header.line_size = (*line_sizes)[line_size_index];
+  header.sample_threshold = Cache::sample_modulus;
+  header.sample_modulus = Cache::sample_modulus;
+  header.exact_distance = bf_cache_exact_distance;
+  header.num_histograms = bf_max_set_bits;
+  for(auto& model: models){
+    header.accesses += model->getAccesses();
+    header.cold_misses += model->getColdMisses();
+    header.split_accesses += model->getSplitAccesses();
+    header.capacity_misses += model->getCapacityMisses();
+    header.sample_threshold = min(header.sample_threshold, model->getSampleThreshold());
+    header.sampled_lines += model->getSampledLines();
+  }
+  return header;
+}
+
+// Get the private (or shared) cache hits for the i-th line size
+vector<HitHistogram> bf_get_cache_hits_by_line_size(size_t line_size_index, bool shared){
+  if(line_size_index == 0){
+    return shared ? bf_get_shared_cache_hits() : bf_get_private_cache_hits();
+  }
+  vector<HitHistogram> hits(bf_max_set_bits);
+  if(shared){
+    finish_shared_cache();
+    (*extra_global_caches)[line_size_index - 1]->addHits(hits);
+  } else {
+    for(auto& model: (*all_extra_caches)[line_size_index - 1]){
+      model->addHits(hits);
+    }
+  }
+  return hits;
+}
+
+// Get the TLB hierarchy described by BF_TLB_HIERARCHY
+const vector<tlb_level_t>& bf_get_tlb_hierarchy(void){
+  return *tlb_hierarchy;
+}
+
+// Get the page sizes the TLB model tracks
+vector<uint64_t> bf_get_tlb_page_sizes(void){
+  return vector<uint64_t>(tlb_page_sizes, tlb_page_sizes + num_tlb_page_sizes);
+}
+
+// Get all threads' TLB accesses for the i-th page size
+uint64_t bf_get_tlb_accesses(size_t page_size_index){
+  uint64_t res = 0;
+  for(auto& tlb: *all_tlbs[page_size_index]){
+    res += tlb->getAccesses();
+  }
+  return res;
+}
+
+// Get all threads' TLB hits for the i-th page size
+vector<HitHistogram> bf_get_tlb_hits(size_t page_size_index){
+  vector<HitHistogram> tot_hits(tlb_set_bits);
+  for(auto& tlb: *all_tlbs[page_size_index]){
+    tlb->addHits(tot_hits);
+  }
+  return tot_hits;
+}
+
+// Get the number of falsely shared lines BF_FALSE_SHARING asks for
+// (0=no false-sharing detection)
+uint64_t bf_get_false_sharing_report_size(void){
+  return false_sharing_lines;
+}
+
+// Get the total coherence invalidations and those due to false sharing
+void bf_get_coherence_invalidations(uint64_t* invalidations,
+                                    uint64_t* false_invalidations){
+  finish_shared_cache();
+  *invalidations = coherence->getInvalidations();
+  *false_invalidations = coherence->getFalseInvalidations();
+}
+
+// Get every line that incurred a coherence invalidation, naming
+// functions by their unique symbols
+vector<false_sharing_t> bf_get_false_sharing(void){
+  finish_shared_cache();
+  auto shared = coherence->getSharedLines();
+  for(auto& line : shared){
+    for(auto& pair : line.funcs){
+      if(pair.storer != nullptr) pair.storer = bf_string_to_symbol(pair.storer);
+      if(pair.victim != nullptr) pair.victim = bf_string_to_symbol(pair.victim);
+    }
+  }
+  return shared;
+}
+
+// Get a function's misses in each level of the cache hierarchy,
+// followed by its misses of each miss_kind_t in each level
+vector<uint64_t> bf_get_func_cache_misses(const char* funcname){
+  // Combine all caches' per-function misses by function name the
+  // first time we're called.
+  static unordered_map<const char*,vector<uint64_t> >* func_misses = nullptr;
+  if(func_misses == nullptr){
+    finish_shared_cache();
+    func_misses = new unordered_map<const char*,vector<uint64_t> >();
+    auto all_caches = *caches;
+    all_caches.push_back(global_cache);
+    for(auto& cache: all_caches){
+      for(const auto& elem : cache->getFuncMisses()){
+        auto& misses = (*func_misses)[bf_string_to_symbol(elem.first)];
+        misses = misses.empty() ? elem.second : vecsum(misses, elem.second);
+      }
+    }
+  }
+  auto func_iter = func_misses->find(funcname);
+  if(func_iter == func_misses->end()){
+    return vector<uint64_t>(cache_hierarchy->size()*(1 + num_miss_kinds), 0);
+  }
+  return func_iter->second;
+}
+
+// Get each memory instruction's misses in each level of the cache
+// hierarchy, combining instructions with the same description
+vector<pair<const char*,vector<uint64_t> > > bf_get_miss_sites(void){
+  finish_shared_cache();
+  auto num_levels = cache_hierarchy->size();
+  unordered_map<const char*,vector<uint64_t> > site_misses;
+  auto all_caches = *caches;
+  all_caches.push_back(global_cache);
+  const auto& id_to_name = site_id_to_name();
+  for(auto& cache: all_caches){
+    if(cache->getNumLevels() != num_levels){
+      continue;
+    }
+    auto misses = cache->getSiteMisses();
+    for(uint64_t site = 0; site*num_levels < misses.size(); ++site){
+      auto first = begin(misses) + site*num_levels;
+      if(all_of(first, first + num_levels, [](uint64_t m){ return m == 0; })){
+        continue;
+      }
+      auto& total = site_misses[bf_string_to_symbol(id_to_name[site])];
+      total.resize(num_levels, 0);
+      transform(first, first + num_levels, begin(total), begin(total),
+                [](uint64_t a, uint64_t b){ return a + b; });
+    }
+  }
+  return vector<pair<const char*,vector<uint64_t> > >(begin(site_misses),
+                                                        end(site_misses));
+}
+
+// Get the lowest sampling threshold of any private cache
+uint64_t bf_get_private_sample_threshold(void){
+  uint64_t res = Cache::sample_modulus;
+  for(auto& cache: *caches){
+    res = min(res, cache->getSampleThreshold());
+  }
+  return res;
+}
+
+uint64_t bf_get_shared_sample_threshold(void){
+  finish_shared_cache();
+  return global_cache->getSampleThreshold();
+}
+
+uint64_t bf_get_private_sampled_lines(void){
+  uint64_t res = 0;
+  for(auto& cache: *caches){
+    res += cache->getSampledLines();
+  }
+  return res;
+}
+
+uint64_t bf_get_shared_sampled_lines(void){
+  finish_shared_cache();
+  return global_cache->getSampledLines();
+}
+
+// Each modeled miss ratio is a ratio estimate over a random sample of
+// lines.  Whatever the cache size, a line's contribution to the misses
+// deviates from its expected share by at most its access count c, so
+// the estimate's standard error is at most sqrt(sum c^2)/sum c.
+static double sample_error(double square_accesses, uint64_t accesses){
+  if(accesses == 0){
+    return 0.0;
+  }
+  return 1.96*sqrt(square_accesses)/double(accesses);
+}
+
+// Get a 95% confidence bound on the error in private-cache miss ratios
+double bf_get_private_sample_error(void){
+  double square_accesses = 0.0;
+  uint64_t accesses = 0;
+  for(auto& cache: *caches){
+    square_accesses += cache->getSquareLineAccesses();
+    accesses += cache->getModeledAccesses();
+  }
+  return sample_error(square_accesses, accesses);
+}
+
+double bf_get_shared_sample_error(void){
+  finish_shared_cache();
+  return sample_error(global_cache->getSquareLineAccesses(),
+                      global_cache->getModeledAccesses());
+}
+
 } // namespace bytesflops
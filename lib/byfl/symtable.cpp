@@ -9,45 +9,172 @@
 
 using namespace std;
 
-// Say whether one string is strictly less than another.
-struct str_less_than
-{
-  bool operator()(const char* s1, const char* s2) const {
-    if (s1 == s2)
-      return false;
-    return strcmp(s1, s2) < 0;
+namespace bytesflops {
+
+// Store symbols contiguously in large chunks of memory that are never
+// freed.  Allocation is a simple pointer bump.
+class SymbolArena {
+private:
+  static const size_t chunk_size = 65536;  // Bytes per chunk
+  char* next_free;        // Next unused byte in the current chunk
+  size_t bytes_left;      // Number of unused bytes in the current chunk
+
+public:
+  SymbolArena() {
+    next_free = NULL;
+    bytes_left = 0;
+  }
+
+  // Copy a string of a given length (excluding the trailing '\0')
+  // into the arena and return the copy.
+  const char* copy (const char* str, size_t len) {
+    char* result;
+    if (len + 1 > chunk_size / 4)
+      // Give large strings their own allocation.
+      result = (char*) malloc(len + 1);
+    else {
+      if (len + 1 > bytes_left) {
+        next_free = (char*) malloc(chunk_size);
+        bytes_left = chunk_size;
+      }
+      result = next_free;
+      next_free += len + 1;
+      bytes_left -= len + 1;
+    }
+    memcpy(result, str, len + 1);
+    return result;
   }
 };
 
-namespace bytesflops {
+// Map equal strings to a single, unique string using an
+// open-addressing hash table with linear probing.  Each slot caches
+// its symbol's hash and length so probing rarely touches the string
+// itself and growing the table never rehashes a string.
+class SymbolTable {
+private:
+  typedef struct {
+    uint64_t hash;        // Hash of the symbol
+    size_t length;        // Length of the symbol, excluding the trailing '\0'
+    const char* symbol;   // Interned string (NULL=empty slot)
+  } slot_t;
+  slot_t* slots;          // The table proper
+  size_t num_slots;       // Number of slots (always a power of two)
+  size_t num_symbols;     // Number of occupied slots
+  SymbolArena arena;      // Storage for the symbols' characters
 
-// Define a map from equal strings to equivalent strings.
-typedef map<const char*, const char*, str_less_than> symbol_table_t;
-static symbol_table_t* symbol_table = NULL;
+  // Insert an interned symbol into a table, assuming it's not
+  // already present and there's room for it.
+  static void insert (slot_t* table, size_t table_size, const slot_t& entry) {
+    size_t mask = table_size - 1;
+    for (size_t i = entry.hash & mask; ; i = (i + 1) & mask)
+      if (table[i].symbol == NULL) {
+        table[i] = entry;
+        return;
+      }
+  }
+
+  // Double the number of slots.
+  void grow (void) {
+    size_t new_num_slots = num_slots*2;
+    slot_t* new_slots = new slot_t[new_num_slots];
+    memset(new_slots, 0, new_num_slots*sizeof(slot_t));
+    for (size_t i = 0; i < num_slots; i++)
+      if (slots[i].symbol != NULL)
+        insert(new_slots, new_num_slots, slots[i]);
+    delete[] slots;
+    slots = new_slots;
+    num_slots = new_num_slots;
+  }
+
+public:
+  SymbolTable() {
+    num_slots = 4096;
+    num_symbols = 0;
+    slots = new slot_t[num_slots];
+    memset(slots, 0, num_slots*sizeof(slot_t));
+  }
+
+  // Map a nonunique string to a unique string.
+  const char* intern (const char* nonunique) {
+    // Compute the string's hash (64-bit FNV-1a) and length in a
+    // single pass.
+    uint64_t hash = 14695981039346656037ULL;
+    const char* c;
+    for (c = nonunique; *c != '\0'; c++) {
+      hash ^= (unsigned char) *c;
+      hash *= 1099511628211ULL;
+    }
+    size_t length = c - nonunique;
+
+    // Return the existing symbol if there is one.
+    size_t mask = num_slots - 1;
+    size_t i;
+    for (i = hash & mask; slots[i].symbol != NULL; i = (i + 1) & mask)
+      if (slots[i].hash == hash
+          && slots[i].length == length
+          && memcmp(slots[i].symbol, nonunique, length) == 0)
+        return slots[i].symbol;
+
+    // New entry for the symbol table -- create a unique symbol and
+    // return it.  Keep the table at most half full.
+    slots[i].hash = hash;
+    slots[i].length = length;
+    slots[i].symbol = arena.copy(nonunique, length);
+    const char* unique = slots[i].symbol;
+    if (++num_symbols*2 > num_slots)
+      grow();
+    return unique;
+  }
+};
+
+static SymbolTable* symbol_table = NULL;
+static pthread_mutex_t symbol_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Remember recently returned symbols so that re-interning a string
+// that is already a symbol requires only a pointer comparison.
+// Entries are only ever symbols, which are immutable and never freed,
+// so the cache can be read without acquiring symbol_table_lock.
+static const size_t identity_cache_size = 1024;   // Must be a power of two
+static const char* identity_cache[identity_cache_size];
+
+// Return the identity cache slot for a given pointer.
+static inline const char** identity_cache_slot (const char* str)
+{
+  return &identity_cache[(uintptr_t(str) >> 3) & (identity_cache_size - 1)];
+}
 
 
 // Initialize some of our variables at first use.
 void initialize_symtable (void) {
-  symbol_table = new symbol_table_t();
+  symbol_table = new SymbolTable();
 }
 
 
 // Map a nonunique string to a unique string (in other words, intern a
 // string to a symbol).
+static const char* string_to_symbol (const char* nonunique)
+{
+  const char* unique = symbol_table->intern(nonunique);
+  __atomic_store_n(identity_cache_slot(unique), unique, __ATOMIC_RELAXED);
+  return unique;
+}
+
+
+// Map a nonunique string to a unique string, serializing access to
+// the symbol table in multithreaded programs.
 const char* bf_string_to_symbol (const char* nonunique)
 {
   if (nonunique == NULL)
     return NULL;
-  symbol_table_t::iterator sym_iter = symbol_table->find(nonunique);
-  if (sym_iter == symbol_table->end()) {
-    // New entry for the symbol table -- create a unique symbol and return it.
-    const char* unique = strdup(nonunique);
-    (*symbol_table)[unique] = unique;
-    return unique;
-  }
-  else
-    // Existing entry in the symbol table -- return it.
-    return sym_iter->second;
+  if (__atomic_load_n(identity_cache_slot(nonunique), __ATOMIC_RELAXED) == nonunique)
+    // The string is already a symbol.
+    return nonunique;
+  if (!bf_thread_safe)
+    return string_to_symbol(nonunique);
+  pthread_mutex_lock(&symbol_table_lock);
+  const char* unique = string_to_symbol(nonunique);
+  pthread_mutex_unlock(&symbol_table_lock);
+  return unique;
 }
 
 } // namespace bytesflops
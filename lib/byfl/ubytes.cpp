@@ -87,10 +87,13 @@ public:
 typedef CachedUnorderedMap<uintptr_t, PageTableEntry*, hash<uintptr_t>, eqaddr> page_to_bits_t;
 typedef CachedUnorderedMap<const char*, page_to_bits_t*> func_to_page_t;
 
-// Keep track of the unique bytes touched by each function and by the
-// program as a whole.
+// Keep track of the unique bytes touched by each function, by each
+// thread and each function within each thread (in multithreaded
+// programs), and by the program as a whole.
 static page_to_bits_t* global_unique_bytes = NULL;
 static func_to_page_t* function_unique_bytes = NULL;
+static vector<page_to_bits_t*>* thread_unique_bytes = NULL;
+static vector<func_to_page_t*>* thread_function_unique_bytes = NULL;
 
 namespace bytesflops {
 
@@ -99,6 +102,8 @@ void initialize_ubytes (void)
 {
   global_unique_bytes = new page_to_bits_t();
   function_unique_bytes = new func_to_page_t();
+  thread_unique_bytes = new vector<page_to_bits_t*>();
+  thread_function_unique_bytes = new vector<func_to_page_t*>();
 }
 
 
@@ -127,6 +132,20 @@ uint64_t bf_tally_unique_addresses (const char* funcname)
 }
 
 
+// Return the number of unique addresses referenced by a given function
+// in a given thread.
+uint64_t bf_tally_unique_addresses (const char* funcname, size_t thread_id)
+{
+  if (thread_id >= thread_function_unique_bytes->size() || (*thread_function_unique_bytes)[thread_id] == NULL)
+    return 0;
+  func_to_page_t::iterator map_iter = (*thread_function_unique_bytes)[thread_id]->find(funcname);
+  if (map_iter == (*thread_function_unique_bytes)[thread_id]->end())
+    return 0;
+  else
+    return tally_unique_addresses(*map_iter->second);
+}
+
+
 // Return the number of unique addresses referenced by the entire program.
 uint64_t bf_tally_unique_addresses (void)
 {
@@ -134,6 +153,16 @@ uint64_t bf_tally_unique_addresses (void)
 }
 
 
+// Return the number of unique addresses referenced by a given thread.
+uint64_t bf_tally_unique_addresses (size_t thread_id)
+{
+  if (thread_id >= thread_unique_bytes->size() || (*thread_unique_bytes)[thread_id] == NULL)
+    return 0;
+  else
+    return tally_unique_addresses(*(*thread_unique_bytes)[thread_id]);
+}
+
+
 // Given a mapping of page numbers to bit vectors and a page number,
 // return a bit vector, creating it if not found.
 static PageTableEntry* find_or_create_page (page_to_bits_t& mapping, uint64_t pagenum)
@@ -192,29 +221,49 @@ static page_to_bits_t* assoc_addresses_with_func (const char* funcname,
 }
 
 
-// Associate a set of memory locations with a given function.  This
-// function basically wraps assoc_addresses_with_func() with a quick
+// Return the page-to-bit-vector mapping for a given function in the
+// calling thread, creating it if not found.
+static page_to_bits_t* thread_func_mapping (const char* funcname)
+{
+  if (bf_thread_id >= thread_function_unique_bytes->size())
+    thread_function_unique_bytes->resize(bf_thread_id + 1, NULL);
+  func_to_page_t*& thread_funcs = (*thread_function_unique_bytes)[bf_thread_id];
+  if (thread_funcs == NULL)
+    thread_funcs = new func_to_page_t();
+  func_to_page_t::iterator map_iter = thread_funcs->find(funcname);
+  if (map_iter == thread_funcs->end())
+    return (*thread_funcs)[funcname] = new page_to_bits_t();
+  else
+    return map_iter->second;
+}
+
+
+// Associate a set of memory locations with a given function and, in
+// multithreaded programs, with the function in the calling thread.
+// This function basically wraps assoc_addresses_with_func() with a quick
 // cache lookup.
 void bf_assoc_addresses_with_func (const char* funcname, uint64_t baseaddr, uint64_t numaddrs)
 {
   // Keep track of the two most recently used page-to-bit-vector maps.
   typedef struct {
     const char* funcname;
+    size_t thread_id;
     page_to_bits_t* unique_bytes;
+    page_to_bits_t* thread_unique_bytes;   // NULL if not multithreaded
   } prev_value_t;
-  static prev_value_t prev_values[2] = {{NULL, NULL}, {NULL, NULL}};
+  static prev_value_t prev_values[2] = {{NULL, 0, NULL, NULL}, {NULL, 0, NULL, NULL}};
 
   // Find the given function's mapping from page number to bit list.
   if (bf_call_stack)
-    funcname = bf_func_and_parents;
+    funcname = bf_func_and_parents();
   else
     funcname = bf_string_to_symbol(funcname);
-  if (funcname == prev_values[0].funcname)
+  if (funcname == prev_values[0].funcname && bf_thread_id == prev_values[0].thread_id)
     // Fastest case: same function as last time
     flag_bytes_in_range(*prev_values[0].unique_bytes, baseaddr, numaddrs);
   else
     // Second-fastest case: same function as the time before last
-    if (funcname == prev_values[1].funcname) {
+    if (funcname == prev_values[1].funcname && bf_thread_id == prev_values[1].thread_id) {
       prev_value_t swap = prev_values[0];
       prev_values[0] = prev_values[1];
       prev_values[1] = swap;
@@ -224,15 +273,28 @@ void bf_assoc_addresses_with_func (const char* funcname, uint64_t baseaddr, uint
       // Slowest case: different function from the last two times
       prev_values[1] = prev_values[0];
       prev_values[0].funcname = funcname;
+      prev_values[0].thread_id = bf_thread_id;
       prev_values[0].unique_bytes = assoc_addresses_with_func(funcname, baseaddr, numaddrs);
+      prev_values[0].thread_unique_bytes = bf_thread_safe ? thread_func_mapping(funcname) : NULL;
     }
+  if (prev_values[0].thread_unique_bytes != NULL)
+    flag_bytes_in_range(*prev_values[0].thread_unique_bytes, baseaddr, numaddrs);
 }
 
 
-// Associate a set of memory locations with the program as a whole.
+// Associate a set of memory locations with the program as a whole
+// and, in multithreaded programs, with the calling thread.
 void bf_assoc_addresses_with_prog (uint64_t baseaddr, uint64_t numaddrs)
 {
   flag_bytes_in_range(*global_unique_bytes, baseaddr, numaddrs);
+  if (bf_thread_safe) {
+    if (bf_thread_id >= thread_unique_bytes->size())
+      thread_unique_bytes->resize(bf_thread_id + 1, NULL);
+    page_to_bits_t*& unique_bytes = (*thread_unique_bytes)[bf_thread_id];
+    if (unique_bytes == NULL)
+      unique_bytes = new page_to_bits_t();
+    flag_bytes_in_range(*unique_bytes, baseaddr, numaddrs);
+  }
 }
 
 } // namespace bytesflops
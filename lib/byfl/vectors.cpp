@@ -124,7 +124,7 @@ void bf_tally_vector_operation (const char *funcname, uint64_t num_elements,
   // Find the given function's mapping from vector to tally and increment that.
   if (bf_per_func)
     if (bf_call_stack)
-      funcname = bf_func_and_parents;
+      funcname = bf_func_and_parents();
     else
       funcname = bf_string_to_symbol(funcname);
   else
@@ -15,6 +15,18 @@ namespace bytesflops_pass {
   InstrumentEveryBB("bf-every-bb", cl::init(false), cl::NotHidden,
                     cl::desc("Output byte and flop counts at the end of every basic block"));
 
+  // Define a command-line option for counting only basic-block
+  // executions and deriving all other counts from static tables.
+  cl::opt<bool>
+  BBFrequencies("bf-bb-freq", cl::init(false), cl::NotHidden,
+                cl::desc("Count only basic-block executions and compute all other tallies at exit"));
+
+  // Define a command-line option for accumulating counters in
+  // registers within innermost loops.
+  cl::opt<bool>
+  PromoteLoopCounters("bf-loop-regs", cl::init(false), cl::NotHidden,
+                      cl::desc("Keep inner-loop counters in registers and update memory only on loop exit"));
+
   // Define a command-line option for aggregating measurements by
   // function name.
   cl::opt<bool>
@@ -110,9 +122,21 @@ namespace bytesflops_pass {
                  cl::value_desc("size"));
 
   // Define a command-line option to dump out the raw cache data to file.
-  cl::opt<bool>
-  DumpCache("bf-dump-cache", cl::init(false), cl::NotHidden,
-            cl::desc("Dump out cache data to file."));
+  cl::bits<DumpCacheType>
+  DumpCache("bf-dump-cache", cl::NotHidden, cl::CommaSeparated, cl::ValueOptional,
+            cl::desc("Dump out cache data to file."),
+            cl::values(clEnumValN(DC_TEXT,    "text",   "Dump text .dump files"),
+                       clEnumValN(DC_BINARY,  "binary", "Dump binary .bdump files"),
+                       clEnumValN(DC_DEFAULT, "",       "Dump text .dump files"),
+                       clEnumValEnd));
+  unsigned int dc_bits = 0;    // Same as DumpCache.getBits() but with DC_DEFAULT expanded
+
+  // Define a command-line option for the largest reuse distance the
+  // cache model counts exactly.
+  cl::opt<unsigned long long>
+  CacheExactDist("bf-cache-exact-dist", cl::init(0), cl::NotHidden,
+                 cl::desc("Largest reuse distance the cache model counts exactly; larger distances are binned by powers of two (0=no binning)."),
+                 cl::value_desc("distance"));
 
   // Define a command-line option to specify the maximum number of sets.
   cl::opt<unsigned long long>
@@ -120,6 +144,34 @@ namespace bytesflops_pass {
                cl::desc("Log base 2 of the maximum number of sets modeled at the same time."),
                cl::value_desc("bits"));
 
+  // Define a command-line option to bound the memory used by the cache
+  // model.
+  cl::opt<unsigned long long>
+  CacheMaxBytes("bf-cache-max-bytes", cl::init(0), cl::NotHidden,
+                cl::desc("Largest cache size, in bytes, the cache model tracks (0=unlimited)."),
+                cl::value_desc("bytes"));
+
+  // Define a command-line option to model only a sample of the cache
+  // lines.
+  cl::opt<double>
+  CacheSampleRate("bf-cache-sample", cl::init(1.0), cl::NotHidden,
+                  cl::desc("Fraction of cache lines the cache model samples."),
+                  cl::value_desc("fraction"));
+
+  // Define a command-line option to sample ever fewer cache lines to
+  // bound the number modeled.
+  cl::opt<unsigned long long>
+  CacheSampleLines("bf-cache-sample-lines", cl::init(0), cl::NotHidden,
+                   cl::desc("Number of cache lines to sample before lowering the sampling rate (0=fixed rate)."),
+                   cl::value_desc("lines"));
+
+  // Define a command-line option to report the memory instructions
+  // that incur the most cache misses.
+  cl::opt<unsigned long long>
+  MissSites("bf-miss-sites", cl::init(0), cl::NotHidden,
+            cl::desc("Number of memory instructions incurring the most cache misses to report (0=none)."),
+            cl::value_desc("count"));
+
   static RegisterPass<BytesFlops> H("bytesflops", "Bytes:flops instrumentation");
 
 }  // namespace bytesflops_pass
@@ -12,6 +12,7 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instruction.h"
@@ -22,11 +23,15 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <set>
 #include <iomanip>
+#include <map>
 #include <unordered_map>
 #include "byfl-common.h"
 
@@ -39,6 +44,14 @@ namespace bytesflops_pass {
   // every basic block instead of only once at the end of the program.
   extern cl::opt<bool> InstrumentEveryBB;
 
+  // Define a command-line option for counting only basic-block
+  // executions and deriving all other counts from static tables.
+  extern cl::opt<bool> BBFrequencies;
+
+  // Define a command-line option for accumulating counters in
+  // registers within innermost loops.
+  extern cl::opt<bool> PromoteLoopCounters;
+
   // Define a command-line option for aggregating measurements by
   // function name.
   extern cl::opt<bool> TallyByFunction;
@@ -97,11 +110,28 @@ namespace bytesflops_pass {
   extern cl::opt<unsigned long long> CacheLineBytes;
 
   // Define a command-line option for dumping cache data to file.
-  extern cl::opt<bool> DumpCache;
+  typedef enum {DC_TEXT, DC_BINARY, DC_DEFAULT} DumpCacheType;
+  extern cl::bits<DumpCacheType> DumpCache;
+  extern unsigned int dc_bits;    // Same as DumpCache.getBits() but with DC_DEFAULT expanded
+
+  // Define a command-line option for the largest reuse distance counted exactly.
+  extern cl::opt<unsigned long long> CacheExactDist;
 
   // Define a command-line option for log2 of the maximum number of sets to model.
   extern cl::opt<unsigned long long> CacheMaxSetBits;
 
+  // Define a command-line option for the largest cache size to model.
+  extern cl::opt<unsigned long long> CacheMaxBytes;
+
+  // Define a command-line option for the fraction of cache lines to sample.
+  extern cl::opt<double> CacheSampleRate;
+
+  // Define a command-line option for the number of cache lines to sample.
+  extern cl::opt<unsigned long long> CacheSampleLines;
+
+  // Define a command-line option for the number of cache-miss sites to report.
+  extern cl::opt<unsigned long long> MissSites;
+
   // Destructively remove all instances of a given character from a string.
   extern void remove_all_instances(string& some_string, char some_char);
 
@@ -171,13 +201,27 @@ namespace bytesflops_pass {
     Function* tally_vector;      // Pointer to bf_tally_vector_operation()
     Function* reuse_dist_prog;   // Pointer to bf_reuse_dist_addrs_prog()
     Function* memset_intrinsic;  // Pointer to LLVM's memset() intrinsic
-    Function* access_cache;      // Pointer to bf_touch_cache()
+    Function* access_cache;      // Pointer to bf_touch_cache() or bf_touch_cache_from()
+    Function* register_func_table;  // Pointer to bf_register_func_table()
     StringMap<Constant*> func_name_to_arg;   // Map from a function name to an IR function argument
+    StringMap<uint64_t> func_name_to_id;     // Map from a function name to a module-local function ID
+    vector<Constant*> func_table;            // Function names indexed by module-local function ID
+    GlobalVariable* func_id_base_var;        // Program-wide ID of the module's first function
+    Function* register_site_table;  // Pointer to bf_register_site_table()
+    vector<Constant*> site_table;            // Memory-instruction locations indexed by module-local site ID
+    GlobalVariable* site_id_base_var;        // Program-wide ID of the module's first memory instruction
+    Function* register_bb_table;  // Pointer to bf_register_bb_table()
+    GlobalVariable* bb_freq_var;  // Global reference to bf_bb_freq_counts, an array of basic-block execution counts
+    GlobalVariable* bb_id_base_var;          // Program-wide ID of the module's first basic block
+    vector<uint64_t> bb_static_rows;         // {function ID, first increment, number of increments} per basic block
+    vector<uint64_t> bb_static_increments;   // {BF_BBF_* counter, increment} pairs for all basic blocks
+    bool bb_has_dynamic_increments;          // true=current basic block increments a counter by a run-time value
     set<string>* instrument_only;   // Set of functions to instrument; NULL=all
     set<string>* dont_instrument;   // Set of functions not to instrument; NULL=none
     ConstantInt* not_end_of_bb;     // 0, not at the end of a basic block
     ConstantInt* uncond_end_bb;     // 1, basic block ended with an unconditional branch
     ConstantInt* cond_end_bb;       // 2, basic block ended with a conditional branch
+    bool bb_uses_shared_state;   // true=current basic block calls a function that needs the mega-lock
     ConstantInt* zero;        // A 64-bit constant "0"
     ConstantInt* one;         // A 64-bit constant "1"
     typedef unordered_map<string, unsigned long> str2ul_t;
@@ -202,14 +246,77 @@ namespace bytesflops_pass {
       }
     };
 
+    // Keep track of the constant amounts by which the current basic
+    // block increments each counter so that the basic block can
+    // update each counter only once.
+    typedef struct {
+      Constant* global_var;   // Counter or pointer to an array of counters
+      uint64_t idx;           // Index into the array (ignored for scalar counters)
+      bool is_array;          // true=global_var points to an array
+      uint64_t increment;     // Sum of the basic block's increments
+    } pending_increment_t;
+    vector<pending_increment_t> pending_increments;
+
+    // Add a constant increment of a counter to pending_increments.
+    void defer_increment(Constant* global_var, bool is_array,
+                         uint64_t idx, uint64_t increment);
+
+    // Insert code to apply and then forget all pending increments.
+    void flush_pending_increments(BasicBlock::iterator& insert_before);
+
+    // Insert code to add a value to a scalar counter or to an element
+    // of a counter array.  array_base caches array pointers that were
+    // already loaded.
+    void add_to_counter(Constant* global_var, bool is_array, uint64_t idx,
+                        Value* increment, map<Constant*, LoadInst*>& array_base,
+                        Instruction* insert_before);
+
+    // With -bf-loop-regs, an innermost loop accumulates its constant
+    // counter increments in local variables, which mem2reg promotes
+    // to registers.  The loop adds the local sums to the global
+    // counters only when it exits.
+    typedef struct {
+      Constant* global_var;   // Counter or pointer to an array of counters
+      uint64_t idx;           // Index into the array (ignored for scalar counters)
+      bool is_array;          // true=global_var points to an array
+      AllocaInst* local_var;  // The loop's partial sum of the counter
+    } promoted_counter_t;
+    map<Loop*, vector<promoted_counter_t> > promoted_counters;   // Loop-local counters for each loop
+    map<Loop*, bool> loop_is_promotable;   // Memoized results of promotable_loop()
+    Loop* current_promoted_loop;   // Loop whose counters the current basic block updates (NULL=none)
+
+    // Return the innermost loop containing a basic block if the loop's
+    // counters can be kept in registers, otherwise NULL.
+    Loop* promotable_loop(BasicBlock& bb);
+
+    // Return a loop's local variable corresponding to a given counter,
+    // creating it if necessary.
+    AllocaInst* promoted_counter(Loop* loop, Constant* global_var,
+                                 bool is_array, uint64_t idx);
+
+    // Initialize each loop-local counter on loop entry, write it back
+    // on every loop exit, and promote it to a register.
+    void promote_loop_counters(Function& function);
+
+    // Map a pending increment to a BF_BBF_* counter identifier.
+    uint64_t bb_freq_counter(const pending_increment_t& pending);
+
+    // Record all pending increments as the current basic block's
+    // static counts, insert code to increment the basic block's
+    // execution count, and forget the pending increments.
+    void record_bb_static_counts(Module* module, StringRef function_name,
+                                 BasicBlock::iterator& insert_before);
+
     // Insert after a given instruction some code to increment a
-    // global variable.
+    // global variable.  Constant increments are deferred until the
+    // next flush_pending_increments().
     void increment_global_variable(BasicBlock::iterator& iter,
                                    Constant* global_var,
                                    Value* increment);
 
     // Insert after a given instruction some code to increment an
-    // element of a global array.
+    // element of a global array.  Constant increments of constant
+    // indexes are deferred until the next flush_pending_increments().
     void increment_global_array(BasicBlock::iterator& insert_before,
                                 Constant* global_var,
                                 Value* idx,
@@ -263,9 +370,23 @@ namespace bytesflops_pass {
     // Map a function name (string) to an argument to an IR function call.
     Constant* map_func_name_to_arg (Module* module, StringRef funcname);
 
+    // Map a function name to a module-local function ID.
+    uint64_t assign_func_id (Module* module, StringRef funcname);
+
+    // Assign a memory instruction a program-wide site ID, inserting
+    // code to compute the ID before a given instruction.
+    Value* map_inst_to_site_id (Module* module, StringRef funcname,
+                                Instruction& inst, Instruction* insert_before);
+
+    // Map a function name to a program-wide function ID, inserting
+    // code to compute the ID before a given instruction.
+    Value* map_func_name_to_id (Module* module, StringRef funcname,
+                                Instruction* insert_before);
+
     // Declare an external variable.
     GlobalVariable* declare_global_var(Module& module, Type* var_type,
-                                       StringRef var_name, bool is_const=false);
+                                       StringRef var_name, bool is_const=false,
+                                       bool is_thread_local=false);
 
     // Insert code to set every element of a given array to zero.
     void insert_zero_array_code(Module* module,
@@ -292,6 +413,12 @@ namespace bytesflops_pass {
     void callinst_create(Value* function, ArrayRef<Value*> args,
                          BasicBlock* insert_before);
 
+    // Ditto the above but for run-time functions that manipulate
+    // state shared by all threads.  In thread-safe mode, the current
+    // basic block's instrumentation will run under the mega-lock.
+    void callinst_create_shared(Value* function, ArrayRef<Value*> args,
+                                Instruction* insert_before);
+
     // Given a Call instruction, return true if we can safely ignore it.
     bool ignorable_call (const Instruction* inst);
 
@@ -381,6 +508,9 @@ namespace bytesflops_pass {
     // Insert code for incrementing our byte, flop, etc. counters.
     virtual bool runOnFunction(Function& function);
 
+    // Register the module's function names with the run-time library.
+    virtual bool doFinalization(Module& module);
+
     // Output what we instrumented.
     virtual void print(raw_ostream &outfile, const Module *module) const;
   };
@@ -83,11 +83,199 @@ namespace bytesflops_pass {
     return resulting_set;
   }
 
+  // Add a constant increment of a counter to pending_increments.
+  void BytesFlops::defer_increment(Constant* global_var, bool is_array,
+                                   uint64_t idx, uint64_t increment) {
+    for (vector<pending_increment_t>::iterator pi_iter = pending_increments.begin();
+         pi_iter != pending_increments.end();
+         pi_iter++)
+      if (pi_iter->global_var == global_var && (!is_array || pi_iter->idx == idx)) {
+        pi_iter->increment += increment;
+        return;
+      }
+    pending_increment_t new_increment;
+    new_increment.global_var = global_var;
+    new_increment.is_array = is_array;
+    new_increment.idx = idx;
+    new_increment.increment = increment;
+    pending_increments.push_back(new_increment);
+  }
+
+  // Insert code to add a value to a scalar counter or to an element of
+  // a counter array.  Each array pointer is loaded only once per
+  // array_base.
+  void BytesFlops::add_to_counter(Constant* global_var, bool is_array, uint64_t idx,
+                                  Value* increment, map<Constant*, LoadInst*>& array_base,
+                                  Instruction* insert_before) {
+    if (!is_array) {
+      // Scalar counter: load, add, and store.
+      LoadInst* load_var = new LoadInst(global_var, "gvar", false, insert_before);
+      BinaryOperator* inc_var =
+        BinaryOperator::Create(Instruction::Add, load_var, increment,
+                               "new_gvar", insert_before);
+      new StoreInst(inc_var, global_var, false, insert_before);
+      return;
+    }
+
+    // Array element: load the array pointer if necessary then load,
+    // add, and store the element.
+    LoadInst*& load_array = array_base[global_var];
+    if (load_array == NULL) {
+      load_array = new LoadInst(global_var, "garray", false, insert_before);
+      load_array->setAlignment(8);
+    }
+    ConstantInt* idx_const = ConstantInt::get(insert_before->getContext(), APInt(64, idx));
+    GetElementPtrInst* idx_ptr = GetElementPtrInst::Create(load_array, idx_const, "idx_ptr", insert_before);
+    LoadInst* idx_val = new LoadInst(idx_ptr, "idx_val", false, insert_before);
+    idx_val->setAlignment(8);
+    BinaryOperator* inc_elt =
+      BinaryOperator::Create(Instruction::Add, idx_val, increment, "new_val", insert_before);
+    StoreInst* store_inst = new StoreInst(inc_elt, idx_ptr, false, insert_before);
+    store_inst->setAlignment(8);
+  }
+
+  // Insert code to apply all pending increments, updating each
+  // counter once and loading each array pointer once.  Within a loop
+  // whose counters were promoted to registers, update the loop-local
+  // counters instead.  Then forget the pending increments.
+  void BytesFlops::flush_pending_increments(BasicBlock::iterator& insert_before) {
+    LLVMContext& globctx = insert_before->getContext();
+    map<Constant*, LoadInst*> array_base;   // Array pointers already loaded
+    for (vector<pending_increment_t>::iterator pi_iter = pending_increments.begin();
+         pi_iter != pending_increments.end();
+         pi_iter++) {
+      if (pi_iter->increment == 0)
+        continue;
+      ConstantInt* increment = ConstantInt::get(globctx, APInt(64, pi_iter->increment));
+      if (current_promoted_loop == NULL) {
+        add_to_counter(pi_iter->global_var, pi_iter->is_array, pi_iter->idx,
+                       increment, array_base, insert_before);
+        continue;
+      }
+      AllocaInst* local_var =
+        promoted_counter(current_promoted_loop, pi_iter->global_var,
+                         pi_iter->is_array, pi_iter->idx);
+      LoadInst* load_local = new LoadInst(local_var, "lvar", false, insert_before);
+      BinaryOperator* inc_local =
+        BinaryOperator::Create(Instruction::Add, load_local, increment,
+                               "new_lvar", insert_before);
+      new StoreInst(inc_local, local_var, false, insert_before);
+    }
+    pending_increments.clear();
+  }
+
+  // Return a loop's local variable corresponding to a given counter,
+  // creating it if necessary.  New variables are not yet inserted into
+  // the function; promote_loop_counters() does that.
+  AllocaInst* BytesFlops::promoted_counter(Loop* loop, Constant* global_var,
+                                           bool is_array, uint64_t idx) {
+    vector<promoted_counter_t>& counters = promoted_counters[loop];
+    for (vector<promoted_counter_t>::iterator pc_iter = counters.begin();
+         pc_iter != counters.end();
+         pc_iter++)
+      if (pc_iter->global_var == global_var && (!is_array || pc_iter->idx == idx))
+        return pc_iter->local_var;
+    promoted_counter_t new_counter;
+    new_counter.global_var = global_var;
+    new_counter.is_array = is_array;
+    new_counter.idx = idx;
+    new_counter.local_var =
+      new AllocaInst(Type::getInt64Ty(global_var->getContext()), "loop_count");
+    counters.push_back(new_counter);
+    return new_counter.local_var;
+  }
+
+  // Map a pending increment to a BF_BBF_* counter identifier.
+  uint64_t BytesFlops::bb_freq_counter(const pending_increment_t& pending) {
+    Constant* global_var = pending.global_var;
+    if (global_var == load_var)
+      return BF_BBF_LOADS;
+    if (global_var == store_var)
+      return BF_BBF_STORES;
+    if (global_var == load_inst_var)
+      return BF_BBF_LOAD_INS;
+    if (global_var == store_inst_var)
+      return BF_BBF_STORE_INS;
+    if (global_var == flop_var)
+      return BF_BBF_FLOPS;
+    if (global_var == fp_bits_var)
+      return BF_BBF_FP_BITS;
+    if (global_var == op_var)
+      return BF_BBF_OPS;
+    if (global_var == op_bits_var)
+      return BF_BBF_OP_BITS;
+    if (global_var == terminator_var)
+      return BF_BBF_TERMINATORS + pending.idx;
+    if (global_var == mem_intrinsics_var)
+      return BF_BBF_MEM_INTRIN + pending.idx;
+    if (global_var == mem_insts_var)
+      return BF_BBF_MEM_INSTS + pending.idx;
+    if (global_var == inst_mix_histo_var)
+      return BF_BBF_INST_MIX + pending.idx;
+    report_fatal_error("Internal error: Unknown counter in -bf-bb-freq mode");
+  }
+
+  // Record all pending increments as the current basic block's static
+  // counts.  Then insert code to increment the basic block's execution
+  // count, which the run-time library later multiplies by the static
+  // counts.
+  void BytesFlops::record_bb_static_counts(Module* module,
+                                           StringRef function_name,
+                                           BasicBlock::iterator& insert_before) {
+    // Append a row to the module's table of basic blocks.
+    uint64_t local_id = bb_static_rows.size()/3;
+    bb_static_rows.push_back(TallyByFunction ? assign_func_id(module, function_name) : 0);
+    bb_static_rows.push_back(bb_static_increments.size()/2);
+    uint64_t num_increments = 0;
+    for (vector<pending_increment_t>::iterator pi_iter = pending_increments.begin();
+         pi_iter != pending_increments.end();
+         pi_iter++)
+      if (pi_iter->increment != 0) {
+        bb_static_increments.push_back(bb_freq_counter(*pi_iter));
+        bb_static_increments.push_back(pi_iter->increment);
+        num_increments++;
+      }
+    bb_static_rows.push_back(num_increments);
+    pending_increments.clear();
+
+    // Define a variable to hold the module's base basic-block ID the
+    // first time we need it.
+    LLVMContext& globctx = module->getContext();
+    if (bb_id_base_var == NULL)
+      bb_id_base_var =
+        new GlobalVariable(*module, Type::getInt64Ty(globctx), false,
+                           GlobalValue::PrivateLinkage, zero, "bf_bb_id_base");
+
+    // Increment bf_bb_freq_counts[bf_bb_id_base + local_id].
+    LoadInst* base_id = new LoadInst(bb_id_base_var, "bb_base_id", false, insert_before);
+    BinaryOperator* bb_id =
+      BinaryOperator::Create(Instruction::Add, base_id,
+                             ConstantInt::get(globctx, APInt(64, local_id)),
+                             "bb_id", insert_before);
+    LoadInst* freq_array = new LoadInst(bb_freq_var, "bb_freq", false, insert_before);
+    freq_array->setAlignment(8);
+    GetElementPtrInst* freq_ptr =
+      GetElementPtrInst::Create(freq_array, bb_id, "bb_freq_ptr", insert_before);
+    LoadInst* old_freq = new LoadInst(freq_ptr, "old_freq", false, insert_before);
+    old_freq->setAlignment(8);
+    BinaryOperator* new_freq =
+      BinaryOperator::Create(Instruction::Add, old_freq, one, "new_freq", insert_before);
+    StoreInst* store_inst = new StoreInst(new_freq, freq_ptr, false, insert_before);
+    store_inst->setAlignment(8);
+  }
+
   // Insert after a given instruction some code to increment a global
   // variable.
   void BytesFlops::increment_global_variable(BasicBlock::iterator& insert_before,
                                              Constant* global_var,
                                              Value* increment) {
+    // Defer constant increments so they can be combined.
+    if (ConstantInt* const_inc = dyn_cast<ConstantInt>(increment)) {
+      defer_increment(global_var, false, 0, const_inc->getZExtValue());
+      return;
+    }
+    bb_has_dynamic_increments = true;
+
     // %0 = load i64* @<global_var>, align 8
     LoadInst* load_var = new LoadInst(global_var, "gvar", false, insert_before);
 
@@ -106,6 +294,16 @@ namespace bytesflops_pass {
                                           Constant* global_var,
                                           Value* idx,
                                           Value* increment) {
+    // Defer constant increments of constant indexes so they can be
+    // combined.
+    ConstantInt* const_idx = dyn_cast<ConstantInt>(idx);
+    ConstantInt* const_inc = dyn_cast<ConstantInt>(increment);
+    if (const_idx != NULL && const_inc != NULL) {
+      defer_increment(global_var, true, const_idx->getZExtValue(), const_inc->getZExtValue());
+      return;
+    }
+    bb_has_dynamic_increments = true;
+
     // %1 = load i64** @<global_var>, align 8
     LoadInst* load_array = new LoadInst(global_var, "garray", false, insert_before);
     load_array->setAlignment(8);
@@ -360,11 +558,80 @@ namespace bytesflops_pass {
     return string_argument;
   }
 
+  // Map a function name to a module-local function ID, assigning the
+  // next available ID to each new function name.
+  uint64_t BytesFlops::assign_func_id (Module* module, StringRef funcname) {
+    StringMap<uint64_t>::iterator id_iter = func_name_to_id.find(funcname);
+    if (id_iter != func_name_to_id.end())
+      return id_iter->second;
+    uint64_t local_id = func_table.size();
+    func_name_to_id[funcname] = local_id;
+    func_table.push_back(map_func_name_to_arg(module, funcname));
+    return local_id;
+  }
+
+  // Map a function name to a program-wide function ID, which the
+  // run-time library uses as an index into a flat array.  Each module
+  // numbers its functions from zero; the module's constructor learns
+  // at run time where those IDs begin in the program-wide table.
+  Value* BytesFlops::map_func_name_to_id (Module* module, StringRef funcname,
+                                          Instruction* insert_before) {
+    uint64_t local_id = assign_func_id(module, funcname);
+
+    // Define a variable to hold the module's base function ID the
+    // first time we need it.
+    LLVMContext& globctx = module->getContext();
+    if (func_id_base_var == NULL)
+      func_id_base_var =
+        new GlobalVariable(*module, Type::getInt64Ty(globctx), false,
+                           GlobalValue::PrivateLinkage, zero, "bf_func_id_base");
+
+    // Add the module-local ID to the base ID.
+    LoadInst* base_id = new LoadInst(func_id_base_var, "base_id", false, insert_before);
+    return BinaryOperator::Create(Instruction::Add, base_id,
+                                  ConstantInt::get(globctx, APInt(64, local_id)),
+                                  "func_id", insert_before);
+  }
+
+  // Assign a memory instruction a program-wide site ID.  Like
+  // function IDs, site IDs are numbered from zero within each module,
+  // and the module's constructor learns at run time where they begin.
+  // Each site is described by its source location and function.
+  Value* BytesFlops::map_inst_to_site_id (Module* module, StringRef funcname,
+                                          Instruction& inst,
+                                          Instruction* insert_before) {
+    // Describe the instruction's location as "file:line function".
+    DILocation location(inst.getMetadata("dbg"));
+    string site_str;
+    if (location.getFilename().empty())
+      site_str = "??";
+    else
+      site_str = location.getFilename().str();
+    site_str += ':' + to_string(location.getLineNumber()) + ' ' + funcname.str();
+    uint64_t local_id = site_table.size();
+    site_table.push_back(map_func_name_to_arg(module, site_str));
+
+    // Define a variable to hold the module's base site ID the first
+    // time we need it.
+    LLVMContext& globctx = module->getContext();
+    if (site_id_base_var == NULL)
+      site_id_base_var =
+        new GlobalVariable(*module, Type::getInt64Ty(globctx), false,
+                           GlobalValue::PrivateLinkage, zero, "bf_site_id_base");
+
+    // Add the module-local ID to the base ID.
+    LoadInst* base_id = new LoadInst(site_id_base_var, "site_base_id", false, insert_before);
+    return BinaryOperator::Create(Instruction::Add, base_id,
+                                  ConstantInt::get(globctx, APInt(64, local_id)),
+                                  "site_id", insert_before);
+  }
+
   // Declare an external variable.
   GlobalVariable* BytesFlops::declare_global_var(Module& module,
                                                  Type* var_type,
                                                  StringRef var_name,
-                                                 bool is_const) {
+                                                 bool is_const,
+                                                 bool is_thread_local) {
     // Don't declare the same variable twice in a single module.
     GlobalVariable* oldvar = module.getGlobalVariable(var_name);
     if (oldvar)
@@ -372,7 +639,10 @@ namespace bytesflops_pass {
     else
       return new GlobalVariable(module, var_type, is_const,
                                 GlobalVariable::ExternalLinkage, 0,
-                                var_name, 0, GlobalVariable::NotThreadLocal);
+                                var_name, 0,
+                                is_thread_local
+                                ? GlobalVariable::GeneralDynamicTLSModel
+                                : GlobalVariable::NotThreadLocal);
   }
 
   // Insert code to set every element of a given array to zero.
@@ -441,6 +711,14 @@ namespace bytesflops_pass {
                            ConstantInt::get(globctx, APInt(64, BF_END_BB_ANY)),
                            one);
 
+    // Apply all of the basic block's counter increments at once.  In
+    // -bf-bb-freq mode, instead record them in a static table and
+    // merely count the basic block's execution.
+    if (BBFrequencies)
+      record_bb_static_counts(module, function_name, insert_before);
+    else
+      flush_pending_increments(insert_before);
+
     // If we're instrumenting every basic block, insert calls to
     // bf_accumulate_bb_tallies() and bf_report_bb_tallies().
     if (InstrumentEveryBB) {
@@ -450,14 +728,18 @@ namespace bytesflops_pass {
 
     // If we're instrumenting by function, insert a call to
     // bf_assoc_counters_with_func() at the end of the basic block.
-    if (TallyByFunction) {
+    // In -bf-bb-freq mode this is necessary only for counters that
+    // the basic block increments by a run-time value.
+    bool assoc_counters =
+      TallyByFunction && (!BBFrequencies || bb_has_dynamic_increments);
+    if (assoc_counters) {
       vector<Value*> arg_list;
-      arg_list.push_back(map_func_name_to_arg(module, function_name));
+      arg_list.push_back(map_func_name_to_id(module, function_name, insert_before));
       callinst_create(assoc_counts_with_func, arg_list, insert_before);
     }
 
     // Reset all of our counter variables.
-    if (InstrumentEveryBB || TallyByFunction) {
+    if (InstrumentEveryBB || assoc_counters) {
       if (must_clear & CLEAR_LOADS) {
         new StoreInst(zero, load_var, false, insert_before);
         new StoreInst(zero, load_inst_var, false, insert_before);
@@ -565,6 +847,14 @@ namespace bytesflops_pass {
     CallInst::Create(function, args, "", insert_before)->setCallingConv(CallingConv::C);
   }
 
+  // Ditto the above but for run-time functions that manipulate state
+  // shared by all threads.
+  void BytesFlops::callinst_create_shared(Value* function, ArrayRef<Value*> args,
+                                          Instruction* insert_before) {
+    bb_uses_shared_state = true;
+    callinst_create(function, args, insert_before);
+  }
+
   // Given a Call instruction, return true if we can safely ignore it.
   bool BytesFlops::ignorable_call (const Instruction* inst) {
     // Ignore debug intrinsics (llvm.dbg.*).
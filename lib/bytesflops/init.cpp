@@ -17,19 +17,23 @@ namespace bytesflops_pass {
     IntegerType* i64type = Type::getInt64Ty(globctx);
     PointerType* i64ptrtype = Type::getInt64PtrTy(globctx);
 
-    mem_insts_var      = declare_global_var(module, i64ptrtype, "bf_mem_insts_count", true);
-    inst_mix_histo_var = declare_global_var(module, i64ptrtype, "bf_inst_mix_histo", true);
-    terminator_var     = declare_global_var(module, i64ptrtype, "bf_terminator_count", true);
-    mem_intrinsics_var = declare_global_var(module, i64ptrtype, "bf_mem_intrin_count", true);
-    load_var       = declare_global_var(module, i64type, "bf_load_count");
-    store_var      = declare_global_var(module, i64type, "bf_store_count");
-    load_inst_var  = declare_global_var(module, i64type, "bf_load_ins_count");
-    store_inst_var = declare_global_var(module, i64type, "bf_store_ins_count");
-    flop_var       = declare_global_var(module, i64type, "bf_flop_count");
-    fp_bits_var    = declare_global_var(module, i64type, "bf_fp_bits_count");
-
-    op_var         = declare_global_var(module, i64type, "bf_op_count");
-    op_bits_var    = declare_global_var(module, i64type, "bf_op_bits_count");
+    // The counters are thread-local so that multithreaded programs can
+    // update them without synchronization.
+    mem_insts_var      = declare_global_var(module, i64ptrtype, "bf_mem_insts_count", true, true);
+    inst_mix_histo_var = declare_global_var(module, i64ptrtype, "bf_inst_mix_histo", true, true);
+    terminator_var     = declare_global_var(module, i64ptrtype, "bf_terminator_count", true, true);
+    mem_intrinsics_var = declare_global_var(module, i64ptrtype, "bf_mem_intrin_count", true, true);
+    load_var       = declare_global_var(module, i64type, "bf_load_count", false, true);
+    store_var      = declare_global_var(module, i64type, "bf_store_count", false, true);
+    load_inst_var  = declare_global_var(module, i64type, "bf_load_ins_count", false, true);
+    store_inst_var = declare_global_var(module, i64type, "bf_store_ins_count", false, true);
+    flop_var       = declare_global_var(module, i64type, "bf_flop_count", false, true);
+    fp_bits_var    = declare_global_var(module, i64type, "bf_fp_bits_count", false, true);
+
+    op_var         = declare_global_var(module, i64type, "bf_op_count", false, true);
+    op_bits_var    = declare_global_var(module, i64type, "bf_op_bits_count", false, true);
+    if (BBFrequencies)
+      bb_freq_var  = declare_global_var(module, i64ptrtype, "bf_bb_freq_counts", true, true);
 
     // Assign a few constant values.
     not_end_of_bb = ConstantInt::get(globctx, APInt(32, 0));
@@ -57,6 +61,21 @@ namespace bytesflops_pass {
     // Assign a value to bf_tally_inst_mix (instruction mix).
     create_global_constant(module, "bf_tally_inst_mix", bool(TallyInstMix));
 
+    // Assign a value to bf_thread_safe.
+    create_global_constant(module, "bf_thread_safe", bool(ThreadSafety));
+
+    // Assign a value to bf_bb_freq.
+    if (BBFrequencies && (InstrumentEveryBB || TrackCallStack))
+      report_fatal_error("-bf-bb-freq is incompatible with -bf-every-bb and -bf-call-stack");
+    create_global_constant(module, "bf_bb_freq", bool(BBFrequencies));
+
+    // Loop-local counters are written back only on loop exit, which
+    // is too late for any mode that reads the counters at the end of
+    // every basic block.
+    if (PromoteLoopCounters && (InstrumentEveryBB || TallyByFunction || BBFrequencies))
+      report_fatal_error("-bf-loop-regs is incompatible with -bf-every-bb, -bf-by-func, and -bf-bb-freq");
+    current_promoted_loop = NULL;
+
     // Assign a value to bf_per_func.
     create_global_constant(module, "bf_per_func", bool(TallyByFunction));
 
@@ -83,12 +102,39 @@ namespace bytesflops_pass {
     // Assign a value to bf_line_size.
     create_global_constant(module, "bf_line_size", uint64_t(CacheLineBytes));
 
-    // Assign a value to bf_dump_cache.
-    create_global_constant(module, "bf_dump_cache", bool(DumpCache));
+    // Assign values to bf_dump_cache and bf_dump_cache_binary.
+    dc_bits = DumpCache.getBits();
+    if ((dc_bits&(1<<DC_DEFAULT)) != 0)
+      dc_bits = (dc_bits&~(1<<DC_DEFAULT)) | (1<<DC_TEXT);
+    create_global_constant(module, "bf_dump_cache", bool((dc_bits&(1<<DC_TEXT)) != 0));
+    create_global_constant(module, "bf_dump_cache_binary", bool((dc_bits&(1<<DC_BINARY)) != 0));
+
+    // Assign a value to bf_cache_exact_distance.
+    if ((CacheExactDist&(CacheExactDist - 1)) != 0)
+      report_fatal_error("-bf-cache-exact-dist must be a power of two");
+    create_global_constant(module, "bf_cache_exact_distance", uint64_t(CacheExactDist));
 
     // Assign a value to bf_max_sets.
     create_global_constant(module, "bf_max_set_bits", uint64_t(CacheMaxSetBits));
 
+    // Assign a value to bf_cache_max_bytes.
+    create_global_constant(module, "bf_cache_max_bytes", uint64_t(CacheMaxBytes));
+
+    // Assign a value to bf_cache_sample_threshold.
+    if (CacheSampleRate <= 0.0 || CacheSampleRate > 1.0)
+      report_fatal_error("-bf-cache-sample must be greater than 0 and at most 1");
+    uint64_t sample_threshold = uint64_t(CacheSampleRate*BF_CACHE_SAMPLE_MODULUS + 0.5);
+    create_global_constant(module, "bf_cache_sample_threshold",
+                           max(sample_threshold, uint64_t(1)));
+
+    // Assign a value to bf_cache_sample_lines.
+    create_global_constant(module, "bf_cache_sample_lines", uint64_t(CacheSampleLines));
+
+    // Assign a value to bf_miss_sites.
+    if (MissSites > 0 && !CacheModel)
+      report_fatal_error("-bf-miss-sites is allowed only in conjunction with -bf-cache-model");
+    create_global_constant(module, "bf_miss_sites", uint64_t(MissSites));
+
     // Create a global string that stores all of our command-line options.
     ifstream cmdline("/proc/self/cmdline");   // Full command line passed to opt
     string bf_cmdline("[failed to read /proc/self/cmdline]");  // Reconstructed command line with -bf-* options only
@@ -138,27 +184,87 @@ namespace bytesflops_pass {
       report_bb_tallies = declare_thunk(&module, "_ZN10bytesflops20bf_report_bb_talliesEv");
     }
 
+    // Functions are identified at run time by a dense integer ID.
+    // Start each module with an empty table of function names.
+    func_name_to_id.clear();
+    func_table.clear();
+    func_id_base_var = NULL;
+
+    // Inject an external declaration for bf_register_func_table().
+    if (TallyByFunction) {
+      vector<Type*> all_function_args;
+      all_function_args.push_back(PointerType::get(PointerType::get(IntegerType::get(globctx, 8), 0), 0));
+      all_function_args.push_back(IntegerType::get(globctx, 64));
+      FunctionType* int_func_result =
+        FunctionType::get(IntegerType::get(globctx, 64), all_function_args, false);
+      register_func_table =
+        declare_extern_c(int_func_result,
+                         "_ZN10bytesflops22bf_register_func_tableEPPKcm",
+                         &module);
+    }
+
+    // With -bf-miss-sites, memory instructions are likewise
+    // identified by a dense integer ID.  Start each module with an
+    // empty table of instruction locations.
+    site_table.clear();
+    site_id_base_var = NULL;
+
+    // Inject an external declaration for bf_register_site_table().
+    if (MissSites > 0) {
+      vector<Type*> all_function_args;
+      all_function_args.push_back(PointerType::get(PointerType::get(IntegerType::get(globctx, 8), 0), 0));
+      all_function_args.push_back(IntegerType::get(globctx, 64));
+      FunctionType* int_func_result =
+        FunctionType::get(IntegerType::get(globctx, 64), all_function_args, false);
+      register_site_table =
+        declare_extern_c(int_func_result,
+                         "_ZN10bytesflops22bf_register_site_tableEPPKcm",
+                         &module);
+    }
+
+    // In -bf-bb-freq mode, basic blocks are likewise identified by a
+    // dense integer ID.  Start each module with an empty table of
+    // basic blocks.
+    bb_static_rows.clear();
+    bb_static_increments.clear();
+    bb_id_base_var = NULL;
+
+    // Inject an external declaration for bf_register_bb_table().
+    if (BBFrequencies) {
+      vector<Type*> all_function_args;
+      all_function_args.push_back(i64ptrtype);
+      all_function_args.push_back(i64type);
+      all_function_args.push_back(i64ptrtype);
+      all_function_args.push_back(i64type);
+      FunctionType* int_func_result =
+        FunctionType::get(i64type, all_function_args, false);
+      register_bb_table =
+        declare_extern_c(int_func_result,
+                         "_ZN10bytesflops20bf_register_bb_tableEPKmmS1_m",
+                         &module);
+    }
+
     // Inject an external declaration for bf_assoc_counters_with_func().
     if (TallyByFunction) {
-      vector<Type*> single_string_arg;
-      single_string_arg.push_back(PointerType::get(IntegerType::get(globctx, 8), 0));
+      vector<Type*> single_int_arg;
+      single_int_arg.push_back(IntegerType::get(globctx, 64));
       FunctionType* void_func_result =
-        FunctionType::get(Type::getVoidTy(globctx), single_string_arg, false);
+        FunctionType::get(Type::getVoidTy(globctx), single_int_arg, false);
       assoc_counts_with_func =
         declare_extern_c(void_func_result,
-                         "_ZN10bytesflops27bf_assoc_counters_with_funcEPKc",
+                         "_ZN10bytesflops27bf_assoc_counters_with_funcEm",
                          &module);
     }
 
     // Inject an external declarations for bf_increment_func_tally().
     if (TallyByFunction) {
-      vector<Type*> single_string_arg;
-      single_string_arg.push_back(PointerType::get(IntegerType::get(globctx, 8), 0));
+      vector<Type*> single_int_arg;
+      single_int_arg.push_back(IntegerType::get(globctx, 64));
       FunctionType* void_func_result =
-        FunctionType::get(Type::getVoidTy(globctx), single_string_arg, false);
+        FunctionType::get(Type::getVoidTy(globctx), single_int_arg, false);
       tally_function =
         declare_extern_c(void_func_result,
-                         "_ZN10bytesflops18bf_incr_func_tallyEPKc",
+                         "_ZN10bytesflops18bf_incr_func_tallyEm",
                          &module);
     }
 
@@ -166,13 +272,13 @@ namespace bytesflops_pass {
     // bf_pop_function().
     if (TallyByFunction && TrackCallStack) {
       // bf_push_function()
-      vector<Type*> single_string_arg;
-      single_string_arg.push_back(PointerType::get(IntegerType::get(globctx, 8), 0));
-      FunctionType* void_str_func_result =
-        FunctionType::get(Type::getVoidTy(globctx), single_string_arg, false);
+      vector<Type*> single_int_arg;
+      single_int_arg.push_back(IntegerType::get(globctx, 64));
+      FunctionType* void_int_func_result =
+        FunctionType::get(Type::getVoidTy(globctx), single_int_arg, false);
       push_function =
-        declare_extern_c(void_str_func_result,
-                         "_ZN10bytesflops16bf_push_functionEPKc",
+        declare_extern_c(void_int_func_result,
+                         "_ZN10bytesflops16bf_push_functionEm",
                          &module);
 
       // bf_pop_function()
@@ -230,16 +336,27 @@ namespace bytesflops_pass {
       }
     }
       
-    // Declare bf_touch_cache() only if we are asked to use it.
+    // Declare bf_touch_cache() only if we are asked to use it.  When
+    // tallying by function or by memory instruction, declare
+    // bf_touch_cache_from() instead so cache misses can be attributed
+    // to the accessing function and instruction.
+    bool attribute_misses = TallyByFunction || MissSites > 0;
     if (CacheModel) {
       vector<Type*> all_function_args;
+      if (attribute_misses) {
+        all_function_args.push_back(PointerType::get(IntegerType::get(globctx, 8), 0));
+        all_function_args.push_back(IntegerType::get(globctx, 64));
+      }
+      all_function_args.push_back(IntegerType::get(globctx, 64));
       all_function_args.push_back(IntegerType::get(globctx, 64));
       all_function_args.push_back(IntegerType::get(globctx, 64));
       FunctionType* void_func_result =
         FunctionType::get(Type::getVoidTy(globctx), all_function_args, false);
       access_cache = 
         declare_extern_c(void_func_result,
-                         "_ZN10bytesflops14bf_touch_cacheEmm",
+                         attribute_misses
+                         ? "_ZN10bytesflops19bf_touch_cache_fromEPKcmmmm"
+                         : "_ZN10bytesflops14bf_touch_cacheEmmm",
                          &module);
     }
 
@@ -289,6 +406,84 @@ namespace bytesflops_pass {
 
   char BytesFlops::ID = 0;
 
+  // Emit the module's table of function names, in -bf-bb-freq mode,
+  // its table of static basic-block counts, and, with -bf-miss-sites,
+  // its table of memory-instruction locations.  Also emit a
+  // constructor that registers the tables with the run-time library
+  // and records the program-wide IDs of the module's first function,
+  // first basic block, and first memory instruction.
+  bool BytesFlops::doFinalization(Module& module) {
+    // Do nothing if the module didn't need any IDs.
+    if (func_table.empty() && bb_static_rows.empty() && site_table.empty())
+      return false;
+
+    // Define a constructor.  Give it a high priority so it runs before
+    // any user constructor can invoke an instrumented function.
+    LLVMContext& globctx = module.getContext();
+    FunctionType* void_func_result =
+      FunctionType::get(Type::getVoidTy(globctx), false);
+    Function* ctor = Function::Create(void_func_result, GlobalValue::InternalLinkage,
+                                      "bf_register_tables", &module);
+    BasicBlock* ctor_body = BasicBlock::Create(globctx, "entry", ctor);
+    vector<Constant*> getelementptr_indices;
+    getelementptr_indices.push_back(zero);
+    getelementptr_indices.push_back(zero);
+
+    // Define the table of function names.  Pass it to
+    // bf_register_func_table() and store the result in
+    // func_id_base_var.
+    Value* func_base_id = zero;
+    if (!func_table.empty()) {
+      ArrayType* table_type = ArrayType::get(Type::getInt8PtrTy(globctx), func_table.size());
+      GlobalVariable* table_var =
+        new GlobalVariable(module, table_type, true, GlobalValue::PrivateLinkage,
+                           ConstantArray::get(table_type, func_table), "bf_func_table");
+      vector<Value*> arg_list;
+      arg_list.push_back(ConstantExpr::getGetElementPtr(table_var, getelementptr_indices));
+      arg_list.push_back(ConstantInt::get(globctx, APInt(64, func_table.size())));
+      func_base_id = CallInst::Create(register_func_table, arg_list, "base_id", ctor_body);
+      new StoreInst(func_base_id, func_id_base_var, false, ctor_body);
+    }
+
+    // Define the tables of static basic-block counts.  Pass them to
+    // bf_register_bb_table() and store the result in bb_id_base_var.
+    if (!bb_static_rows.empty()) {
+      Constant* rows = ConstantDataArray::get(globctx, ArrayRef<uint64_t>(bb_static_rows));
+      GlobalVariable* rows_var =
+        new GlobalVariable(module, rows->getType(), true, GlobalValue::PrivateLinkage,
+                           rows, "bf_bb_table");
+      Constant* increments = ConstantDataArray::get(globctx, ArrayRef<uint64_t>(bb_static_increments));
+      GlobalVariable* increments_var =
+        new GlobalVariable(module, increments->getType(), true, GlobalValue::PrivateLinkage,
+                           increments, "bf_bb_increments");
+      vector<Value*> arg_list;
+      arg_list.push_back(ConstantExpr::getGetElementPtr(rows_var, getelementptr_indices));
+      arg_list.push_back(ConstantInt::get(globctx, APInt(64, bb_static_rows.size()/3)));
+      arg_list.push_back(ConstantExpr::getGetElementPtr(increments_var, getelementptr_indices));
+      arg_list.push_back(func_base_id);
+      CallInst* bb_base_id = CallInst::Create(register_bb_table, arg_list, "bb_base_id", ctor_body);
+      new StoreInst(bb_base_id, bb_id_base_var, false, ctor_body);
+    }
+
+    // Define the table of memory-instruction locations.  Pass it to
+    // bf_register_site_table() and store the result in
+    // site_id_base_var.
+    if (!site_table.empty()) {
+      ArrayType* table_type = ArrayType::get(Type::getInt8PtrTy(globctx), site_table.size());
+      GlobalVariable* table_var =
+        new GlobalVariable(module, table_type, true, GlobalValue::PrivateLinkage,
+                           ConstantArray::get(table_type, site_table), "bf_site_table");
+      vector<Value*> arg_list;
+      arg_list.push_back(ConstantExpr::getGetElementPtr(table_var, getelementptr_indices));
+      arg_list.push_back(ConstantInt::get(globctx, APInt(64, site_table.size())));
+      CallInst* site_base_id = CallInst::Create(register_site_table, arg_list, "site_base_id", ctor_body);
+      new StoreInst(site_base_id, site_id_base_var, false, ctor_body);
+    }
+    ReturnInst::Create(globctx, ctor_body);
+    appendToGlobalCtors(module, ctor, 0);
+    return true;
+  }
+
   // Insert code for incrementing our byte, flop, etc. counters.
   bool BytesFlops::runOnFunction(Function& function) {
     // Do nothing if we're supposed to ignore this function.
@@ -154,21 +154,34 @@ namespace bytesflops_pass {
         arg_list.push_back(map_func_name_to_arg(module, function_name));
         arg_list.push_back(mem_addr);
         arg_list.push_back(num_bytes);
-        callinst_create(assoc_addrs_with_func, arg_list, insert_before);
+        callinst_create_shared(assoc_addrs_with_func, arg_list, insert_before);
       }
 
       // Unconditionally insert a call to bf_assoc_addresses_with_prog().
       vector<Value*> arg_list;
       arg_list.push_back(mem_addr);
       arg_list.push_back(num_bytes);
-      callinst_create(assoc_addrs_with_prog, arg_list, insert_before);
+      callinst_create_shared(assoc_addrs_with_prog, arg_list, insert_before);
     }
 
-    // Conditionally insert a call to bf_touch_cache()
+    // Conditionally insert a call to bf_touch_cache() or, if misses
+    // are attributed to functions or instructions,
+    // bf_touch_cache_from().
     if (CacheModel) {
       vector<Value*> arg_list;
+      if (TallyByFunction || MissSites > 0) {
+        if (TallyByFunction)
+          arg_list.push_back(map_func_name_to_arg(module, function_name));
+        else
+          arg_list.push_back(ConstantPointerNull::get(Type::getInt8PtrTy(bbctx)));
+        if (MissSites > 0)
+          arg_list.push_back(map_inst_to_site_id(module, function_name, inst, insert_before));
+        else
+          arg_list.push_back(ConstantInt::get(bbctx, APInt(64, BF_NO_MISS_SITE)));
+      }
       arg_list.push_back(mem_addr);
       arg_list.push_back(num_bytes);
+      arg_list.push_back(ConstantInt::get(bbctx, APInt(64, opcode == Instruction::Load ? BF_OP_LOAD : BF_OP_STORE)));
       callinst_create(access_cache, arg_list, insert_before);
     }
 
@@ -179,7 +192,7 @@ namespace bytesflops_pass {
       vector<Value*> arg_list;
       arg_list.push_back(mem_addr);
       arg_list.push_back(num_bytes);
-      callinst_create(reuse_dist_prog, arg_list, insert_before);
+      callinst_create_shared(reuse_dist_prog, arg_list, insert_before);
     }
   }
 
@@ -221,7 +234,7 @@ namespace bytesflops_pass {
     // functions.
     if (TallyByFunction) {
       string augmented_callee_name(string("+") + callee_name.str());
-      Constant* argument = map_func_name_to_arg(module, StringRef(augmented_callee_name));
+      Value* argument = map_func_name_to_id(module, StringRef(augmented_callee_name), insert_before);
       callinst_create(tally_function, argument, insert_before);
     }
   }
@@ -360,7 +373,7 @@ namespace bytesflops_pass {
         arg_list.push_back(get_vector_length(bbctx, vt, one));
         arg_list.push_back(ConstantInt::get(bbctx, APInt(64, total_bits/elt_count)));
         arg_list.push_back(ConstantInt::get(bbctx, APInt(8, 1)));
-        callinst_create(tally_vector, arg_list, insert_before);
+        callinst_create_shared(tally_vector, arg_list, insert_before);
       }
       while (0);
   }
@@ -369,7 +382,7 @@ namespace bytesflops_pass {
   // instructions in each inner loop.
   void BytesFlops::instrument_inner_loop(BasicBlock& bb) {
     // Ensure that the basic block is within an inner loop.
-    static LoopInfo* li = &getAnalysis<LoopInfo>();
+    LoopInfo* li = &getAnalysis<LoopInfo>();
     Loop* loop = li->getLoopFor(&bb);
     if (loop == NULL)
       return;   // Basic block is not within a loop.
@@ -425,6 +438,110 @@ namespace bytesflops_pass {
     loop_len[location_str] += real_insts;
   }
 
+  // Return the innermost loop containing a basic block if the loop's
+  // counters can be kept in registers, otherwise NULL.  This requires
+  // that the loop have a preheader in which to initialize the counters
+  // and that we be able to insert code on every exit edge.
+  Loop* BytesFlops::promotable_loop(BasicBlock& bb) {
+    if (!PromoteLoopCounters)
+      return NULL;
+    Loop* loop = getAnalysis<LoopInfo>().getLoopFor(&bb);
+    if (loop == NULL || loop->getSubLoops().size() > 0)
+      return NULL;
+    map<Loop*, bool>::iterator lp_iter = loop_is_promotable.find(loop);
+    if (lp_iter != loop_is_promotable.end())
+      return lp_iter->second ? loop : NULL;
+    bool promotable = loop->getLoopPreheader() != NULL;
+    SmallVector<Loop::Edge, 8> exit_edges;
+    loop->getExitEdges(exit_edges);
+    for (SmallVector<Loop::Edge, 8>::iterator ee_iter = exit_edges.begin();
+         promotable && ee_iter != exit_edges.end();
+         ee_iter++) {
+      const BasicBlock* from = ee_iter->first;
+      const BasicBlock* to = ee_iter->second;
+      if (to->isLandingPad())
+        promotable = false;   // We can't split an edge to a landing pad.
+      else if (isa<IndirectBrInst>(from->getTerminator()) && to->getUniquePredecessor() != from)
+        promotable = false;   // We can't split an indirect branch's edges.
+    }
+    loop_is_promotable[loop] = promotable;
+    return promotable ? loop : NULL;
+  }
+
+  // Initialize each loop-local counter to zero in its loop's
+  // preheader, add it to the corresponding global counter on every
+  // exit from the loop, and finally promote all of the loop-local
+  // counters to registers.
+  void BytesFlops::promote_loop_counters(Function& function) {
+    vector<AllocaInst*> local_vars;
+    for (map<Loop*, vector<promoted_counter_t> >::iterator pl_iter = promoted_counters.begin();
+         pl_iter != promoted_counters.end();
+         pl_iter++) {
+      Loop* loop = pl_iter->first;
+      vector<promoted_counter_t>& counters = pl_iter->second;
+
+      // Zero each counter in the preheader.
+      Instruction* preheader_end = loop->getLoopPreheader()->getTerminator();
+      for (vector<promoted_counter_t>::iterator pc_iter = counters.begin();
+           pc_iter != counters.end();
+           pc_iter++) {
+        new StoreInst(zero, pc_iter->local_var, false, preheader_end);
+        local_vars.push_back(pc_iter->local_var);
+      }
+
+      // Write back each counter on each exit edge.  The code goes at
+      // the top of the exit block if the loop is its only predecessor,
+      // at the bottom of the exiting block if the exit block is its
+      // only successor, and otherwise in a new block that splits the
+      // edge.
+      SmallVector<Loop::Edge, 8> exit_edges;
+      loop->getExitEdges(exit_edges);
+      set<Loop::Edge> seen_edges;
+      for (SmallVector<Loop::Edge, 8>::iterator ee_iter = exit_edges.begin();
+           ee_iter != exit_edges.end();
+           ee_iter++) {
+        if (!seen_edges.insert(*ee_iter).second)
+          continue;   // A switch can have multiple edges to the same block.
+        BasicBlock* from = const_cast<BasicBlock*>(ee_iter->first);
+        BasicBlock* to = const_cast<BasicBlock*>(ee_iter->second);
+        TerminatorInst* from_term = from->getTerminator();
+        Instruction* insert_before;
+        if (to->getUniquePredecessor() == from)
+          insert_before = to->getFirstInsertionPt();
+        else if (from_term->getNumSuccessors() == 1)
+          insert_before = from_term;
+        else {
+          unsigned int succ_num = 0;
+          while (from_term->getSuccessor(succ_num) != to)
+            succ_num++;
+          BasicBlock* edge_bb = SplitCriticalEdge(from_term, succ_num, NULL, true);
+          insert_before = edge_bb->getTerminator();
+        }
+        map<Constant*, LoadInst*> array_base;   // Array pointers already loaded
+        for (vector<promoted_counter_t>::iterator pc_iter = counters.begin();
+             pc_iter != counters.end();
+             pc_iter++) {
+          LoadInst* load_local = new LoadInst(pc_iter->local_var, "lvar", false, insert_before);
+          add_to_counter(pc_iter->global_var, pc_iter->is_array, pc_iter->idx,
+                         load_local, array_base, insert_before);
+        }
+      }
+    }
+    if (local_vars.size() == 0)
+      return;
+
+    // Allocate the counters in the entry block then let mem2reg turn
+    // them into SSA values.
+    Instruction* entry_inst = function.front().begin();
+    for (vector<AllocaInst*>::iterator lv_iter = local_vars.begin();
+         lv_iter != local_vars.end();
+         lv_iter++)
+      (*lv_iter)->insertBefore(entry_inst);
+    DominatorTree dom_tree;
+    dom_tree.recalculate(function);
+    PromoteMemToReg(local_vars, dom_tree);
+  }
+
   // Do most of the instrumentation work: Walk each instruction in
   // each basic block and add instrumentation code around loads,
   // stores, flops, etc.
@@ -436,6 +553,8 @@ namespace bytesflops_pass {
 
     // Reset the per-function list of inner loops.
     loop_len.clear();
+    promoted_counters.clear();
+    loop_is_promotable.clear();
 
     // Iterate over each basic block in turn.
     for (Function::iterator func_iter = function.begin();
@@ -449,17 +568,17 @@ namespace bytesflops_pass {
       terminator_inst--;
       int must_clear = 0;   // Keep track of which counters we need to clear.
 
-      // If the current basic block belongs to an inner loop, instrument it.
+      // If the current basic block belongs to an inner loop, instrument
+      // it and determine if its counters can be kept in registers.
       instrument_inner_loop(bb);
+      current_promoted_loop = promotable_loop(bb);
 
       // Insert an "unreachable" instruction as a sentinel before the
       // real terminator instruction.  New code is inserted before the
       // real terminator, and instrumentation stops at the sentinel.
       Instruction* unreachable = new UnreachableInst(bbctx, terminator_inst);
-
-      // Acquire the mega-lock before inserting any instrumentation code.
-      if (ThreadSafety)
-        callinst_create(take_mega_lock, terminator_inst);
+      bb_uses_shared_state = false;
+      bb_has_dynamic_increments = false;
 
       // Iterate over the basic block's instructions one-by-one until
       // we reach the sentinal.
@@ -504,13 +623,26 @@ namespace bytesflops_pass {
         instrument_all(module, function_name, inst, bbctx, terminator_inst, must_clear);
       }
 
-      // Add one last bit of code then release the mega-lock and elide
-      // the sentinel terminator.
+      // Add one last bit of code then elide the sentinel terminator.
+      // Counter updates touch only thread-local variables, so the
+      // mega-lock is needed only if the basic block calls a run-time
+      // function that manipulates state shared by all threads.  In
+      // that case, wrap all of the instrumentation code -- which lies
+      // between the sentinel and the terminator -- in the mega-lock.
       insert_end_bb_code(module, function_name, must_clear, terminator_inst);
-      if (ThreadSafety)
+      if (ThreadSafety && bb_uses_shared_state) {
+        BasicBlock::iterator first_inst = unreachable;
+        first_inst++;
+        callinst_create(take_mega_lock, first_inst);
         callinst_create(release_mega_lock, terminator_inst);
+      }
       unreachable->eraseFromParent();
     }  // Ends the loop over basic blocks within the function
+    current_promoted_loop = NULL;
+
+    // Write back and register-promote the counters of all loops that
+    // accumulated counters locally.
+    promote_loop_counters(function);
 
     // Insert a call to bf_initialize_if_necessary() at the
     // beginning of the function.  Also insert a call to
@@ -521,13 +653,13 @@ namespace bytesflops_pass {
     BasicBlock& old_entry = function.front();
     BasicBlock* new_entry =
       BasicBlock::Create(func_ctx, "bf_entry", &function, &old_entry);
-    callinst_create(init_if_necessary, new_entry);
+    BranchInst* entry_branch = BranchInst::Create(&old_entry, new_entry);
+    callinst_create(init_if_necessary, entry_branch);
     if (TallyByFunction) {
       Function* entry_func = TrackCallStack ? push_function : tally_function;
-      Constant* argument = map_func_name_to_arg(module, function_name);
-      callinst_create(entry_func, argument, new_entry);
+      Value* argument = map_func_name_to_id(module, function_name, entry_branch);
+      callinst_create(entry_func, argument, entry_branch);
     }
-    BranchInst::Create(&old_entry, new_entry);
   }
 
 } // namespace bytesflops_pass
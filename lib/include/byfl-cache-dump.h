@@ -0,0 +1,176 @@
+/*
+ * Binary cache-model dump format, written by the helper library and
+ * read by post-processing tools
+ */
+
+#ifndef _BYFL_CACHE_DUMP_H_
+#define _BYFL_CACHE_DUMP_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A binary cache dump (-bf-dump-cache=binary) holds the same data as
+// a text dump in a form that can be mapped directly into memory.
+// Every field is a 64-bit integer in the byte order of the machine
+// that wrote the dump.  The file consists of
+//
+//   1. a bf_cache_dump_header_t,
+//   2. num_histograms bf_cache_dump_index_t entries, the ith of which
+//      locates the hit histogram for a cache with 2^i sets, and
+//   3. the histograms themselves, each an array of hit counts indexed
+//      by bin (see bf_cache_distance_to_bin()).
+#define BF_CACHE_DUMP_MAGIC "BYFLCDMP"
+#define BF_CACHE_DUMP_VERSION 1
+
+typedef struct {
+  char magic[8];              // BF_CACHE_DUMP_MAGIC without the trailing NUL
+  uint64_t version;           // BF_CACHE_DUMP_VERSION
+  uint64_t accesses;          // Total cache accesses
+  uint64_t cold_misses;       // Accesses to lines never seen before
+  uint64_t split_accesses;    // Accesses that touched more than one line
+  uint64_t line_size;         // Cache-line size in bytes
+  uint64_t capacity_misses;   // Accesses to lines evicted from tracking
+  uint64_t sample_threshold;  // Lines modeled per sample_modulus lines
+  uint64_t sample_modulus;    // Denominator of the sampling rate
+  uint64_t sampled_lines;     // Distinct lines modeled
+  uint64_t exact_distance;    // Largest reuse distance with a bin of its own (0=all)
+  uint64_t num_histograms;    // Number of set counts modeled
+} bf_cache_dump_header_t;
+
+typedef struct {
+  uint64_t offset;            // Byte offset of the histogram from the start of the file
+  uint64_t bins;              // Number of bins in the histogram
+} bf_cache_dump_index_t;
+
+// Map a reuse distance to a histogram bin.  Each distance up to
+// exact_distance, which must be a power of two, has a bin of its own.
+// Larger distances are binned by powers of two: distance d shares a
+// bin with all distances in (2^(k-1), 2^k], where 2^(k-1) < d <= 2^k.
+// An exact_distance of 0 gives every distance a bin of its own.
+static inline uint64_t
+bf_cache_distance_to_bin(uint64_t distance, uint64_t exact_distance)
+{
+  if (exact_distance == 0 || distance <= exact_distance)
+    return distance;
+  uint64_t ceil_log2_distance = 64 - __builtin_clzll(distance - 1);
+  uint64_t log2_exact = 63 - __builtin_clzll(exact_distance);
+  return exact_distance + ceil_log2_distance - log2_exact;
+}
+
+// Map a histogram bin to the largest reuse distance it counts.
+static inline uint64_t
+bf_cache_bin_to_distance(uint64_t bin, uint64_t exact_distance)
+{
+  if (exact_distance == 0 || bin <= exact_distance)
+    return bin;
+  return exact_distance << (bin - exact_distance);
+}
+
+// Read a binary cache dump by mapping it into memory.
+class CacheDumpReader {
+public:
+  CacheDumpReader() : base(NULL), length(0) {}
+  ~CacheDumpReader() { close(); }
+
+  // Map a dump into memory.  Return an empty string on success or a
+  // description of the problem on failure.
+  std::string open (const char* filename) {
+    close();
+    int fd = ::open(filename, O_RDONLY);
+    if (fd == -1)
+      return std::string("failed to open ") + filename + ": " + strerror(errno);
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+      std::string problem = std::string("failed to stat ") + filename + ": " + strerror(errno);
+      ::close(fd);
+      return problem;
+    }
+    length = info.st_size;
+    void* mapping = length == 0 ? MAP_FAILED : mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+      length = 0;
+      return std::string("failed to map ") + filename + " into memory";
+    }
+    base = (const char*) mapping;
+
+    // Validate the header and the index.
+    std::string problem;
+    const bf_cache_dump_header_t& hdr = header();
+    if (length < sizeof(bf_cache_dump_header_t)
+        || memcmp(hdr.magic, BF_CACHE_DUMP_MAGIC, sizeof(hdr.magic)) != 0)
+      problem = std::string(filename) + " is not a Byfl binary cache dump";
+    else if (hdr.version != BF_CACHE_DUMP_VERSION)
+      problem = std::string(filename) + " has an unsupported cache-dump version";
+    else if (hdr.num_histograms > (length - sizeof(bf_cache_dump_header_t))/sizeof(bf_cache_dump_index_t))
+      problem = std::string(filename) + " is truncated";
+    else
+      for (uint64_t i = 0; i < hdr.num_histograms; i++) {
+        const bf_cache_dump_index_t& entry = index()[i];
+        if (entry.offset % sizeof(uint64_t) != 0
+            || entry.offset > length
+            || entry.bins > (length - entry.offset)/sizeof(uint64_t)) {
+          problem = std::string(filename) + " is truncated";
+          break;
+        }
+      }
+    if (!problem.empty())
+      close();
+    return problem;
+  }
+
+  // Unmap the dump.
+  void close (void) {
+    if (base != NULL)
+      munmap((void*) base, length);
+    base = NULL;
+    length = 0;
+  }
+
+  // Return the dump's header.
+  const bf_cache_dump_header_t& header (void) const {
+    return *(const bf_cache_dump_header_t*) base;
+  }
+
+  // Return the number of bins in the histogram for a cache with
+  // 2^set_bits sets.
+  uint64_t bins (uint64_t set_bits) const {
+    return index()[set_bits].bins;
+  }
+
+  // Return the histogram for a cache with 2^set_bits sets.
+  const uint64_t* histogram (uint64_t set_bits) const {
+    return (const uint64_t*) (base + index()[set_bits].offset);
+  }
+
+  // Return the largest reuse distance counted by a given bin.
+  uint64_t distance (uint64_t bin) const {
+    return bf_cache_bin_to_distance(bin, header().exact_distance);
+  }
+
+  // Return the number of hits in a cache with 2^set_bits sets and
+  // the given number of ways.
+  uint64_t hits (uint64_t set_bits, uint64_t ways) const {
+    const uint64_t* counts = histogram(set_bits);
+    uint64_t total = 0;
+    for (uint64_t bin = 0; bin < bins(set_bits) && distance(bin) <= ways; bin++)
+      total += counts[bin];
+    return total;
+  }
+
+private:
+  const char* base;     // Start of the mapped file
+  size_t length;        // Length in bytes of the mapped file
+
+  const bf_cache_dump_index_t* index (void) const {
+    return (const bf_cache_dump_index_t*) (base + sizeof(bf_cache_dump_header_t));
+  }
+};
+
+#endif
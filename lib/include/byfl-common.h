@@ -65,6 +65,33 @@ enum {
   BF_NUM_MEM_INTRIN
 };
 
+// Identify a counter in the static basic-block tables used by
+// -bf-bb-freq.  Scalar counters come first, followed by the elements
+// of each counter array.
+enum {
+  BF_BBF_LOADS,        // Bytes loaded
+  BF_BBF_STORES,       // Bytes stored
+  BF_BBF_LOAD_INS,     // Load instructions
+  BF_BBF_STORE_INS,    // Store instructions
+  BF_BBF_FLOPS,        // Floating-point operations
+  BF_BBF_FP_BITS,      // Bits consumed or produced by floating-point operations
+  BF_BBF_OPS,          // Operations of any type
+  BF_BBF_OP_BITS,      // Bits consumed or produced by operations
+  BF_BBF_TERMINATORS,  // First element of bf_terminator_count[]
+  BF_BBF_MEM_INTRIN = BF_BBF_TERMINATORS + BF_END_BB_NUM,   // First element of bf_mem_intrin_count[]
+  BF_BBF_MEM_INSTS = BF_BBF_MEM_INTRIN + BF_NUM_MEM_INTRIN, // First element of bf_mem_insts_count[]
+  BF_BBF_INST_MIX = BF_BBF_MEM_INSTS + NUM_MEM_INSTS        // First element of bf_inst_mix_histo[]
+};
+
+// The cache model samples a cache line if a hash of its line number,
+// which lies in [0, BF_CACHE_SAMPLE_MODULUS), is less than
+// bf_cache_sample_threshold.
+#define BF_CACHE_SAMPLE_MODULUS (1 << 24)
+
+// Site ID passed to bf_touch_cache_from() when memory instructions
+// aren't being tracked
+#define BF_NO_MISS_SITE (~UINT64_C(0))
+
 // Map a memory-access type to an index into bf_mem_insts_count[].
 static inline uint64_t
 mem_type_to_index(uint64_t memop,